@@ -56,5 +56,22 @@ namespace BasicDriverUnitTest
 			Assert::IsNotNull(pDevice);
 			Assert::IsTrue(pFile->DeviceObject == pDevice);
 		}
+
+		// Reset driver globals to their state after DriverEntry
+
+		TEST_METHOD(BasicDriverResetState)
+		{
+			PDRIVER_OBJECT *ppDriver = (PDRIVER_OBJECT *)DdkFindFunction("DcsBasic!pDriverObject");
+
+			Assert::IsNotNull(ppDriver);
+			PDRIVER_OBJECT pDriver = *ppDriver;
+			Assert::IsNotNull(pDriver);
+
+			for (int i = 0; i < 2; i++) {
+				*ppDriver = NULL;
+				Assert::IsTrue(DdkResetDriverState("DcsBasic") == STATUS_SUCCESS);
+				Assert::IsTrue(*ppDriver == pDriver);
+			}
+		}
 	};
 }
@@ -70,8 +70,10 @@ extern "C" {
  */
 
 #ifndef _DDKINLINE_
+DDKAPI extern ULONG64 DdkSharedUserData;
+
 #undef KI_USER_SHARED_DATA
-#define KI_USER_SHARED_DATA 0x7FFE0000UI64
+#define KI_USER_SHARED_DATA DdkSharedUserData
 #endif
 
 
@@ -28,6 +28,8 @@ typedef CCHAR KPROCESSOR_MODE;
 typedef unsigned char KIRQL, *PKIRQL;
 typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
 typedef volatile LONG EX_SPIN_LOCK, *PEX_SPIN_LOCK;
+typedef ULONG_PTR ERESOURCE_THREAD, *PERESOURCE_THREAD;
+typedef ULONG_PTR EX_PUSH_LOCK, *PEX_PUSH_LOCK;
 typedef struct _OBJECT_TYPE OBJECT_TYPE, *POBJECT_TYPE;
 
 
@@ -40,7 +42,7 @@ typedef enum { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
 typedef enum { NotificationTimer, SynchronizationTimer } TIMER_TYPE;
 typedef enum { LowImportance, MediumImportance, HighImportance, MediumHighImportance } KDPC_IMPORTANCE;
 typedef enum { CriticalWorkQueue, DelayedWorkQueue, HyperCriticalWorkQueue, MaximumWorkQueue } WORK_QUEUE_TYPE;
-typedef enum { Executive, Suspended = 5, UserRequest, } KWAIT_REASON;
+typedef enum { Executive, Suspended = 5, UserRequest, WrQueue = 15, } KWAIT_REASON;
 typedef enum { NonPagedPool, PagedPool } POOL_TYPE;
 typedef enum { LowPoolPriority, NormalPoolPriority = 16 } EX_POOL_PRIORITY;
 typedef enum { KernelMode, UserMode } MODE;
@@ -61,6 +63,11 @@ typedef struct _KSEMAPHORE KSEMAPHORE, *PKSEMAPHORE, *PRKSEMAPHORE;
 typedef struct _KWAIT_BLOCK KWAIT_BLOCK, *PKWAIT_BLOCK, *PRKWAIT_BLOCK;
 typedef struct _CLIENT_ID CLIENT_ID, *PCLIENT_ID;
 typedef struct _KTIMER KTIMER, *PKTIMER, *PRKTIMER;
+typedef struct _KQUEUE KQUEUE, *PKQUEUE, *PRKQUEUE;
+typedef struct _ERESOURCE ERESOURCE, *PERESOURCE;
+typedef struct _FAST_MUTEX FAST_MUTEX, *PFAST_MUTEX, KGUARDED_MUTEX, *PKGUARDED_MUTEX;
+typedef struct _EX_RUNDOWN_REF EX_RUNDOWN_REF, *PEX_RUNDOWN_REF;
+typedef struct _EX_RUNDOWN_REF_CACHE_AWARE *PEX_RUNDOWN_REF_CACHE_AWARE;
 typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
 typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
 typedef struct _FILE_OBJECT FILE_OBJECT, *PFILE_OBJECT;
@@ -73,6 +80,8 @@ typedef struct _OBJECT_HANDLE_INFORMATION OBJECT_HANDLE_INFORMATION, *POBJECT_HA
 typedef struct _KEY_VALUE_PARTIAL_INFORMATION KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
 typedef struct _PCI_COMMON_CONFIG PCI_COMMON_CONFIG, *PPCI_COMMON_CONFIG;
 typedef struct _CM_RESOURCE_LIST CM_RESOURCE_LIST, *PCM_RESOURCE_LIST;
+typedef struct _EX_TIMER *PEX_TIMER;
+typedef struct _EXT_CANCEL_PARAMETERS *PEXT_CANCEL_PARAMETERS;
 
 
 /*
@@ -87,8 +96,38 @@ typedef VOID IO_WORKITEM_ROUTINE(PDEVICE_OBJECT, PVOID);
 typedef IO_WORKITEM_ROUTINE *PIO_WORKITEM_ROUTINE;
 typedef VOID IO_WORKITEM_ROUTINE_EX(PVOID, PVOID, PIO_WORKITEM);
 typedef IO_WORKITEM_ROUTINE_EX *PIO_WORKITEM_ROUTINE_EX;
+typedef VOID WORKER_THREAD_ROUTINE(PVOID);
+typedef WORKER_THREAD_ROUTINE *PWORKER_THREAD_ROUTINE;
 typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT, PUNICODE_STRING);
 typedef DRIVER_INITIALIZE *PDRIVER_INITIALIZE;
+typedef VOID EXT_CALLBACK(PEX_TIMER, PVOID);
+typedef EXT_CALLBACK *PEXT_CALLBACK;
+typedef VOID EXT_DELETE_CALLBACK(PVOID);
+typedef EXT_DELETE_CALLBACK *PEXT_DELETE_CALLBACK;
+
+
+/*
+ *	Structure Definitions (must match DDK)
+ */
+
+typedef struct _EXT_SET_PARAMETERS_V0 {
+	ULONG Version;
+	ULONG Reserved;
+	LONGLONG NoWakeTolerance;
+} EXT_SET_PARAMETERS, *PEXT_SET_PARAMETERS;
+
+typedef struct _EXT_DELETE_PARAMETERS {
+	ULONG Version;
+	ULONG Reserved;
+	PEXT_DELETE_CALLBACK DeleteCallback;
+	PVOID DeleteContext;
+} EXT_DELETE_PARAMETERS, *PEXT_DELETE_PARAMETERS;
+
+typedef struct _WORK_QUEUE_ITEM {
+	LIST_ENTRY List;
+	PWORKER_THREAD_ROUTINE WorkerRoutine;
+	volatile PVOID Parameter;
+} WORK_QUEUE_ITEM, *PWORK_QUEUE_ITEM;
 
 
 /*
@@ -99,6 +138,12 @@ typedef DRIVER_INITIALIZE *PDRIVER_INITIALIZE;
 
 #define KeWaitForMutexObject KeWaitForSingleObject
 
+#define EX_TIMER_HIGH_RESOLUTION 0x4
+#define EX_TIMER_NO_WAKE 0x8
+
+#define ExInitializeWorkItem(Item, Routine, Context) \
+	((Item)->WorkerRoutine = (Routine), (Item)->Parameter = (Context), (Item)->List.Flink = NULL)
+
 
 /*
  *	Function Declarations
@@ -107,6 +152,12 @@ typedef DRIVER_INITIALIZE *PDRIVER_INITIALIZE;
 DDKAPI KIRQL KeGetCurrentIrql();
 DDKAPI VOID KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql);
 DDKAPI VOID KeLowerIrql(KIRQL NewIrql);
+DDKAPI VOID KeEnterCriticalRegion();
+DDKAPI VOID KeLeaveCriticalRegion();
+DDKAPI VOID KeEnterGuardedRegion();
+DDKAPI VOID KeLeaveGuardedRegion();
+DDKAPI BOOLEAN KeAreApcsDisabled();
+DDKAPI BOOLEAN KeAreAllApcsDisabled();
 
 DDKAPI NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
     HANDLE ProcessHandle, PCLIENT_ID ClientId, PKSTART_ROUTINE StartRoutine, PVOID StartContext);
@@ -155,8 +206,56 @@ DDKAPI VOID KeInitializeDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOI
 DDKAPI VOID KeInitializeThreadedDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOID DeferredContext);
 DDKAPI BOOLEAN KeInsertQueueDpc(PRKDPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2);
 DDKAPI BOOLEAN KeRemoveQueueDpc(PRKDPC Dpc);
+DDKAPI VOID KeSetImportanceDpc(PRKDPC Dpc, KDPC_IMPORTANCE Importance);
+DDKAPI VOID KeSetTargetProcessorDpc(PRKDPC Dpc, CCHAR Number);
 DDKAPI VOID KeFlushQueuedDpcs(VOID);
 
+DDKAPI PEX_TIMER ExAllocateTimer(PEXT_CALLBACK Callback, PVOID CallbackContext, ULONG Attributes);
+DDKAPI BOOLEAN ExSetTimer(PEX_TIMER Timer, LONGLONG DueTime, LONGLONG Period, PEXT_SET_PARAMETERS Parameters);
+DDKAPI BOOLEAN ExCancelTimer(PEX_TIMER Timer, PEXT_CANCEL_PARAMETERS Parameters);
+DDKAPI BOOLEAN ExDeleteTimer(PEX_TIMER Timer, BOOLEAN Cancel, BOOLEAN Wait, PEXT_DELETE_PARAMETERS Parameters);
+
+DDKAPI VOID ExQueueWorkItem(PWORK_QUEUE_ITEM WorkItem, WORK_QUEUE_TYPE QueueType);
+
+DDKAPI VOID KeInitializeQueue(PRKQUEUE Queue, ULONG Count);
+DDKAPI LONG KeInsertQueue(PRKQUEUE Queue, PLIST_ENTRY Entry);
+DDKAPI LONG KeInsertHeadQueue(PRKQUEUE Queue, PLIST_ENTRY Entry);
+DDKAPI LONG KeReadStateQueue(PRKQUEUE Queue);
+DDKAPI PLIST_ENTRY KeRemoveQueue(PRKQUEUE Queue, KPROCESSOR_MODE WaitMode, PLARGE_INTEGER Timeout);
+DDKAPI ULONG KeRemoveQueueEx(PKQUEUE Queue, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout, PLIST_ENTRY *EntryArray, ULONG Count);
+DDKAPI PLIST_ENTRY KeRundownQueue(PRKQUEUE Queue);
+
+DDKAPI VOID KeInitializeGuardedMutex(PKGUARDED_MUTEX Mutex);
+DDKAPI VOID KeAcquireGuardedMutex(PKGUARDED_MUTEX Mutex);
+DDKAPI BOOLEAN KeTryToAcquireGuardedMutex(PKGUARDED_MUTEX Mutex);
+DDKAPI VOID KeReleaseGuardedMutex(PKGUARDED_MUTEX Mutex);
+DDKAPI VOID ExAcquireFastMutex(PFAST_MUTEX FastMutex);
+DDKAPI BOOLEAN ExTryToAcquireFastMutex(PFAST_MUTEX FastMutex);
+DDKAPI VOID ExReleaseFastMutex(PFAST_MUTEX FastMutex);
+
+DDKAPI NTSTATUS ExInitializeResourceLite(PERESOURCE Resource);
+DDKAPI NTSTATUS ExReinitializeResourceLite(PERESOURCE Resource);
+DDKAPI NTSTATUS ExDeleteResourceLite(PERESOURCE Resource);
+DDKAPI BOOLEAN ExAcquireResourceSharedLite(PERESOURCE Resource, BOOLEAN Wait);
+DDKAPI BOOLEAN ExAcquireResourceExclusiveLite(PERESOURCE Resource, BOOLEAN Wait);
+DDKAPI BOOLEAN ExAcquireSharedStarveExclusive(PERESOURCE Resource, BOOLEAN Wait);
+DDKAPI BOOLEAN ExAcquireSharedWaitForExclusive(PERESOURCE Resource, BOOLEAN Wait);
+DDKAPI VOID ExConvertExclusiveToSharedLite(PERESOURCE Resource);
+DDKAPI VOID ExReleaseResourceLite(PERESOURCE Resource);
+DDKAPI VOID ExReleaseResourceForThreadLite(PERESOURCE Resource, ERESOURCE_THREAD ResourceThreadId);
+DDKAPI BOOLEAN ExIsResourceAcquiredExclusiveLite(PERESOURCE Resource);
+DDKAPI ULONG ExIsResourceAcquiredSharedLite(PERESOURCE Resource);
+DDKAPI ULONG ExGetExclusiveWaiterCount(PERESOURCE Resource);
+DDKAPI ULONG ExGetSharedWaiterCount(PERESOURCE Resource);
+
+DDKAPI VOID ExInitializeRundownProtection(PEX_RUNDOWN_REF RunRef);
+DDKAPI BOOLEAN ExAcquireRundownProtection(PEX_RUNDOWN_REF RunRef);
+DDKAPI VOID ExReleaseRundownProtection(PEX_RUNDOWN_REF RunRef);
+DDKAPI VOID ExWaitForRundownProtectionRelease(PEX_RUNDOWN_REF RunRef);
+DDKAPI SIZE_T ExSizeOfRundownProtectionCacheAware();
+DDKAPI VOID ExInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware, SIZE_T RunRefSize);
+
 DDKAPI NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Interval);
 DDKAPI KPRIORITY KeSetPriorityThread(PKTHREAD Thread, KPRIORITY Priority);
 DDKAPI KPRIORITY KeQueryPriorityThread(PKTHREAD Thread);
@@ -100,10 +100,20 @@
  *	External Definitions
  */
 
+#define DDK_LATENCY_DPC			0
+#define DDK_LATENCY_WORKITEM	1
+#define DDK_LATENCY_TIMER		2
+#define DDK_LATENCY_TYPES		3
+
 extern "C" {
 DDKAPI NTSTATUS DdkLoadDriver(char *pFile, HRESULT (*pLoad)(const char *) = NULL);
 DDKAPI NTSTATUS DdkInitDriver(char *pName, PDRIVER_INITIALIZE DriverInit);
 DDKAPI VOID DdkUnloadDriver(char *pName, INT (*pUnload)(const char *) = NULL);
+DDKAPI NTSTATUS DdkResetDriverState(char *pName);
+DDKAPI NTSTATUS DdkCheckpoint();
+DDKAPI NTSTATUS DdkRestore();
+DDKAPI VOID DdkDiscardCheckpoint();
+DDKAPI NTSTATUS DdkWaitForIdle(PLARGE_INTEGER Timeout = NULL);
 DDKAPI VOID DdkThreadInit();
 DDKAPI VOID DdkThreadDeinit();
 DDKAPI VOID DdkModuleStart(char *pName, void (*cleanup)());
@@ -111,12 +121,29 @@ DDKAPI BOOLEAN DdkModuleEnd(char *pName);
 DDKAPI PKTHREAD DdkGetCurrentThread();
 DDKAPI PVOID DdkFindFunction(const char *pName);
 DDKAPI PVOID DdkCodeFromPointer(PVOID pAddr);
+DDKAPI PVOID DdkPatchImage(PVOID pImage);
+DDKAPI VOID DdkUnpatchImage(PVOID pPatch);
 DDKAPI NTSTATUS DdkAttachIntercept(PVOID pFunction,
 	PVOID pIntercept, PVOID pIdentity, PVOID pInstance, PVOID pThread);
 DDKAPI NTSTATUS DdkDetachIntercept(PVOID pId, PVOID pThread);
 DDKAPI PVOID DdkGetRealPointer();
 DDKAPI void DdkCreateRegistryKey(ULONG RelativeTo, PWSTR Path);
 DDKAPI void DdkDeleteRegistryKey(ULONG RelativeTo, PWSTR Path);
+DDKAPI LONG64 DdkQueryFaultSite(PVOID pAddr);
+DDKAPI VOID DdkReportFaultSites();
+DDKAPI VOID DdkSetSpinLimit(ULONG Spins);
+DDKAPI VOID DdkEnableLockStats(BOOLEAN Enable);
+DDKAPI VOID DdkReportLockStats();
+DDKAPI BOOLEAN DdkQueryLockStats(PVOID Lock, PULONG64 Acquires, PULONG64 Contended, PULONG64 WaitTime, PULONG64 HoldTime);
+DDKAPI ULONG DdkGetResourceContention(PERESOURCE Resource);
+DDKAPI BOOLEAN DdkQueryLatency(PVOID Routine, ULONG Type, ULONG PerMille, PULONG64 Latency, PULONG64 Runtime);
+DDKAPI VOID DdkReportLatency();
+DDKAPI VOID DdkResetLatency();
+DDKAPI NTSTATUS DdkSetWorkQueue(WORK_QUEUE_TYPE QueueType, ULONG MinimumThreads, ULONG MaximumThreads, KPRIORITY Priority);
+DDKAPI BOOLEAN DdkQueryWorkQueue(WORK_QUEUE_TYPE QueueType, PULONG Depth, PULONG MaximumDepth, PULONG Threads, PULONG64 Completed);
+DDKAPI VOID DdkReportWorkQueues();
+DDKAPI VOID DdkEnableVirtualTime(BOOLEAN Enable, BOOLEAN Automatic = FALSE);
+DDKAPI VOID DdkAdvanceVirtualTime(LONG64 Interval);
 };
 
 
@@ -0,0 +1,101 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Checkpoint Routines
+ */
+
+#include "stdafx.h"
+
+
+/*
+ *	A checkpoint captures the emulated environment after an expensive
+ *	fixture setup, such as loading a driver and starting its devices, so
+ *	that each test can start from the same state without repeating it.
+ *	Driver data, devices, the object namespace, the registry hive and the
+ *	local file tree are restored. Devices and names created since the
+ *	checkpoint are removed, and those deleted since are put back, as the
+ *	checkpoint holds a reference on each. Unloading a driver discards the
+ *	checkpoint, which could not bring it back.
+ */
+
+void DdkLoadLock();
+void DdkLoadUnlock();
+void DdkCheckpointImages();
+void DdkRestoreImages();
+void DdkCheckpointDevices();
+void DdkRestoreDevices();
+void DdkDiscardDevices();
+void DdkCheckpointNames();
+void DdkRestoreNames();
+void DdkDiscardNames();
+void DdkCheckpointRegistry();
+void DdkRestoreRegistry();
+void DdkCheckpointFiles();
+void DdkRestoreFiles();
+
+static bool checkpointed = false;
+
+
+DDKAPI
+NTSTATUS DdkCheckpoint()
+{
+	DdkThreadInit();
+
+	DdkLoadLock();
+	DdkCheckpointImages();
+	DdkCheckpointDevices();
+	DdkCheckpointNames();
+	DdkCheckpointRegistry();
+	DdkCheckpointFiles();
+	checkpointed = true;
+	DdkLoadUnlock();
+
+	return STATUS_SUCCESS;
+}
+
+
+DDKAPI
+NTSTATUS DdkRestore()
+{
+	DdkThreadInit();
+
+	DdkLoadLock();
+
+	if (!checkpointed) {
+		DdkLoadUnlock();
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	DdkRestoreNames();
+	DdkRestoreDevices();
+	DdkRestoreImages();
+	DdkRestoreRegistry();
+	DdkRestoreFiles();
+	DdkLoadUnlock();
+
+	return STATUS_SUCCESS;
+}
+
+
+DDKAPI
+VOID DdkDiscardCheckpoint()
+{
+	DdkThreadInit();
+
+	DdkLoadLock();
+
+	if (checkpointed) {
+		DdkDiscardDevices();
+		DdkDiscardNames();
+		checkpointed = false;
+	}
+
+	DdkLoadUnlock();
+}
@@ -27,6 +27,13 @@ extern CCHAR _KeNumberProcessors;
 };
 
 
+static ULONG ProcessorCount = 1;
+
+// Virtual processor plus one, for threads bound to a virtual processor
+
+static __declspec(thread) ULONG DdkCurrentProcessor;
+
+
 void DdkCpuInit()
 {
     SYSTEM_INFO sysinfo;
@@ -34,4 +41,36 @@ void DdkCpuInit()
     
 	KeNumberProcessors = (CCHAR) sysinfo.dwNumberOfProcessors;
 	_KeNumberProcessors = (CCHAR) sysinfo.dwNumberOfProcessors;
+
+	ProcessorCount = min(sysinfo.dwNumberOfProcessors, DDK_MAXIMUM_PROCESSORS);
+}
+
+
+ULONG DdkGetProcessorCount()
+{
+	return ProcessorCount;
+}
+
+
+/*
+ *	ULONG DdkGetCurrentProcessor()
+ *
+ *	DPCs run on threads bound to a virtual processor, so the processor
+ *	number stays constant for the duration of the DPC. Other threads
+ *	report the physical processor they are currently running on.
+ */
+
+ULONG DdkGetCurrentProcessor()
+{
+	if (DdkCurrentProcessor)
+		return DdkCurrentProcessor - 1;
+
+	return GetCurrentProcessorNumber() % ProcessorCount;
+}
+
+
+void DdkSetCurrentProcessor(ULONG Number)
+{
+	DDKASSERT(Number < ProcessorCount);
+	DdkCurrentProcessor = Number + 1;
 }
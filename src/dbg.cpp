@@ -17,21 +17,29 @@
 #include <stddef.h>
 
 
+HMODULE DdkFindModule(PVOID pAddr);
+
+
+static void vDdkPrint(const char *Format, va_list arglist)
+{
+	char s[2048];
+	int n = vsnprintf(s, sizeof(s) - 1, Format, arglist);
+
+	if (n > 0 && n < sizeof(s) - 1 && s[n - 1] != '\n')
+		strcpy(s + n, "\n");
+
+	OutputDebugString(s);
+}
+
+
 DDKAPI
 ULONG vDbgPrintEx(ULONG ComponentId, ULONG Level, PCCH Format, va_list arglist)
 {
 	UNREFERENCED_PARAMETER(ComponentId);
 	UNREFERENCED_PARAMETER(Level);
 
-	if (IsDebuggerPresent()) {
-		char s[2048];
-		int n = vsnprintf(s, sizeof(s) - 1, Format, arglist);
-
-		if (n > 0 && n < sizeof(s) - 1 && s[n - 1] != '\n')
-			strcpy(s + n, "\n");
-
-		OutputDebugString(s);
-	}
+	if (IsDebuggerPresent())
+		vDdkPrint(Format, arglist);
 
 	return 0;
 }
@@ -58,3 +66,32 @@ ULONG DbgPrintEx(ULONG ComponentId, ULONG Level, PCSTR Format, ...)
 	va_end(args);
 	return 0;
 }
+
+
+void DdkPrint(const char *Format, ...)
+{
+	va_list args;
+
+	va_start(args, Format);
+	vDdkPrint(Format, args);
+	va_end(args);
+}
+
+
+char *DdkFormatAddress(PVOID pAddr, char *pBuffer, size_t len)
+{
+	char path[MAX_PATH] = { 0 }, *name = path;
+	HMODULE h = DdkFindModule(pAddr);
+
+	// Report addresses as module+offset, which survives relocation
+
+	if (h && GetModuleFileName(h, path, sizeof(path) - 1)) {
+		char *cp = strrchr(path, '\\');
+		if (cp) name = cp + 1;
+	}
+
+	if (!h || !*name) snprintf(pBuffer, len, "%p", pAddr);
+	else snprintf(pBuffer, len, "%s+0x%I64x", name, (ULONG64)((char *)pAddr - (char *)h));
+
+	return pBuffer;
+}
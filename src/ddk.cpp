@@ -116,33 +116,33 @@ USHORT KeQueryActiveGroupCount()
 DDKAPI
 KAFFINITY KeQueryGroupAffinity(USHORT GroupNumber)
 {
+	ULONG count = DdkGetProcessorCount();
+
 	UNREFERENCED_PARAMETER(GroupNumber);
-	return 0xf;
+	return (count < DDK_MAXIMUM_PROCESSORS) ? ((KAFFINITY)1 << count) - 1 : ~(KAFFINITY)0;
 }
 
 
 DDKAPI
 ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
 {
-	// TODO - need a cpuid that is constant until the thread suspends
-	UNREFERENCED_PARAMETER(ProcNumber);
-	return 0;
-}
+	ULONG Number = DdkGetCurrentProcessor();
 
+	if (ProcNumber) {
+		ProcNumber->Group = 0;
+		ProcNumber->Number = (UCHAR)Number;
+		ProcNumber->Reserved = 0;
+	}
 
-DDKAPI
-ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber)
-{
-	UNREFERENCED_PARAMETER(GroupNumber);
-	return 16;
+	return Number;
 }
 
 
 DDKAPI
-VOID ExQueueWorkItem(PWORK_QUEUE_ITEM WorkItem, WORK_QUEUE_TYPE QueueType)
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber)
 {
-	UNREFERENCED_PARAMETER(WorkItem);
-	UNREFERENCED_PARAMETER(QueueType);
+	UNREFERENCED_PARAMETER(GroupNumber);
+	return DdkGetProcessorCount();
 }
 
 
@@ -293,28 +293,6 @@ POWER_STATE PoSetPowerState(PDEVICE_OBJECT DeviceObject, POWER_STATE_TYPE Type,
 }
 
 
-DDKAPI
-VOID ExAcquireFastMutex(PFAST_MUTEX FastMutex)
-{
-	UNREFERENCED_PARAMETER(FastMutex);
-}
-
-
-DDKAPI
-VOID ExReleaseFastMutex(PFAST_MUTEX FastMutex)
-{
-	UNREFERENCED_PARAMETER(FastMutex);
-}
-
-
-DDKAPI
-BOOLEAN ExTryToAcquireFastMutex(PFAST_MUTEX FastMutex)
-{
-	UNREFERENCED_PARAMETER(FastMutex);
-	return FALSE;
-}
-
-
 DDKAPI
 BOOLEAN IoIs32bitProcess(PIRP Irp)
 {
@@ -331,15 +309,6 @@ ULONG IoWMIDeviceObjectToProviderId(PDEVICE_OBJECT DeviceObject)
 }
 
 
-DDKAPI
-ULONG ExSetTimerResolution(ULONG DesiredTime, BOOLEAN SetResolution)
-{
-	UNREFERENCED_PARAMETER(DesiredTime);
-	UNREFERENCED_PARAMETER(SetResolution);
-	return 0;
-}
-
-
 DDKAPI
 VOID IoAcquireCancelSpinLock(PKIRQL Irql)
 {
@@ -354,17 +323,6 @@ VOID IoReleaseCancelSpinLock(KIRQL Irql)
 }
 
 
-DDKAPI
-LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
-{
-	UNREFERENCED_PARAMETER(PerformanceFrequency);
-
-	LARGE_INTEGER v;
-	v.QuadPart = 0;
-	return v;
-}
-
-
 DDKAPI
 NTSTATUS ZwCreateSection(PHANDLE SectionHandle, ACCESS_MASK DesiredAccess,
     POBJECT_ATTRIBUTES ObjectAttributes, PLARGE_INTEGER MaximumSize, ULONG SectionPageProtection,
@@ -659,16 +617,22 @@ KeQueryHighestNodeNumber()
 NTSTATUS
 KeGetProcessorNumberFromIndex(ULONG ProcIndex, PPROCESSOR_NUMBER ProcNumber)
 {
-	UNREFERENCED_PARAMETER(ProcIndex);
-	UNREFERENCED_PARAMETER(ProcNumber);
+	if (ProcIndex >= DdkGetProcessorCount())
+		return STATUS_INVALID_PARAMETER;
+
+	ProcNumber->Group = 0;
+	ProcNumber->Number = (UCHAR)ProcIndex;
+	ProcNumber->Reserved = 0;
 	return STATUS_SUCCESS;
 }
 
 ULONG
 KeGetProcessorIndexFromNumber(PPROCESSOR_NUMBER ProcNumber)
 {
-	UNREFERENCED_PARAMETER(ProcNumber);
-	return 0;
+	if (ProcNumber->Group || ProcNumber->Number >= DdkGetProcessorCount())
+		return INVALID_PROCESSOR_INDEX;
+
+	return ProcNumber->Number;
 }
 
 DDKAPI
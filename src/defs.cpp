@@ -13,6 +13,7 @@
   */
 
 #include "stdddk.h"
+#include <ntifs.h>
 
 
 size_t _SizeofEvent_ = sizeof(KEVENT);
@@ -20,5 +21,8 @@ size_t _SizeofMutex_ = sizeof(KMUTEX);
 size_t _SizeofTimer_ = sizeof(KTIMER);
 size_t _SizeofSemaphore_ = sizeof(KSEMAPHORE);
 size_t _SizeofDpc_ = sizeof(KDPC);
+size_t _SizeofWaitBlock_ = sizeof(KWAIT_BLOCK);
+size_t _SizeofQueue_ = sizeof(KQUEUE);
+size_t _SizeofResource_ = sizeof(ERESOURCE);
 
 ULONG ThreadWaitObjects = THREAD_WAIT_OBJECTS;
\ No newline at end of file
@@ -37,13 +37,19 @@ extern "C" _Analysis_noreturn_ void DdkFail(wchar_t *s);
 
 typedef struct _IMAGE IMAGE, *PIMAGE;
 
+#define DDK_MAXIMUM_PROCESSORS	64
+
 BOOLEAN DdkIsDpc();
 BOOLEAN DdkIsWorkItem();
+void DdkBeginDeferred();
+void DdkEndDeferred();
+LONG DdkDeferredWork();
 DWORD DdkGetWaitTime(LARGE_INTEGER *pTimeout);
 DWORD DdkGetDelayTime(LARGE_INTEGER *pTimeout);
 FILETIME DdkGetDueTime(LARGE_INTEGER Timeout);
 VOID DdkAddDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT DeviceObject);
 VOID DdkRemoveDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT DeviceObject);
+VOID DdkRestoreDevice(PDEVICE_OBJECT DeviceObject, BOOLEAN Keep);
 void DdkCreatePath(PUNICODE_STRING Out, PUNICODE_STRING Name, PWCH Dir = 0, PWCH Prefix = 0);
 BOOLEAN DdkInsertName(PUNICODE_STRING Name, POBJECT pObj, PWCH Dir = 0, PWCH *pPath = 0);
 POBJECT DdkCreateName(PUNICODE_STRING Name, POBJECT pObj, PWCH Dir = 0, PWCH *pPath = 0);
@@ -52,6 +58,8 @@ VOID DdkRemoveObjectName(POBJECT Object);
 POBJECT DdkLookupName(PUNICODE_STRING Name, PWCH Dir = 0);
 POBJECT DdkLookupName(PWCH Name, PWCH Dir = 0);
 POBJECT DdkLookupName(char *Name, PWCH Dir = 0);
+ULONG DdkFindNamedObjects(USHORT type, POBJECT *pv, ULONG max);
+PWCH DdkFindObjectName(POBJECT Object);
 PFILE_OBJECT DdkGetFilePointer(HANDLE FileHandle);
 void DdkFreeFileObject(OBJECT *pObj);
 void DdkFreeDriverObject(OBJECT *pObj);
@@ -64,8 +72,14 @@ VOID DdkUnloadImage(PIMAGE pImage);
 NTSTATUS DdkPnpCreateDevice(PDRIVER_OBJECT DriverObject);
 void DdkPnpUnload(PDRIVER_OBJECT DriverObject);
 NTSTATUS DdkSynchronousIrp(PDEVICE_OBJECT DeviceObject, UCHAR Major, UCHAR Minor, PIRP Irp = NULL);
+ULONG DdkGetProcessorCount();
+ULONG DdkGetCurrentProcessor();
+void DdkSetCurrentProcessor(ULONG Number);
 ULONG DdkGetTickCountMultiplier();
 ULONG64 DdkGetTickCount();
+ULONG64 DdkGetSystemTickCount();
+void DdkSetVirtualSharedData(PVOID pPage, ULONG64 InterruptTime, ULONG64 SystemTime, ULONG64 TickCount);
+void DdkSetSystemSharedData();
 ULONG64 DdkReadCR8();
 VOID DdkWriteCR8(ULONG64 v);
 WCHAR *DdkAllocUnicodeBuffer(size_t len);
@@ -77,11 +91,53 @@ LONG DdkInvokeForAllThreads(LONG (*func)(HANDLE));
 WCHAR *DdkUnicodeToString(UNICODE_STRING *u, WCHAR remove = 0);
 void DdkGetLocalPath(WCHAR *buffer, int len, UNICODE_STRING *path, bool create);
 void DdkGetLocalPath(char *buffer, size_t len, char *path, char *file, char *suffix = "");
+bool DdkGetCachePath(char *buffer, size_t len, ULONG64 key, char *file, char *suffix = "");
+void DdkPrint(const char *Format, ...);
+char *DdkFormatAddress(PVOID pAddr, char *pBuffer, size_t len);
+
+enum { LockSpin, LockQueued, LockShared, LockExclusive, LockMutex, LockFastMutex, LockPushLock, LockTypes };
+
+extern volatile LONG DdkLockStats;
+extern __declspec(thread) int DdkLocksHeld;
+LONG64 DdkLockStatTime();
+void DdkLockStatAcquire(PVOID pLock, PVOID pCaller, ULONG type, LONG64 start, bool contended);
+void DdkLockStatRelease(PVOID pLock);
+void DdkResetLockStats();
+
+LONG64 DdkLatencyTime();
+LONG64 DdkLatencyTicks(LONG64 Interval);
+void DdkRecordLatency(PVOID Routine, ULONG Type, LONG64 Queued, LONG64 Start, LONG64 End);
+PVOID DdkGetDpcRoutine(PKDPC Dpc);
+
+enum { VirtualOff, VirtualManual, VirtualAutomatic };
+
+DDKAPI_NODECL ULONG64 DdkSharedUserData;
+extern volatile LONG DdkVirtualTime;
+LONG64 DdkReadCounter();
+LONG64 DdkClockTime();
+LONG64 DdkQuerySystemTime();
+void DdkBeginVirtualWait();
+void DdkEndVirtualWait();
+void DdkVirtualActivity();
+bool DdkHoldSharedData();
+void DdkReleaseSharedData();
+PKTIMER DdkArmWaitTimer(LARGE_INTEGER DueTime);
+void DdkFreeWaitTimer(PKTIMER Timer);
+void DdkAdvanceTimers(LONG64 Now);
+LONG64 DdkNextTimerDue();
+LONG DdkArmedTimers();
+void DdkQueueBlock();
+void DdkQueueUnblock();
+void DdkQueueThreadExit();
+void DdkWaitThreadExit();
+void DdkInitializeQueue(PRKQUEUE Queue, ULONG Count);
+bool DdkQueueStarved(PRKQUEUE Queue);
 
 
 #define EXCEPTION_UNITTEST_ASSERTION   (DWORD)0xe3530001
 
 
-extern size_t _SizeofEvent_, _SizeofMutex_, _SizeofTimer_, _SizeofSemaphore_, _SizeofDpc_;
+extern size_t _SizeofEvent_, _SizeofMutex_, _SizeofTimer_, _SizeofSemaphore_, _SizeofDpc_, _SizeofWaitBlock_, _SizeofQueue_;
+extern size_t _SizeofResource_;
 extern ULONG ThreadWaitObjects;
 
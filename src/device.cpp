@@ -24,6 +24,7 @@ typedef struct _DEVICE : public OBJECT {
 	DEVOBJ_EXTENSION Extension;
 	DEVOBJ_POWER Power;
 	PWCH DeviceName;
+	bool Deleted;
 } DEVICE, *PDEVICE;
 
 static volatile LONG UniqueId = -1;
@@ -127,11 +128,37 @@ VOID IoDeleteDevice(PDEVICE_OBJECT DeviceObject)
 
 	DEVICE *pDevice = GetDevice(FromPointer(DeviceObject));
 
+	pDevice->Deleted = true;
 	DdkRemoveObjectName(pDevice);
 	DdkDereferenceObject(pDevice);
 }
 
 
+/*
+ *	Bring a device back to its checkpoint state, once names are restored.
+ *	A device deleted since the checkpoint takes back the reference that
+ *	IoDeleteDevice dropped, and one created since is deleted.
+ */
+
+VOID DdkRestoreDevice(PDEVICE_OBJECT DeviceObject, BOOLEAN Keep)
+{
+	DEVICE *pDevice = GetDevice(FromPointer(DeviceObject));
+
+	if (!Keep) {
+		if (!pDevice->Deleted) IoDeleteDevice(DeviceObject);
+		return;
+	}
+
+	if (pDevice->Deleted) {
+		pDevice->Deleted = false;
+		DdkReferenceObject(pDevice);
+	}
+
+	if (pDevice->DeviceName)
+		pDevice->DeviceName = DdkFindObjectName(pDevice);
+}
+
+
 DDKAPI
 NTSTATUS IoRegisterDeviceInterface(PDEVICE_OBJECT PhysicalDeviceObject,
 	CONST GUID *InterfaceClassGuid, PUNICODE_STRING ReferenceString, PUNICODE_STRING SymbolicLinkName)
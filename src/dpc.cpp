@@ -15,44 +15,139 @@
 
 
 typedef struct _DPC {
-	PTP_WORK Work;
-	PCRITICAL_SECTION Lock;
+	struct _DPC *Next;
+	struct _DPC *Prev;
     PKDEFERRED_ROUTINE DeferredRoutine;
     PVOID DeferredContext;
     PVOID SystemArgument1;
     PVOID SystemArgument2;
-	volatile LONG queued;
-	volatile LONG cancel;
+	volatile LONG queued;		// Virtual processor + 1 while queued
     UCHAR Importance;
     bool threaded;
+	USHORT Number;				// Target processor + 1, or 0 for current
+	LONG64 queuetime;
 } DPC, *PDPC;
 
 
+/*
+ *	Each virtual processor has its own DPC queue, drained by a dedicated
+ *	thread bound to that processor. As in the kernel, HighImportance DPCs
+ *	are queued at the head and all others at the tail, and the thread
+ *	runs everything queued before it waits again.
+ *
+ *	All DPC state lives in the KDPC itself. The queued field names the
+ *	queue holding the DPC and only changes under that queue's lock, so
+ *	KeInsertQueueDpc can reject a queued DPC without taking any lock.
+ */
+
+typedef struct DECLSPEC_CACHEALIGN _DPCQUEUE {
+	SRWLOCK Lock;
+	CONDITION_VARIABLE Ready;
+	DPC *head;
+	DPC *tail;
+	HANDLE h;
+	ULONG Number;
+} DPCQUEUE;
+
+
 __declspec(thread) bool DdkDpcActive = false;
-static volatile LONGLONG DpcsQueued, DpcsCompleted;
 
+static DPCQUEUE queuev[DDK_MAXIMUM_PROCESSORS];
+static ULONG queuec;
+static INIT_ONCE QueueInit = INIT_ONCE_STATIC_INIT;
 
-static VOID DdkDpcCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_WORK Work)
+
+static void DdkRunDpc(DPC *pDpc, PVOID SystemArgument1, PVOID SystemArgument2, LONG64 queued)
 {
-	DPC *pDpc = (DPC *)Context;
 	KIRQL irql = (pDpc->threaded ? PASSIVE_LEVEL : DISPATCH_LEVEL);
+	PKDEFERRED_ROUTINE DeferredRoutine = pDpc->DeferredRoutine;
 	KIRQL oldirql;
 
-	DdkThreadInit();
 	DdkDpcActive = true;
-	InterlockedExchange(&pDpc->queued, 0);
-	DisassociateCurrentThreadFromCallback(Instance);
-	KeLowerIrql(PASSIVE_LEVEL);
 	KeRaiseIrql(irql, &oldirql);
 
-	(*pDpc->DeferredRoutine)((PRKDPC)pDpc,
-		pDpc->DeferredContext, pDpc->SystemArgument1, pDpc->SystemArgument2);
+	LONG64 start = DdkLatencyTime();
 
+	(*DeferredRoutine)((PRKDPC)pDpc,
+		pDpc->DeferredContext, SystemArgument1, SystemArgument2);
+
+	DdkRecordLatency(DeferredRoutine, DDK_LATENCY_DPC, queued, start, DdkLatencyTime());
 	DDKASSERT(KeGetCurrentIrql() == irql);
 
-	InterlockedIncrement64(&DpcsCompleted);
 	KeLowerIrql(PASSIVE_LEVEL);
 	DdkDpcActive = false;
+	DdkEndDeferred();
+}
+
+
+static void DdkUnlinkDpc(DPCQUEUE *q, DPC *pDpc)
+{
+	if (pDpc->Prev) pDpc->Prev->Next = pDpc->Next;
+	else q->head = pDpc->Next;
+
+	if (pDpc->Next) pDpc->Next->Prev = pDpc->Prev;
+	else q->tail = pDpc->Prev;
+
+	pDpc->Next = pDpc->Prev = NULL;
+}
+
+
+static DWORD WINAPI DdkDpcThread(PVOID arg)
+{
+	DPCQUEUE *q = (DPCQUEUE *)arg;
+
+	DdkThreadInit();
+	DdkSetCurrentProcessor(q->Number);
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+	AcquireSRWLockExclusive(&q->Lock);
+
+	for (;;) {
+		DPC *pDpc = q->head;
+
+		if (!pDpc) {
+			SleepConditionVariableSRW(&q->Ready, &q->Lock, INFINITE, 0);
+			continue;
+		}
+
+		DdkUnlinkDpc(q, pDpc);
+
+		// The DPC can be queued again as soon as it is removed
+
+		PVOID SystemArgument1 = pDpc->SystemArgument1;
+		PVOID SystemArgument2 = pDpc->SystemArgument2;
+		LONG64 queuetime = pDpc->queuetime;
+
+		InterlockedExchange(&pDpc->queued, 0);
+		ReleaseSRWLockExclusive(&q->Lock);
+
+		DdkRunDpc(pDpc, SystemArgument1, SystemArgument2, queuetime);
+		AcquireSRWLockExclusive(&q->Lock);
+	}
+
+	return 0;
+}
+
+
+static BOOL CALLBACK DdkDpcInit(PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
+{
+	queuec = DdkGetProcessorCount();
+
+	for (ULONG i = 0; i < queuec; i++) {
+		DPCQUEUE *q = &queuev[i];
+
+		InitializeSRWLock(&q->Lock);
+		InitializeConditionVariable(&q->Ready);
+		q->Number = i;
+		q->h = CreateThread(NULL, 0, DdkDpcThread, q, 0, NULL);
+
+		if (!q->h)
+			ddkfail("Unable to create DPC thread");
+
+		SetThreadIdealProcessor(q->h, i);
+	}
+
+	return TRUE;
 }
 
 
@@ -67,14 +162,7 @@ VOID KeInitializeDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOID Defer
 	memset(Dpc, 0, _SizeofDpc_);
 
 	DdkThreadInit();
-	pDpc->Lock = (PCRITICAL_SECTION)calloc(1, sizeof(CRITICAL_SECTION));
-	pDpc->Work = CreateThreadpoolWork(DdkDpcCallback, (PVOID)pDpc, NULL);
-
-	if (!pDpc->Work || !pDpc->Lock)
-		ddkfail("Unable to initialize DPC");
-
-	if (!InitializeCriticalSectionAndSpinCount(pDpc->Lock, 4000))
-		ddkfail("KeInitializeDpc failed to initialize spinlock");
+	InitOnceExecuteOnce(&QueueInit, DdkDpcInit, NULL, NULL);
 
 	pDpc->DeferredRoutine = DeferredRoutine;
 	pDpc->DeferredContext = DeferredContext;
@@ -90,25 +178,73 @@ VOID KeInitializeThreadedDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVO
 }
 
 
+DDKAPI
+VOID KeSetImportanceDpc(PRKDPC Dpc, KDPC_IMPORTANCE Importance)
+{
+	((PDPC)Dpc)->Importance = (UCHAR)Importance;
+}
+
+
+DDKAPI
+VOID KeSetTargetProcessorDpc(PRKDPC Dpc, CCHAR Number)
+{
+	DDKASSERT((ULONG)Number < queuec);
+	((PDPC)Dpc)->Number = (USHORT)Number + 1;
+}
+
+
+DDKAPI
+NTSTATUS KeSetTargetProcessorDpcEx(PKDPC Dpc, PPROCESSOR_NUMBER ProcNumber)
+{
+	if (ProcNumber->Group || ProcNumber->Number >= queuec)
+		return STATUS_INVALID_PARAMETER;
+
+	((PDPC)Dpc)->Number = (USHORT)ProcNumber->Number + 1;
+	return STATUS_SUCCESS;
+}
+
+
 DDKAPI
 BOOLEAN KeInsertQueueDpc(PRKDPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2)
 {
 	DPC *pDpc = (DPC *)Dpc;
 
-	EnterCriticalSection(pDpc->Lock);
+	if (pDpc->queued)
+		return FALSE;
 
-	if (pDpc->queued || pDpc->cancel) {
-		LeaveCriticalSection(pDpc->Lock);
+	ULONG Number = (pDpc->Number) ? pDpc->Number - 1 : DdkGetCurrentProcessor();
+	DPCQUEUE *q = &queuev[Number];
+
+	AcquireSRWLockExclusive(&q->Lock);
+
+	if (InterlockedCompareExchange(&pDpc->queued, Number + 1, 0)) {
+		ReleaseSRWLockExclusive(&q->Lock);
 		return FALSE;
 	}
 
 	pDpc->SystemArgument1 = SystemArgument1;
 	pDpc->SystemArgument2 = SystemArgument2;
-	pDpc->queued = 1;
+	pDpc->queuetime = DdkLatencyTime();
+
+	if (pDpc->Importance == HighImportance) {
+		pDpc->Prev = NULL;
+		pDpc->Next = q->head;
+		if (q->head) q->head->Prev = pDpc;
+		else q->tail = pDpc;
+		q->head = pDpc;
+	}
+
+	else {
+		pDpc->Next = NULL;
+		pDpc->Prev = q->tail;
+		if (q->tail) q->tail->Next = pDpc;
+		else q->head = pDpc;
+		q->tail = pDpc;
+	}
 
-	InterlockedIncrement64(&DpcsQueued);
-	SubmitThreadpoolWork(pDpc->Work);
-	LeaveCriticalSection(pDpc->Lock);
+	DdkBeginDeferred();
+	ReleaseSRWLockExclusive(&q->Lock);
+	WakeConditionVariable(&q->Ready);
 	return TRUE;
 }
 
@@ -117,32 +253,76 @@ DDKAPI
 BOOLEAN KeRemoveQueueDpc(PRKDPC Dpc)
 {
 	DPC *pDpc = (DPC *)Dpc;
+	LONG queued = pDpc->queued;
 
-	EnterCriticalSection(pDpc->Lock);
-
-	if (!pDpc->queued || pDpc->cancel) {
-		LeaveCriticalSection(pDpc->Lock);
+	if (!queued)
 		return FALSE;
+
+	DPCQUEUE *q = &queuev[queued - 1];
+	BOOLEAN rc = FALSE;
+
+	AcquireSRWLockExclusive(&q->Lock);
+
+	// Still queued here, rather than run and queued elsewhere
+
+	if (pDpc->queued == queued) {
+		DdkUnlinkDpc(q, pDpc);
+		InterlockedExchange(&pDpc->queued, 0);
+		rc = TRUE;
 	}
 
-	pDpc->cancel = 1;
-	LeaveCriticalSection(pDpc->Lock);
-	WaitForThreadpoolWorkCallbacks(pDpc->Work, TRUE);
+	ReleaseSRWLockExclusive(&q->Lock);
 
-	BOOLEAN rc = (InterlockedExchange(&pDpc->queued, 0) != 0);
-	if (rc) InterlockedIncrement64(&DpcsCompleted);
-	InterlockedExchange(&pDpc->cancel, 0);
+	if (rc) DdkEndDeferred();
 	return rc;
 }
 
 
+static VOID DdkFlushDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+	volatile LONG *pending = (volatile LONG *)DeferredContext;
+
+	if (!InterlockedDecrement(pending))
+		WakeByAddressAll((PVOID)pending);
+}
+
+
+/*
+ *	VOID KeFlushQueuedDpcs()
+ *
+ *	Queue a marker DPC at the tail of every processor's queue and wait
+ *	for all of them to run. Each queue is drained in order by a single
+ *	thread, so every DPC queued before the call has completed by then.
+ *	DPCs queued later do not extend the wait.
+ */
+
 DDKAPI
 VOID KeFlushQueuedDpcs()
 {
 	DDKASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
 
-	LONGLONG queued = DpcsQueued;
-	while (DpcsCompleted < queued) Sleep(10);
+	KDPC flushv[DDK_MAXIMUM_PROCESSORS];
+	volatile LONG pending;
+	LONG count;
+
+	InitOnceExecuteOnce(&QueueInit, DdkDpcInit, NULL, NULL);
+	pending = queuec;
+
+	for (ULONG i = 0; i < queuec; i++) {
+		KeInitializeDpc(&flushv[i], DdkFlushDpc, (PVOID)&pending);
+		KeSetImportanceDpc(&flushv[i], LowImportance);
+		KeSetTargetProcessorDpc(&flushv[i], (CCHAR)i);
+		KeInsertQueueDpc(&flushv[i], 0, 0);
+	}
+
+	while ((count = pending) != 0)
+		WaitOnAddress((PVOID)&pending, &count, sizeof(count), INFINITE);
+}
+
+
+PVOID DdkGetDpcRoutine(PKDPC Dpc)
+{
+	return ((PDPC)Dpc)->DeferredRoutine;
 }
 
 
@@ -34,6 +34,9 @@ NTSTATUS DdkReferenceDriver(OBJECT *pObj, bool loaded);
 NTSTATUS DdkDriverEntry(PDRIVER_OBJECT DriverObject);
 void DdkDelayLoad(PIMAGE pImage, HRESULT (*pLoad)(const char *));
 void DdkDelayUnload(PIMAGE pImage, INT (*pUnload)(const char *));
+void DdkResetImageData(PIMAGE pImage);
+void DdkSnapshotImageData(PIMAGE pImage);
+void DdkDiscardCheckpoint();
 
 
 DRIVER_DISPATCH DdkDefaultDispatch;
@@ -80,6 +83,11 @@ NTSTATUS DdkLoadDriver(char *pFile, HRESULT (*pLoadAll)(const char *))
 
 	NTSTATUS rc = DdkCreateDriver(name, DdkGetImageEntry(pImage), pImage);
 
+	// Driver data is reset to its state once DriverEntry has run
+
+	if (NT_SUCCESS(rc))
+		DdkSnapshotImageData(pImage);
+
 	if (pLoadAll && NT_SUCCESS(rc))
 		DdkDelayLoad(pImage, pLoadAll);
 
@@ -140,6 +148,9 @@ VOID DdkUnloadDriver(char *pName, INT (*pUnload)(const char *))
 		DdkDelayUnload(pDriver->Image, pUnload);
 
 	if (pDriver->loadcount && !--(pDriver->loadcount)) {
+		// A checkpoint cannot bring back a driver, and its references would hold it
+
+		DdkDiscardCheckpoint();
 		DdkPnpUnload(&pDriver->Driver);
 
 		if (pDriver->Driver.DriverUnload)
@@ -157,6 +168,135 @@ VOID DdkUnloadDriver(char *pName, INT (*pUnload)(const char *))
 }
 
 
+DDKAPI_NODECL
+NTSTATUS DdkResetDriverState(char *pName)
+{
+	DdkThreadInit();
+
+	DdkLoadLock();
+	OBJECT *pObj = DdkLookupName(pName, L"\\Driver");
+
+	if (!pObj) {
+		DdkLoadUnlock();
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+
+	DRIVER *pDriver = GetDriver(pObj);
+	NTSTATUS rc = (pDriver->Image) ? STATUS_SUCCESS : STATUS_NOT_SUPPORTED;
+
+	if (pDriver->Image)
+		DdkResetImageData(pDriver->Image);
+
+	DdkDereferenceObject(pObj);
+	DdkLoadUnlock();
+	return rc;
+}
+
+
+/*
+ *	A checkpoint holds a reference on each device of each driver, so that
+ *	a device deleted since is still there for the restore to bring back.
+ *	A restore deletes the devices created since.
+ */
+
+static POBJECT *CheckpointDevices;
+static ULONG CheckpointDeviceCount;
+
+
+static POBJECT *DdkGetDrivers(ULONG *pCount)
+{
+	POBJECT *pv = NULL;
+	ULONG n = 0, max = 0;
+
+	do {
+		for (ULONG i = 0; i < n && i < max; i++)
+			DdkDereferenceObject(pv[i]);
+
+		free(pv);
+		max = n + 16;
+
+		if (!(pv = (POBJECT *)malloc(max * sizeof(POBJECT))))
+			ddkfail("Unable to list drivers");
+
+		n = DdkFindNamedObjects(IoDriverType, pv, max);
+	} while (n > max);
+
+	*pCount = n;
+	return pv;
+}
+
+
+static ULONG DdkListDevices(PDRIVER pDriver, POBJECT **ppv, ULONG n)
+{
+	for (PDEVICE_OBJECT pDevice = pDriver->Driver.DeviceObject; pDevice; pDevice = pDevice->NextDevice) {
+		OBJECT *pObj = FromPointer(pDevice);
+
+		if (!(n & 15) && !(*ppv = (POBJECT *)realloc(*ppv, (n + 16) * sizeof(POBJECT))))
+			ddkfail("Unable to list devices");
+
+		DdkReferenceObject(pObj);
+		(*ppv)[n++] = pObj;
+	}
+
+	return n;
+}
+
+
+void DdkDiscardDevices()
+{
+	for (ULONG i = 0; i < CheckpointDeviceCount; i++)
+		DdkDereferenceObject(CheckpointDevices[i]);
+
+	free(CheckpointDevices);
+	CheckpointDevices = NULL;
+	CheckpointDeviceCount = 0;
+}
+
+
+void DdkCheckpointDevices()
+{
+	POBJECT *pDevices = NULL;
+	ULONG count, n = 0;
+	POBJECT *pDrivers = DdkGetDrivers(&count);
+
+	DdkDiscardDevices();
+
+	for (ULONG i = 0; i < count; i++) {
+		n = DdkListDevices(GetDriver(pDrivers[i]), &pDevices, n);
+		DdkDereferenceObject(pDrivers[i]);
+	}
+
+	free(pDrivers);
+	CheckpointDevices = pDevices;
+	CheckpointDeviceCount = n;
+}
+
+
+void DdkRestoreDevices()
+{
+	POBJECT *pDevices = NULL;
+	ULONG count, n = 0;
+	POBJECT *pDrivers = DdkGetDrivers(&count);
+
+	for (ULONG i = 0; i < count; i++) {
+		n = DdkListDevices(GetDriver(pDrivers[i]), &pDevices, n);
+		DdkDereferenceObject(pDrivers[i]);
+	}
+
+	for (ULONG i = 0; i < n; i++) {
+		ULONG j = 0;
+
+		while (j < CheckpointDeviceCount && CheckpointDevices[j] != pDevices[i]) j++;
+
+		DdkRestoreDevice((PDEVICE_OBJECT)ToPointer(pDevices[i]), j < CheckpointDeviceCount);
+		DdkDereferenceObject(pDevices[i]);
+	}
+
+	free(pDrivers);
+	free(pDevices);
+}
+
+
 NTSTATUS DdkCreateDriver(char *pName, PDRIVER_INITIALIZE DriverInit, PIMAGE Image)
 {
 	DRIVER *pDriver = (DRIVER *)DdkAllocObject(sizeof(DRIVER)
@@ -14,18 +14,15 @@
 #include "stdafx.h"
 
 
-typedef struct _EVENT : public OBJECT {
-	bool	notify;
+typedef struct _EVENT : public DISPATCH {
 } EVENT, *PEVENT;
 
 
-
 static void DdkInitEvent(PEVENT pEvent, EVENT_TYPE Type, BOOLEAN State)
 {
-	pEvent->h = CreateEvent(NULL, (Type == NotificationEvent), (State != FALSE), NULL);
 	pEvent->type = EventType;
 	pEvent->notify = (Type == NotificationEvent);
-	if (!pEvent->h) ddkfail("Unable to initialize Event");
+	pEvent->signal = (State != FALSE);
 }
 
 
@@ -84,15 +81,7 @@ LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait)
 
 	DDKASSERT(KeGetCurrentIrql() <= (Wait ? APC_LEVEL : DISPATCH_LEVEL));
 
-	DWORD rc = WaitForSingleObject(pEvent->h, 0);
-
-	if (rc == WAIT_OBJECT_0) {
-		if (!pEvent->notify) SetEvent(pEvent->h);
-		return 1;
-	}
-
-	SetEvent(pEvent->h);
-	return 0;
+	return DdkSignalObject(pEvent);
 }
 
 
@@ -103,14 +92,7 @@ LONG KeResetEvent(PRKEVENT Event)
 
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
 
-	DWORD rc = WaitForSingleObject(pEvent->h, 0);
-
-	if (rc == WAIT_OBJECT_0) {
-		if (pEvent->notify) ResetEvent(pEvent->h);
-		return 1;
-	}
-
-	return 0;
+	return InterlockedExchange(&pEvent->signal, 0);
 }
 
 
@@ -120,7 +102,7 @@ VOID KeClearEvent(PRKEVENT Event)
 	EVENT *pEvent = (EVENT *)Event;
 
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-	ResetEvent(pEvent->h);
+	pEvent->signal = 0;
 }
 
 
@@ -130,13 +112,5 @@ LONG KeReadStateEvent(PRKEVENT Event)
 	EVENT *pEvent = (EVENT *)Event;
 
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-
-	DWORD rc = WaitForSingleObject(pEvent->h, 0);
-
-	if (rc == WAIT_OBJECT_0) {
-		if (!pEvent->notify) SetEvent(pEvent->h);
-		return TRUE;
-	}
-
-	return FALSE;
+	return pEvent->signal;
 }
@@ -21,9 +21,39 @@
 #endif
 
 
+#define SITE_COUNT		4096
+#define SITE_PROBES		16
+
+
+/*
+ *	Decoded fault sites are cached so that repeated faults from the same
+ *	instruction are resolved with a single lookup. Entries are claimed with
+ *	an interlocked exchange and the decoded information is published as a
+ *	single value, so the handler never needs to take a lock.
+ */
+
+enum { SiteUnknown, SiteShared, SiteReadCR8, SiteWriteCR8 };
+
+typedef struct _FAULTSITE {
+	PVOID volatile	addr;		// Faulting instruction
+	volatile LONG64	info;		// Kind, register, length and register mask
+	volatile LONG64	count;		// Faults handled
+} FAULTSITE;
+
+#define SITE_INFO(kind, reg, len, mask) \
+	((LONG64)(kind) | ((LONG64)(reg) << 8) | ((LONG64)(len) << 16) | ((LONG64)(mask) << 32))
+
+#define SITE_KIND(info)	((UCHAR)(info))
+#define SITE_REG(info)	((UCHAR)((info) >> 8))
+#define SITE_LEN(info)	((UCHAR)((info) >> 16))
+#define SITE_MASK(info)	((ULONG)((info) >> 32))
+
+
 extern "C" LONG DdkExceptionHandler(EXCEPTION_POINTERS *xp);
+bool DdkTrackImageWrite(PVOID pAddr);
 
 static PVOID DdkVectoredHandle;
+static FAULTSITE sitev[SITE_COUNT];
 
 
 void DdkExceptionInit()
@@ -59,90 +89,217 @@ static DWORD64 *DdkGetRegister(EXCEPTION_POINTERS *xp, UCHAR reg)
 }
 
 
+static FAULTSITE *DdkFindSite(PVOID addr, bool insert)
+{
+	ULONG i = (ULONG)(((ULONG64)addr * 0x9E3779B97F4A7C15UI64) >> 52);
+
+	for (int n = 0; n < SITE_PROBES; n++, i = (i + 1) % SITE_COUNT) {
+		PVOID v = sitev[i].addr;
+
+		if (v == addr) return &sitev[i];
+
+		if (!v) {
+			if (!insert) return NULL;
+
+			v = InterlockedCompareExchangePointer(&sitev[i].addr, addr, NULL);
+			if (!v || v == addr) return &sitev[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+static ULONG DdkFixupShared(EXCEPTION_POINTERS *xp, ULONG64 addr, ULONG mask)
+{
+	ULONG found = 0;
+
+	// The address of the shared area is in a register so
+	// rather than decoding the instructions just fixup the
+	// registers and continue.
+
+	for (UCHAR i = 0; i < REGISTER_COUNT; i++) {
+		if (!(mask & (1UL << i))) continue;
+
+		DWORD64 *pReg = DdkGetRegister(xp, i);
+
+		if ((ULONG64)(*pReg) == addr) {
+			*pReg = (DdkSharedUserData | (*pReg & 0x7ff));
+			found |= (1UL << i);
+		}
+	}
+
+	return found;
+}
+
+
 static LONG DdkAccessException(EXCEPTION_POINTERS *xp)
 {
 	static const ULONG64 KernelShared = 0xFFFFF78000000000UI64;
-	static const DWORD64 UserShared = 0x7FFE0000UI64;
+	static const ULONG AllRegisters = (ULONG)((1ULL << REGISTER_COUNT) - 1);
+
+	if (xp->ExceptionRecord->NumberParameters != 2)
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	// Check for Write to a tracked driver data page
+
+	if (xp->ExceptionRecord->ExceptionInformation[0] == 1
+			&& DdkTrackImageWrite((PVOID)xp->ExceptionRecord->ExceptionInformation[1]))
+		return EXCEPTION_CONTINUE_EXECUTION;
 
 	// Check for Read Access Exception
 
-	if (xp->ExceptionRecord->NumberParameters != 2
-	|| xp->ExceptionRecord->ExceptionInformation[0] != 0)
+	if (xp->ExceptionRecord->ExceptionInformation[0] != 0)
 		return EXCEPTION_CONTINUE_SEARCH;
 
 	ULONG64 addr = (ULONG64) xp->ExceptionRecord->ExceptionInformation[1];
 
 	// Check for Read from KI_USER_SHARED_DATA
 
-	if (addr >= KernelShared && addr < KernelShared + 0x800) {
-		bool found = false;
+	if (addr < KernelShared || addr >= KernelShared + 0x800)
+		return EXCEPTION_CONTINUE_SEARCH;
 
-		// The address of the shared area is in a register so
-		// rather than decoding the instructions just fixup the
-		// registers and continue.
+	FAULTSITE *pSite = DdkFindSite(xp->ExceptionRecord->ExceptionAddress, true);
+	LONG64 info = (pSite) ? pSite->info : 0;
+	ULONG found = 0;
 
-		for (UCHAR i = 0; i < REGISTER_COUNT; i++) {
-			DWORD64 *pReg = DdkGetRegister(xp, i);
+	if (SITE_KIND(info) == SiteShared)
+		found = DdkFixupShared(xp, addr, SITE_MASK(info));
 
-			if ((ULONG64)(*pReg) == addr) {
-				*pReg = (UserShared | (*pReg & 0x7ff));
-				found = true;
-			}
-		}
+	if (!found && (found = DdkFixupShared(xp, addr, AllRegisters)) != 0 && pSite)
+		InterlockedExchange64(&pSite->info, SITE_INFO(SiteShared, 0, 0, found));
 
-		if (found) return EXCEPTION_CONTINUE_EXECUTION;
-	}
+	if (!found) return EXCEPTION_CONTINUE_SEARCH;
 
-	return EXCEPTION_CONTINUE_SEARCH;
+	if (pSite) InterlockedIncrement64(&pSite->count);
+	return EXCEPTION_CONTINUE_EXECUTION;
 }
 
 
 static LONG DdkPrivException(EXCEPTION_POINTERS *xp)
 {
 #if defined(_X86_) || defined(_AMD64_)
-	UCHAR *op = (UCHAR *)(xp->ExceptionRecord->ExceptionAddress);
+	FAULTSITE *pSite = DdkFindSite(xp->ExceptionRecord->ExceptionAddress, true);
+	LONG64 info = (pSite) ? pSite->info : 0;
 
-	// Check for CR8 access (irql value)
+	if (SITE_KIND(info) != SiteReadCR8 && SITE_KIND(info) != SiteWriteCR8) {
+		UCHAR *op = (UCHAR *)(xp->ExceptionRecord->ExceptionAddress);
 
-	// These are MOVs with format 0x44 0x0F 0x20 0xC0
-	// The register is in bytes 0 and 3 (mask 0x01 and 0x07)
-	// The direction is in byte 2 (0x20: read, 0x22 write)
+		// Check for CR8 access (irql value)
 
-	if ((op[0] & 0xf6) == 0x44 && op[1] == 0x0f
-			&& (op[2] & 0xfd) == 0x20 && (op[3] & 0xf8) == 0xc0) {
+		// These are MOVs with format 0x44 0x0F 0x20 0xC0
+		// The register is in bytes 0 and 3 (mask 0x01 and 0x07)
+		// The direction is in byte 2 (0x20: read, 0x22 write)
 
-		DWORD64 *pReg = DdkGetRegister(xp, ((op[0] & 1) << 3) + (op[3] & 0x7));
+		if ((op[0] & 0xf6) != 0x44 || op[1] != 0x0f
+				|| (op[2] & 0xfd) != 0x20 || (op[3] & 0xf8) != 0xc0)
+			return EXCEPTION_CONTINUE_SEARCH;
 
-		// Emulate the failing instruction
+		info = SITE_INFO((op[2] & 0x02) ? SiteWriteCR8 : SiteReadCR8,
+			((op[0] & 1) << 3) + (op[3] & 0x7), 4, 0);
 
-		if (op[2] & 0x02) DdkWriteCR8((ULONG64)*pReg);
-		else *pReg = (DWORD64)DdkReadCR8();
+		if (pSite) InterlockedExchange64(&pSite->info, info);
+	}
 
-		// Skip over it and continue running
+	DWORD64 *pReg = DdkGetRegister(xp, SITE_REG(info));
 
-		xp->ContextRecord->Rip += 4;
-		return EXCEPTION_CONTINUE_EXECUTION;
-	}
-#endif
+	// Emulate the failing instruction
+
+	if (SITE_KIND(info) == SiteWriteCR8) DdkWriteCR8((ULONG64)*pReg);
+	else *pReg = (DWORD64)DdkReadCR8();
+
+	// Skip over it and continue running
+
+	xp->ContextRecord->Rip += SITE_LEN(info);
+
+	if (pSite) InterlockedIncrement64(&pSite->count);
+	return EXCEPTION_CONTINUE_EXECUTION;
+#else
 	return EXCEPTION_CONTINUE_SEARCH;
+#endif
 }
 
 
 extern "C"
 LONG DdkExceptionHandler(EXCEPTION_POINTERS *xp)
 {
-	if (xp->ExceptionRecord->ExceptionCode == EXCEPTION_ACCESS_VIOLATION)
+	switch (xp->ExceptionRecord->ExceptionCode) {
+	case EXCEPTION_ACCESS_VIOLATION:
 		return DdkAccessException(xp);
 
-	if (xp->ExceptionRecord->ExceptionCode == EXCEPTION_PRIV_INSTRUCTION)
+	case EXCEPTION_PRIV_INSTRUCTION:
 		return DdkPrivException(xp);
 
-    if (xp->ExceptionRecord->ExceptionCode == STATUS_ASSERTION_FAILURE) {
-        xp->ExceptionRecord->ExceptionCode = EXCEPTION_UNITTEST_ASSERTION;
-        xp->ExceptionRecord->NumberParameters = 2;
+	case STATUS_ASSERTION_FAILURE:
+		xp->ExceptionRecord->ExceptionCode = EXCEPTION_UNITTEST_ASSERTION;
+		xp->ExceptionRecord->NumberParameters = 2;
 		xp->ExceptionRecord->ExceptionInformation[0] = 0;
-        xp->ExceptionRecord->ExceptionInformation[1] = 0;
-    }
+		xp->ExceptionRecord->ExceptionInformation[1] = 0;
+		break;
+	}
+
+	// Anything else (C++ exceptions, test assertions) is not ours
 
 	return EXCEPTION_CONTINUE_SEARCH;
 }
+
+
+/*
+ *	VOID DdkFlushFaultSites(PVOID pAddr, size_t len)
+ *
+ *	Discard cached fault sites within an image that is being unloaded.
+ *	The slot keeps its address so that probe sequences remain intact.
+ */
+
+void DdkFlushFaultSites(PVOID pAddr, size_t len)
+{
+	for (int i = 0; i < SITE_COUNT; i++) {
+		char *addr = (char *)sitev[i].addr;
+
+		if (addr >= (char *)pAddr && addr < (char *)pAddr + len) {
+			InterlockedExchange64(&sitev[i].info, 0);
+			InterlockedExchange64(&sitev[i].count, 0);
+		}
+	}
+}
+
+
+static int __cdecl DdkCompareSites(const void *a, const void *b)
+{
+	LONG64 x = (*(FAULTSITE **)a)->count, y = (*(FAULTSITE **)b)->count;
+	return (x < y) ? 1 : (x > y) ? -1 : 0;
+}
+
+
+DDKAPI
+LONG64 DdkQueryFaultSite(PVOID pAddr)
+{
+	FAULTSITE *pSite = DdkFindSite(pAddr, false);
+	return (pSite) ? pSite->count : 0;
+}
+
+
+DDKAPI
+VOID DdkReportFaultSites()
+{
+	static const char *kind[] = { "unknown", "shared data", "read cr8", "write cr8" };
+	FAULTSITE **vec = (FAULTSITE **)malloc(SITE_COUNT * sizeof(FAULTSITE *));
+	int n = 0;
+
+	if (!vec) return;
+
+	for (int i = 0; i < SITE_COUNT; i++)
+		if (sitev[i].addr && sitev[i].count) vec[n++] = &sitev[i];
+
+	qsort(vec, n, sizeof(vec[0]), DdkCompareSites);
+
+	for (int i = 0; i < n; i++) {
+		char addr[MAX_PATH + 32];
+
+		DdkPrint("DDK: fault site %s (%s) handled %I64d",
+			DdkFormatAddress(vec[i]->addr, addr, sizeof(addr)),
+			kind[SITE_KIND(vec[i]->info) & 3], vec[i]->count);
+	}
+
+	free(vec);
+}
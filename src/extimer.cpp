@@ -0,0 +1,326 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Executive Timer Routines
+ */
+
+#include "stdafx.h"
+
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION	0x00000002
+#endif
+
+
+/*
+ *	Executive timers are waitable timers, high resolution when asked for,
+ *	so they are not held to the millisecond tick of the timer wheels. A
+ *	threadpool wait sees the timer fire, rearms a periodic timer, and
+ *	queues a DPC to run the callback at DISPATCH_LEVEL. The DPC targets
+ *	the processor that allocated the timer, so callbacks never overlap and
+ *	the final DPC can free the timer. In virtual time the timer is armed
+ *	on the wheel instead, as only the wheel follows the virtual clock.
+ */
+
+#define EXTIMER_DELETE		((PVOID)1)		// Free the timer
+#define EXTIMER_EXPIRED		((PVOID)2)		// Run the callback, then free the timer
+
+typedef struct _EXTIMER {
+	PKDPC			Dpc;
+	PKTIMER			Timer;			// Wheel timer used in virtual time
+	SRWLOCK			Lock;
+	HANDLE			h;				// Waitable timer
+	PTP_WAIT		Wait;
+	PEXT_CALLBACK	Callback;
+	PVOID			Context;
+	ULONG			Attributes;
+	LONG64			due;			// DDK clock
+	LONG64			Period;
+	bool			armed;
+	bool			wheel;			// Armed on the timer wheel
+	bool			deleted;
+	PEXT_DELETE_CALLBACK DeleteCallback;
+	PVOID			DeleteContext;
+	volatile LONG	*freed;			// Set once freed, for a waiting delete
+} EXTIMER;
+
+
+static HANDLE DdkCreateWaitableTimer(ULONG Attributes)
+{
+	DWORD flags = CREATE_WAITABLE_TIMER_MANUAL_RESET;
+	HANDLE h = NULL;
+
+	if (Attributes & EX_TIMER_HIGH_RESOLUTION)
+		h = CreateWaitableTimerExW(NULL, NULL,
+			flags | CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+	// High resolution timers are not supported before Windows 10 1803
+
+	if (!h) h = CreateWaitableTimerExW(NULL, NULL, flags, TIMER_ALL_ACCESS);
+	return h;
+}
+
+
+static void DdkArmExTimer(EXTIMER *pTimer, LONG64 interval)
+{
+	LARGE_INTEGER due;
+
+	due.QuadPart = -interval;
+
+	if (!SetWaitableTimer(pTimer->h, &due, 0, NULL, NULL, FALSE))
+		ddkfail("Unable to set executive timer");
+
+	SetThreadpoolWait(pTimer->Wait, pTimer->h, NULL);
+}
+
+
+/*
+ *	Called with the timer lock held.
+ */
+
+static BOOLEAN DdkCancelExTimer(EXTIMER *pTimer)
+{
+	if (!pTimer->armed) return FALSE;
+
+	pTimer->armed = false;
+
+	if (pTimer->wheel)
+		return KeCancelTimer(pTimer->Timer);
+
+	CancelWaitableTimer(pTimer->h);
+	if (!pTimer->Period) DdkEndDeferred();
+	return TRUE;
+}
+
+
+static void DdkFreeExTimer(EXTIMER *pTimer)
+{
+	PEXT_DELETE_CALLBACK DeleteCallback = pTimer->DeleteCallback;
+	PVOID DeleteContext = pTimer->DeleteContext;
+	volatile LONG *freed = pTimer->freed;
+
+	SetThreadpoolWait(pTimer->Wait, NULL, NULL);
+	WaitForThreadpoolWaitCallbacks(pTimer->Wait, TRUE);
+	CloseThreadpoolWait(pTimer->Wait);
+
+	CloseHandle(pTimer->h);
+	KeCancelTimer(pTimer->Timer);
+	free(pTimer);
+
+	if (DeleteCallback) (*DeleteCallback)(DeleteContext);
+
+	if (freed) {
+		InterlockedExchange(freed, 1);
+		WakeByAddressAll((PVOID)freed);
+	}
+}
+
+
+static VOID DdkExTimerDpc(PKDPC Dpc, PVOID Context, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+	EXTIMER *pTimer = (EXTIMER *)Context;
+
+	// A deleted timer only runs the callback when it was left to expire
+
+	if (SystemArgument1 == EXTIMER_EXPIRED || (SystemArgument1 != EXTIMER_DELETE && !pTimer->deleted))
+		(*pTimer->Callback)((PEX_TIMER)pTimer, pTimer->Context);
+
+	if (SystemArgument1 == EXTIMER_DELETE || SystemArgument1 == EXTIMER_EXPIRED)
+		DdkFreeExTimer(pTimer);
+}
+
+
+static VOID CALLBACK DdkExTimerSignalled(PTP_CALLBACK_INSTANCE Instance,
+	PVOID Context, PTP_WAIT Wait, TP_WAIT_RESULT WaitResult)
+{
+	EXTIMER *pTimer = (EXTIMER *)Context;
+	LONG64 now = DdkClockTime(), t = DdkLatencyTime();
+
+	DdkThreadInit();
+	AcquireSRWLockExclusive(&pTimer->Lock);
+
+	// Setting the timer again clears the signal, so a stale signal is ignored
+
+	if (pTimer->armed && !pTimer->wheel && WaitForSingleObject(pTimer->h, 0) == WAIT_OBJECT_0) {
+		DdkRecordLatency(pTimer->Callback, DDK_LATENCY_TIMER,
+			t - DdkLatencyTicks(max(now - pTimer->due, 0)), t, 0);
+
+		if (!pTimer->deleted)
+			KeInsertQueueDpc(pTimer->Dpc, 0, 0);
+
+		else {
+			KeRemoveQueueDpc(pTimer->Dpc);
+			KeInsertQueueDpc(pTimer->Dpc, EXTIMER_EXPIRED, 0);
+		}
+
+		if (pTimer->Period) {
+			pTimer->due = max(pTimer->due + pTimer->Period, now);
+			DdkArmExTimer(pTimer, pTimer->due - now);
+		}
+
+		else {
+			pTimer->armed = false;
+			DdkEndDeferred();
+		}
+	}
+
+	ReleaseSRWLockExclusive(&pTimer->Lock);
+}
+
+
+DDKAPI
+PEX_TIMER ExAllocateTimer(PEXT_CALLBACK Callback, PVOID CallbackContext, ULONG Attributes)
+{
+	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+	EXTIMER *pTimer = (EXTIMER *)calloc(1, sizeof(EXTIMER) + _SizeofDpc_ + _SizeofTimer_);
+
+	if (!pTimer) return NULL;
+
+	pTimer->Dpc = (PKDPC)(pTimer + 1);
+	pTimer->Timer = (PKTIMER)((char *)pTimer->Dpc + _SizeofDpc_);
+	pTimer->Callback = Callback;
+	pTimer->Context = CallbackContext;
+	pTimer->Attributes = Attributes;
+	pTimer->h = DdkCreateWaitableTimer(Attributes);
+	pTimer->Wait = CreateThreadpoolWait(DdkExTimerSignalled, pTimer, NULL);
+
+	if (!pTimer->h || !pTimer->Wait) {
+		if (pTimer->h) CloseHandle(pTimer->h);
+		if (pTimer->Wait) CloseThreadpoolWait(pTimer->Wait);
+		free(pTimer);
+		return NULL;
+	}
+
+	InitializeSRWLock(&pTimer->Lock);
+	KeInitializeTimerEx(pTimer->Timer, NotificationTimer);
+	KeInitializeDpc(pTimer->Dpc, DdkExTimerDpc, pTimer);
+	KeSetTargetProcessorDpc(pTimer->Dpc, (CCHAR)DdkGetCurrentProcessor());
+
+	if (Attributes & EX_TIMER_HIGH_RESOLUTION)
+		KeSetImportanceDpc(pTimer->Dpc, HighImportance);
+
+	return (PEX_TIMER)pTimer;
+}
+
+
+DDKAPI
+BOOLEAN ExSetTimer(PEX_TIMER Timer, LONGLONG DueTime, LONGLONG Period, PEXT_SET_PARAMETERS Parameters)
+{
+	EXTIMER *pTimer = (EXTIMER *)Timer;
+	LONG64 interval = -DueTime;
+	BOOLEAN rc;
+
+	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+	DDKASSERT(!pTimer->deleted && Period >= 0);
+
+	if (DueTime > 0) interval = DueTime - DdkQuerySystemTime();
+	if (interval < 0) interval = 0;
+
+	AcquireSRWLockExclusive(&pTimer->Lock);
+
+	rc = DdkCancelExTimer(pTimer);
+
+	pTimer->armed = true;
+	pTimer->Period = Period;
+	pTimer->due = DdkClockTime() + interval;
+	pTimer->wheel = (DdkVirtualTime != 0);
+
+	if (pTimer->wheel) {
+		LARGE_INTEGER due;
+
+		due.QuadPart = -interval;
+		KeSetTimerEx(pTimer->Timer, due, (LONG)((Period + 9999) / 10000), pTimer->Dpc);
+	}
+
+	else {
+		if (!Period) DdkBeginDeferred();
+		DdkArmExTimer(pTimer, interval);
+	}
+
+	ReleaseSRWLockExclusive(&pTimer->Lock);
+	return rc;
+}
+
+
+DDKAPI
+BOOLEAN ExCancelTimer(PEX_TIMER Timer, PEXT_CANCEL_PARAMETERS Parameters)
+{
+	EXTIMER *pTimer = (EXTIMER *)Timer;
+
+	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+	AcquireSRWLockExclusive(&pTimer->Lock);
+	BOOLEAN rc = DdkCancelExTimer(pTimer);
+	ReleaseSRWLockExclusive(&pTimer->Lock);
+
+	return rc;
+}
+
+
+/*
+ *	BOOLEAN ExDeleteTimer(PEX_TIMER Timer, BOOLEAN Cancel, BOOLEAN Wait,
+ *			PEXT_DELETE_PARAMETERS Parameters)
+ *
+ *	A one-shot timer that is not cancelled is freed after its callback
+ *	has run, and a waiting delete returns once that has happened. Periodic
+ *	timers, and timers in virtual time, which may never be reached, are
+ *	always cancelled.
+ */
+
+DDKAPI
+BOOLEAN ExDeleteTimer(PEX_TIMER Timer, BOOLEAN Cancel, BOOLEAN Wait, PEXT_DELETE_PARAMETERS Parameters)
+{
+	EXTIMER *pTimer = (EXTIMER *)Timer;
+	volatile LONG freed = 0;
+	BOOLEAN rc = FALSE;
+
+	DDKASSERT(KeGetCurrentIrql() <= ((Wait) ? PASSIVE_LEVEL : DISPATCH_LEVEL));
+
+	if (Parameters) {
+		pTimer->DeleteCallback = Parameters->DeleteCallback;
+		pTimer->DeleteContext = Parameters->DeleteContext;
+	}
+
+	AcquireSRWLockExclusive(&pTimer->Lock);
+
+	if (Cancel || pTimer->wheel || pTimer->Period)
+		rc = DdkCancelExTimer(pTimer);
+
+	bool expire = pTimer->armed;
+	pTimer->deleted = true;
+	if (expire && Wait) pTimer->freed = &freed;
+
+	ReleaseSRWLockExclusive(&pTimer->Lock);
+
+	// The threadpool wait and the final DPC free the timer on expiry
+
+	if (expire) {
+		for (LONG n; Wait && (n = freed) == 0; )
+			WaitOnAddress((PVOID)&freed, &n, sizeof(n), INFINITE);
+
+		return rc;
+	}
+
+	// Nothing can queue the DPC once the threadpool wait has stopped
+
+	SetThreadpoolWait(pTimer->Wait, NULL, NULL);
+	WaitForThreadpoolWaitCallbacks(pTimer->Wait, TRUE);
+	KeRemoveQueueDpc(pTimer->Dpc);
+
+	if (Wait) {
+		KeFlushQueuedDpcs();
+		DdkFreeExTimer(pTimer);
+	}
+
+	else KeInsertQueueDpc(pTimer->Dpc, EXTIMER_DELETE, NULL);
+
+	return rc;
+}
@@ -0,0 +1,271 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Fast Mutex and Push Lock Routines
+ */
+
+#include "stdafx.h"
+
+
+/*
+ *	Drivers initialise a fast mutex inline, setting the count to one and
+ *	initialising the event, so the layout must match the DDK. The count
+ *	is decremented to acquire the mutex, and goes negative as threads wait
+ *	on the event. A release that finds waiters sets the event, handing the
+ *	mutex to one of them. A guarded mutex is the same structure, acquired
+ *	in a guarded region rather than at APC_LEVEL.
+ */
+
+typedef struct _FASTMUTEX {
+	volatile LONG	Count;			// One when free
+	PVOID			Owner;
+	ULONG			Contention;
+	DISPATCH		Event;			// Synchronization event
+	ULONG			OldIrql;
+} FASTMUTEX;
+
+
+static void DdkAcquireFastMutex(FASTMUTEX *pMutex, PVOID pCaller)
+{
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+	bool contended = (InterlockedDecrement(&pMutex->Count) != 0);
+
+	if (contended) {
+		pMutex->Contention++;
+		KeWaitForSingleObject(&pMutex->Event, Executive, KernelMode, FALSE, NULL);
+	}
+
+	pMutex->Owner = KeGetCurrentThread();
+
+	if (start) DdkLockStatAcquire(pMutex, pCaller, LockFastMutex, start, contended);
+}
+
+
+static bool DdkTryToAcquireFastMutex(FASTMUTEX *pMutex, PVOID pCaller)
+{
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+
+	if (InterlockedCompareExchange(&pMutex->Count, 0, 1) != 1)
+		return false;
+
+	pMutex->Owner = KeGetCurrentThread();
+
+	if (start) DdkLockStatAcquire(pMutex, pCaller, LockFastMutex, start, false);
+	return true;
+}
+
+
+static void DdkReleaseFastMutex(FASTMUTEX *pMutex)
+{
+	DDKASSERT(pMutex->Owner == KeGetCurrentThread());
+
+	pMutex->Owner = NULL;
+
+	if (DdkLocksHeld) DdkLockStatRelease(pMutex);
+
+	if (InterlockedIncrement(&pMutex->Count) != 1)
+		KeSetEvent((PRKEVENT)&pMutex->Event, IO_NO_INCREMENT, FALSE);
+}
+
+
+DDKAPI
+VOID ExAcquireFastMutex(PFAST_MUTEX FastMutex)
+{
+	FASTMUTEX *pMutex = (FASTMUTEX *)FastMutex;
+	KIRQL irql;
+
+	KeRaiseIrql(APC_LEVEL, &irql);
+
+	DdkAcquireFastMutex(pMutex, _ReturnAddress());
+	pMutex->OldIrql = irql;
+}
+
+
+DDKAPI
+BOOLEAN ExTryToAcquireFastMutex(PFAST_MUTEX FastMutex)
+{
+	FASTMUTEX *pMutex = (FASTMUTEX *)FastMutex;
+	KIRQL irql;
+
+	KeRaiseIrql(APC_LEVEL, &irql);
+
+	if (!DdkTryToAcquireFastMutex(pMutex, _ReturnAddress())) {
+		KeLowerIrql(irql);
+		return FALSE;
+	}
+
+	pMutex->OldIrql = irql;
+	return TRUE;
+}
+
+
+DDKAPI
+VOID ExReleaseFastMutex(PFAST_MUTEX FastMutex)
+{
+	FASTMUTEX *pMutex = (FASTMUTEX *)FastMutex;
+	KIRQL irql = (KIRQL)pMutex->OldIrql;
+
+	DDKASSERT(KeGetCurrentIrql() == APC_LEVEL);
+
+	DdkReleaseFastMutex(pMutex);
+	KeLowerIrql(irql);
+}
+
+
+DDKAPI
+VOID ExAcquireFastMutexUnsafe(PFAST_MUTEX FastMutex)
+{
+	DDKASSERT(KeAreApcsDisabled());
+	DdkAcquireFastMutex((FASTMUTEX *)FastMutex, _ReturnAddress());
+}
+
+
+DDKAPI
+VOID ExReleaseFastMutexUnsafe(PFAST_MUTEX FastMutex)
+{
+	DDKASSERT(KeAreApcsDisabled());
+	DdkReleaseFastMutex((FASTMUTEX *)FastMutex);
+}
+
+
+DDKAPI
+VOID KeInitializeGuardedMutex(PKGUARDED_MUTEX Mutex)
+{
+	FASTMUTEX *pMutex = (FASTMUTEX *)Mutex;
+
+	pMutex->Count = 1;
+	pMutex->Owner = NULL;
+	pMutex->Contention = 0;
+	KeInitializeEvent((PRKEVENT)&pMutex->Event, SynchronizationEvent, FALSE);
+}
+
+
+DDKAPI
+VOID KeAcquireGuardedMutex(PKGUARDED_MUTEX Mutex)
+{
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+	KeEnterGuardedRegion();
+	DdkAcquireFastMutex((FASTMUTEX *)Mutex, _ReturnAddress());
+}
+
+
+DDKAPI
+BOOLEAN KeTryToAcquireGuardedMutex(PKGUARDED_MUTEX Mutex)
+{
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+	KeEnterGuardedRegion();
+
+	if (DdkTryToAcquireFastMutex((FASTMUTEX *)Mutex, _ReturnAddress()))
+		return TRUE;
+
+	KeLeaveGuardedRegion();
+	return FALSE;
+}
+
+
+DDKAPI
+VOID KeReleaseGuardedMutex(PKGUARDED_MUTEX Mutex)
+{
+	DdkReleaseFastMutex((FASTMUTEX *)Mutex);
+	KeLeaveGuardedRegion();
+}
+
+
+DDKAPI
+VOID KeAcquireGuardedMutexUnsafe(PKGUARDED_MUTEX Mutex)
+{
+	DDKASSERT(KeAreAllApcsDisabled());
+	DdkAcquireFastMutex((FASTMUTEX *)Mutex, _ReturnAddress());
+}
+
+
+DDKAPI
+VOID KeReleaseGuardedMutexUnsafe(PKGUARDED_MUTEX Mutex)
+{
+	DDKASSERT(KeAreAllApcsDisabled());
+	DdkReleaseFastMutex((FASTMUTEX *)Mutex);
+}
+
+
+/*
+ *	A push lock is a pointer sized lock that starts out as zero, as does a
+ *	slim reader/writer lock, which behaves the same way: shared or
+ *	exclusive, not recursive, and not fair. A contended acquire blocks as
+ *	a wait, so a thread counted by a queue gives up its place. As in the
+ *	kernel, it is held in a critical region.
+ */
+
+DDKAPI
+VOID ExInitializePushLock(PEX_PUSH_LOCK PushLock)
+{
+	InitializeSRWLock((PSRWLOCK)PushLock);
+}
+
+
+DDKAPI
+VOID ExAcquirePushLockExclusiveEx(PEX_PUSH_LOCK PushLock, ULONG Flags)
+{
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+	DDKASSERT(KeAreApcsDisabled());
+
+	bool contended = !TryAcquireSRWLockExclusive((PSRWLOCK)PushLock);
+
+	if (contended) {
+		DdkQueueBlock();
+		AcquireSRWLockExclusive((PSRWLOCK)PushLock);
+		DdkQueueUnblock();
+	}
+
+	if (start) DdkLockStatAcquire(PushLock, _ReturnAddress(), LockPushLock, start, contended);
+}
+
+
+DDKAPI
+VOID ExAcquirePushLockSharedEx(PEX_PUSH_LOCK PushLock, ULONG Flags)
+{
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+	DDKASSERT(KeAreApcsDisabled());
+
+	bool contended = !TryAcquireSRWLockShared((PSRWLOCK)PushLock);
+
+	if (contended) {
+		DdkQueueBlock();
+		AcquireSRWLockShared((PSRWLOCK)PushLock);
+		DdkQueueUnblock();
+	}
+
+	if (start) DdkLockStatAcquire(PushLock, _ReturnAddress(), LockPushLock, start, contended);
+}
+
+
+DDKAPI
+VOID ExReleasePushLockExclusiveEx(PEX_PUSH_LOCK PushLock, ULONG Flags)
+{
+	DDKASSERT(KeAreApcsDisabled());
+
+	if (DdkLocksHeld) DdkLockStatRelease(PushLock);
+	ReleaseSRWLockExclusive((PSRWLOCK)PushLock);
+}
+
+
+DDKAPI
+VOID ExReleasePushLockSharedEx(PEX_PUSH_LOCK PushLock, ULONG Flags)
+{
+	DDKASSERT(KeAreApcsDisabled());
+
+	if (DdkLocksHeld) DdkLockStatRelease(PushLock);
+	ReleaseSRWLockShared((PSRWLOCK)PushLock);
+}
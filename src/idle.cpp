@@ -0,0 +1,94 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Idle Routines
+ */
+
+#include "stdafx.h"
+
+
+/*
+ *	Queued DPCs, pending one-shot timers, queued work items and deferred
+ *	deletes each hold a count until they have completed. Work that queues
+ *	further work takes the new count before releasing its own, so the
+ *	count only reaches zero once everything has drained.
+ */
+
+static volatile LONG DeferredWork;
+
+
+void DdkBeginDeferred()
+{
+	InterlockedIncrement(&DeferredWork);
+	if (DdkVirtualTime) DdkVirtualActivity();
+}
+
+
+void DdkEndDeferred()
+{
+	LONG count = InterlockedDecrement(&DeferredWork);
+
+	DDKASSERT(count >= 0);
+	if (!count) WakeByAddressAll((PVOID)&DeferredWork);
+	if (DdkVirtualTime) DdkVirtualActivity();
+}
+
+
+LONG DdkDeferredWork()
+{
+	return DeferredWork;
+}
+
+
+/*
+ *	NTSTATUS DdkWaitForIdle(PLARGE_INTEGER Timeout)
+ *
+ *	Wait until all outstanding deferred work has completed. Periodic
+ *	timers are never idle and are not waited for.
+ */
+
+DDKAPI
+NTSTATUS DdkWaitForIdle(PLARGE_INTEGER Timeout)
+{
+	DWORD wait = DdkGetWaitTime(Timeout);
+	ULONGLONG start = GetTickCount64();
+	LONG count;
+
+	// Deferred work waiting for itself would never complete
+
+	DDKASSERT(!DdkIsDpc() && !DdkIsWorkItem());
+
+	// Pending timers only expire in virtual time if it can advance
+
+	bool waiter = (DdkVirtualTime != 0);
+	NTSTATUS status = STATUS_SUCCESS;
+
+	if (waiter) DdkBeginVirtualWait();
+
+	while ((count = DeferredWork) != 0) {
+		DWORD remaining = INFINITE;
+
+		if (wait != INFINITE) {
+			ULONGLONG elapsed = GetTickCount64() - start;
+
+			if (elapsed >= wait) {
+				status = STATUS_TIMEOUT;
+				break;
+			}
+
+			remaining = (DWORD)(wait - elapsed);
+		}
+
+		WaitOnAddress((PVOID)&DeferredWork, &count, sizeof(count), remaining);
+	}
+
+	if (waiter) DdkEndVirtualWait();
+	return status;
+}
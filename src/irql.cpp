@@ -19,6 +19,9 @@
 
 __declspec(thread) KIRQL DdkCurrentIrql = PASSIVE_LEVEL;
 
+static __declspec(thread) LONG DdkKernelApcDisable;
+static __declspec(thread) LONG DdkSpecialApcDisable;
+
 
 #ifndef _DDKINLINE_
 DDKAPI
@@ -88,3 +91,53 @@ KIRQL DdkRaiseIrqlToDpcLevel()
 {
 	return KfRaiseIrql(DISPATCH_LEVEL);
 }
+
+
+/*
+ *	No APCs are delivered, but critical and guarded regions are counted
+ *	so that locks that need APCs disabled can check that they are.
+ */
+
+DDKAPI
+VOID KeEnterCriticalRegion()
+{
+	DdkKernelApcDisable++;
+}
+
+
+DDKAPI
+VOID KeLeaveCriticalRegion()
+{
+	DDKASSERT(DdkKernelApcDisable > 0);
+	DdkKernelApcDisable--;
+}
+
+
+DDKAPI
+VOID KeEnterGuardedRegion()
+{
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+	DdkSpecialApcDisable++;
+}
+
+
+DDKAPI
+VOID KeLeaveGuardedRegion()
+{
+	DDKASSERT(DdkSpecialApcDisable > 0);
+	DdkSpecialApcDisable--;
+}
+
+
+DDKAPI
+BOOLEAN KeAreApcsDisabled()
+{
+	return (DdkKernelApcDisable || DdkSpecialApcDisable || DdkCurrentIrql >= APC_LEVEL);
+}
+
+
+DDKAPI
+BOOLEAN KeAreAllApcsDisabled()
+{
+	return (DdkSpecialApcDisable || DdkCurrentIrql >= APC_LEVEL);
+}
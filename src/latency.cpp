@@ -0,0 +1,259 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Latency Statistics Routines
+ */
+
+#include "stdafx.h"
+#include <intrin.h>
+
+
+/*
+ *	Deferred work is recorded against the routine that runs it. Latency
+ *	is the time from queueing (or timer expiry) to the routine starting,
+ *	and runtime is the time spent in the routine. Both are kept as
+ *	log-linear histograms in microseconds: exact below 16us, then eight
+ *	buckets per power of two, which is close enough for percentiles.
+ */
+
+#define LAT_COUNT		256
+#define LAT_PROBES		16
+#define LAT_EXACT		16
+#define LAT_SUB			8
+#define LAT_BUCKETS		(LAT_EXACT + LAT_SUB * 32)
+
+typedef struct DECLSPEC_ALIGN(16) _LATENCY {
+	PVOID volatile	routine;
+	volatile LONG64	type;			// Type + 1 once claimed
+	volatile LONG64	count;
+	volatile LONG64	maxlatency;		// Microseconds
+	volatile LONG64	maxruntime;
+	volatile LONG	latency[LAT_BUCKETS];
+	volatile LONG	runtime[LAT_BUCKETS];
+} LATENCY;
+
+
+static LATENCY latv[LAT_COUNT];
+static volatile LONG64 dropped;
+static LONG64 frequency;
+
+
+LONG64 DdkLatencyTime()
+{
+	return DdkReadCounter();
+}
+
+
+static LONG64 DdkLatencyFrequency()
+{
+	if (!frequency) {
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency = f.QuadPart;
+	}
+
+	return frequency;
+}
+
+
+LONG64 DdkLatencyTicks(LONG64 Interval)
+{
+	return Interval * DdkLatencyFrequency() / 10000000;
+}
+
+
+static ULONG DdkLatencyBucket(ULONG64 us)
+{
+	ULONG e;
+
+	if (us < LAT_EXACT) return (ULONG)us;
+
+	_BitScanReverse64(&e, us);
+
+	ULONG b = LAT_EXACT + (e - 4) * LAT_SUB + (ULONG)((us >> (e - 3)) & (LAT_SUB - 1));
+	return (b < LAT_BUCKETS) ? b : LAT_BUCKETS - 1;
+}
+
+
+static ULONG64 DdkLatencyValue(ULONG b)
+{
+	if (b < LAT_EXACT) return b;
+
+	ULONG e = (b - LAT_EXACT) / LAT_SUB + 4;
+	ULONG sub = (b - LAT_EXACT) % LAT_SUB;
+
+	return ((ULONG64)(LAT_SUB + sub + 1) << (e - 3)) - 1;
+}
+
+
+static LATENCY *DdkFindLatency(PVOID Routine, ULONG Type, bool create)
+{
+	ULONG64 key = (ULONG64)Routine ^ Type;
+	ULONG i = (ULONG)((key * 0x9E3779B97F4A7C15ULL) >> 56);
+
+	for (int n = 0; n < LAT_PROBES; n++, i = (i + 1) % LAT_COUNT) {
+		LATENCY *pLat = &latv[i];
+
+		if (pLat->routine == Routine && pLat->type == Type + 1)
+			return pLat;
+
+		if (!pLat->routine) {
+			LONG64 compare[2] = { 0, 0 };
+
+			if (!create) return NULL;
+
+			if (InterlockedCompareExchange128((volatile LONG64 *)pLat,
+					(LONG64)Type + 1, (LONG64)Routine, compare))
+				return pLat;
+
+			if (pLat->routine == Routine && pLat->type == Type + 1)
+				return pLat;
+		}
+	}
+
+	if (create) InterlockedIncrement64(&dropped);
+	return NULL;
+}
+
+
+static void DdkLatencyMax(volatile LONG64 *pMax, LONG64 v)
+{
+	LONG64 max;
+
+	while ((max = *pMax) < v)
+		if (InterlockedCompareExchange64(pMax, v, max) == max)
+			break;
+}
+
+
+/*
+ *	void DdkRecordLatency(PVOID Routine, ULONG Type, LONG64 Queued, LONG64 Start, LONG64 End)
+ *
+ *	Record one run of a routine. Times are from DdkLatencyTime, and End is
+ *	zero when there is no runtime to record.
+ */
+
+void DdkRecordLatency(PVOID Routine, ULONG Type, LONG64 Queued, LONG64 Start, LONG64 End)
+{
+	LATENCY *pLat = DdkFindLatency(Routine, Type, true);
+	LONG64 f = DdkLatencyFrequency();
+
+	if (!pLat) return;
+
+	LONG64 latency = (Start > Queued) ? (Start - Queued) * 1000000 / f : 0;
+
+	InterlockedIncrement64(&pLat->count);
+	InterlockedIncrement(&pLat->latency[DdkLatencyBucket(latency)]);
+	DdkLatencyMax(&pLat->maxlatency, latency);
+
+	if (End) {
+		LONG64 runtime = (End > Start) ? (End - Start) * 1000000 / f : 0;
+
+		InterlockedIncrement(&pLat->runtime[DdkLatencyBucket(runtime)]);
+		DdkLatencyMax(&pLat->maxruntime, runtime);
+	}
+}
+
+
+static ULONG64 DdkLatencyPercentile(volatile LONG *hist, ULONG PerMille)
+{
+	ULONG64 total = 0, sum = 0;
+
+	for (ULONG b = 0; b < LAT_BUCKETS; b++)
+		total += hist[b];
+
+	if (!total) return 0;
+
+	ULONG64 target = (total * PerMille + 999) / 1000;
+
+	for (ULONG b = 0; b < LAT_BUCKETS; b++)
+		if ((sum += hist[b]) >= target && sum)
+			return DdkLatencyValue(b);
+
+	return DdkLatencyValue(LAT_BUCKETS - 1);
+}
+
+
+/*
+ *	BOOLEAN DdkQueryLatency(PVOID Routine, ULONG Type, ULONG PerMille,
+ *			PULONG64 Latency, PULONG64 Runtime)
+ *
+ *	Return the given percentile, in parts per thousand, of the latency and
+ *	runtime of a routine in microseconds. Values are the upper bound of
+ *	the histogram bucket holding the percentile.
+ */
+
+DDKAPI
+BOOLEAN DdkQueryLatency(PVOID Routine, ULONG Type, ULONG PerMille, PULONG64 Latency, PULONG64 Runtime)
+{
+	LATENCY *pLat = DdkFindLatency(Routine, Type, false);
+
+	if (!pLat || !pLat->count || PerMille > 1000)
+		return FALSE;
+
+	if (Latency) *Latency = DdkLatencyPercentile(pLat->latency, PerMille);
+	if (Runtime) *Runtime = DdkLatencyPercentile(pLat->runtime, PerMille);
+	return TRUE;
+}
+
+
+static int __cdecl DdkCompareLatency(const void *p1, const void *p2)
+{
+	const LATENCY *l1 = *(const LATENCY **)p1, *l2 = *(const LATENCY **)p2;
+
+	if (l1->maxruntime != l2->maxruntime) return (l1->maxruntime < l2->maxruntime) ? 1 : -1;
+	if (l1->maxlatency != l2->maxlatency) return (l1->maxlatency < l2->maxlatency) ? 1 : -1;
+	return 0;
+}
+
+
+DDKAPI
+VOID DdkReportLatency()
+{
+	static const char *type[] = { "dpc", "workitem", "timer" };
+	LATENCY **vec = (LATENCY **)malloc(LAT_COUNT * sizeof(LATENCY *));
+	int n = 0;
+
+	if (!vec) return;
+
+	for (int i = 0; i < LAT_COUNT; i++)
+		if (latv[i].routine && latv[i].count) vec[n++] = &latv[i];
+
+	qsort(vec, n, sizeof(vec[0]), DdkCompareLatency);
+
+	for (int i = 0; i < n; i++) {
+		LATENCY *p = vec[i];
+		ULONG t = (ULONG)p->type - 1;
+		char addr[MAX_PATH + 32];
+
+		DdkPrint("DDK: %s %s count %I64d latency p50 %I64dus p99 %I64dus p999 %I64dus max %I64dus"
+			" runtime p50 %I64dus p99 %I64dus p999 %I64dus max %I64dus",
+			(t < DDK_LATENCY_TYPES) ? type[t] : "?",
+			DdkFormatAddress(p->routine, addr, sizeof(addr)), p->count,
+			DdkLatencyPercentile(p->latency, 500), DdkLatencyPercentile(p->latency, 990),
+			DdkLatencyPercentile(p->latency, 999), p->maxlatency,
+			DdkLatencyPercentile(p->runtime, 500), DdkLatencyPercentile(p->runtime, 990),
+			DdkLatencyPercentile(p->runtime, 999), p->maxruntime);
+	}
+
+	free(vec);
+
+	if (dropped) DdkPrint("DDK: latency stats dropped %I64d runs", dropped);
+}
+
+
+DDKAPI
+VOID DdkResetLatency()
+{
+	for (int i = 0; i < LAT_COUNT; i++)
+		if (latv[i].routine) memset(&latv[i], 0, sizeof(LATENCY));
+
+	dropped = 0;
+}
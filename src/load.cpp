@@ -22,13 +22,23 @@ typedef struct _DELAYLOAD {
 
 static const int maxmodules = 100;
 
+#define IMAGE_PAGE		0x1000
+
+enum { PageTracked = 0x01, PageDirty = 0x02, PageExecute = 0x04 };
+
 typedef struct _IMAGE {
 	struct _IMAGE *Next;
 	HMODULE h;
 	PIMAGE_NT_HEADERS64 Header;
 	PDRIVER_INITIALIZE DriverEntry;
 	DELAYLOAD DelayLoad[maxmodules];
-	char *Data;
+	PVOID Patch;
+	bool Shared;					// Holds the private shared data page
+	char *Data;						// Taken at load, restored on unload
+	char *State;					// Taken after DriverEntry, restored on reset
+	char *Synced;					// The copy that clean pages match
+	char *Saved;					// Taken by DdkCheckpoint
+	BYTE *Pages;
 	char Name[1];
 } IMAGE, *PIMAGE;
 
@@ -36,16 +46,21 @@ IMAGE *DdkImageList;
 
 
 void DdkSaveImageData(PIMAGE pImage);
-void DdkRestoreImageData(PIMAGE pImage);
-char *DdkReadImage(char *pPath, DWORD *pSize);
+void DdkSyncImageData(PIMAGE pImage, char *pData, bool save);
+char *DdkReadImage(char *pPath, DWORD *pSize, FILETIME *pTime);
+ULONG64 DdkHashImage(char *pBuffer, DWORD size, FILETIME *pTime);
+bool DdkCacheImage(char *pBuffer, char *pLoad, DWORD size);
 void DdkUpdateImage(char *pBuffer, DWORD size, DWORD *pEntry);
+void DdkPatchSharedData(char *pBuffer, DWORD size);
 bool DdkWriteImage(char *pBuffer, char *pLoad, DWORD size);
 bool DdkGetWriteTime(char *pPath, FILETIME *pTime);
 NTSTATUS DdkDetachAddressRange(PVOID pAddr, size_t len, HMODULE module);
 HMODULE DdkFindModule(PVOID pAddr);
 char *DdkFindDLLName(HMODULE h, char *pName);
+void DdkFlushFaultSites(PVOID pAddr, size_t len);
 
 static CRITICAL_SECTION Lock;
+static SRWLOCK ImageLock = SRWLOCK_INIT;		// Image list and page tracking
 
 
 void DdkLoadInit()
@@ -75,16 +90,36 @@ PIMAGE DdkLoadImage(char *pPath, char *pName)
 	for (PIMAGE pEntry = DdkImageList; pEntry; pEntry = pEntry->Next)
 		if (!_stricmp(pEntry->Name, pName)) return pEntry;
 
-	char *pBuffer = DdkReadImage(pPath, &size);
+	FILETIME time;
+	char *pBuffer = DdkReadImage(pPath, &size, &time);
 
 	if (!pBuffer)
 		ddkfail("Unable to read driver file");
 
-	DdkUpdateImage(pBuffer, size, &entry);
-	DdkGetLocalPath(tmp, sizeof(tmp), "C:\\Windows\\System32\\drivers", pName, ".sys");
+	// The shared data page cannot change while the image is loaded
+
+	bool shared = DdkHoldSharedData();
+
+	// Use a previously prepared image if one is available
+
+	bool cached = DdkGetCachePath(tmp, sizeof(tmp),
+		DdkHashImage(pBuffer, size, &time), pName, ".sys");
+
+	if (cached && GetFileAttributes(tmp) != INVALID_FILE_ATTRIBUTES) {
+		PIMAGE_NT_HEADERS64 pHdr = (PIMAGE_NT_HEADERS64)(&pBuffer[((PIMAGE_DOS_HEADER)pBuffer)->e_lfanew]);
+		entry = pHdr->OptionalHeader.AddressOfEntryPoint;
+	}
+
+	else {
+		DdkUpdateImage(pBuffer, size, &entry);
+
+		if (!cached || !DdkCacheImage(pBuffer, tmp, size)) {
+			DdkGetLocalPath(tmp, sizeof(tmp), "C:\\Windows\\System32\\drivers", pName, ".sys");
 
-	if (!DdkWriteImage(pBuffer, tmp, size))
-		ddkfail("Unable to write driver file");
+			if (!DdkWriteImage(pBuffer, tmp, size))
+				ddkfail("Unable to write driver file");
+		}
+	}
 
 	free(pBuffer);
 
@@ -97,11 +132,17 @@ PIMAGE DdkLoadImage(char *pPath, char *pName)
 	p->Header = (PIMAGE_NT_HEADERS64)((ULONG_PTR)h + ((PIMAGE_DOS_HEADER)h)->e_lfanew);
 	p->DriverEntry = (PDRIVER_INITIALIZE)((ULONG_PTR)h + (ULONG_PTR)entry);
 	p->Next = DdkImageList;
+	p->Patch = DdkPatchImage(h);
+	p->Shared = shared;
 	p->h = h;
 
 	strcpy(p->Name, pName);
 	DdkSaveImageData(p);
+
+	AcquireSRWLockExclusive(&ImageLock);
 	DdkImageList = p;
+	ReleaseSRWLockExclusive(&ImageLock);
+
 	return p;
 }
 
@@ -167,7 +208,7 @@ static bool isSaveData(PIMAGE_SECTION_HEADER p)
 }
 
 
-static void DdkSaveImageData(PIMAGE pImage)
+static char *DdkAllocImageData(PIMAGE pImage)
 {
 	PIMAGE_SECTION_HEADER pSection = IMAGE_FIRST_SECTION(pImage->Header);
 	DWORD len = 0;
@@ -175,37 +216,170 @@ static void DdkSaveImageData(PIMAGE pImage)
 	for (int i = 0; i < pImage->Header->FileHeader.NumberOfSections; i++)
 		if (isSaveData(&pSection[i])) len += pSection[i].Misc.VirtualSize;
 
-	if (!len) return;
+	char *cp = (len) ? (char *)malloc(len) : NULL;
+
+	if (len && !cp) ddkfail("Unable to save image data");
+	return cp;
+}
 
-	pImage->Data = (char *)malloc(len);
-	char *cp = pImage->Data;
 
-	if (!cp) ddkfail("Unable to save image data");
+static void DdkCopyImageData(PIMAGE pImage, char *cp, bool save)
+{
+	PIMAGE_SECTION_HEADER pSection = IMAGE_FIRST_SECTION(pImage->Header);
+
+	if (!cp) return;
 
 	for (int i = 0; i < pImage->Header->FileHeader.NumberOfSections; i++)
 		if (isSaveData(&pSection[i])) {
-			memcpy(cp, (char *)(pImage->h) + pSection[i].VirtualAddress, pSection[i].Misc.VirtualSize);
+			char *pBase = (char *)(pImage->h) + pSection[i].VirtualAddress;
+
+			if (save) memcpy(cp, pBase, pSection[i].Misc.VirtualSize);
+			else memcpy(pBase, cp, pSection[i].Misc.VirtualSize);
+
 			cp += pSection[i].Misc.VirtualSize;
 		}
 }
 
 
-static void DdkRestoreImageData(PIMAGE pImage)
+static void DdkSaveImageData(PIMAGE pImage)
+{
+	pImage->Data = DdkAllocImageData(pImage);
+	DdkCopyImageData(pImage, pImage->Data, true);
+}
+
+
+/*
+ *	Driver data can be reset without reloading the image. Once DriverEntry
+ *	has run the writable sections are copied, and on the first reset or
+ *	checkpoint they are made read only. A write then marks the page dirty
+ *	and makes it writable again, so later syncs with the same copy only
+ *	need the dirty pages. Writes from system calls do not fault, so a
+ *	driver passing its own globals to Win32 I/O must not rely on this once
+ *	it has been reset or checkpointed. Drivers that are never reset keep
+ *	their data writable.
+ *
+ *	The fault handler looks pages up under the image lock, which is also
+ *	held while the tracking changes, but never waits for the load lock.
+ */
+
+static void DdkSyncImageData(PIMAGE pImage, char *pData, bool save)
 {
 	PIMAGE_SECTION_HEADER pSection = IMAGE_FIRST_SECTION(pImage->Header);
-	char *cp = pImage->Data;
+	IMAGE_OPTIONAL_HEADER64 *pOpt = &pImage->Header->OptionalHeader;
+	bool all = (pImage->Synced != pData);
+	char *cp = pData;
 
 	if (!cp) return;
 
-	for (int i = 0; i < pImage->Header->FileHeader.NumberOfSections; i++)
-		if (isSaveData(&pSection[i])) {
-			memcpy((char *)(pImage->h) + pSection[i].VirtualAddress, cp, pSection[i].Misc.VirtualSize);
-			cp += pSection[i].Misc.VirtualSize;
+	AcquireSRWLockExclusive(&ImageLock);
+
+	// Sections sharing a page cannot be protected separately
+
+	if (!pImage->Pages && pOpt->SectionAlignment >= IMAGE_PAGE) {
+		pImage->Pages = (BYTE *)calloc((pOpt->SizeOfImage + IMAGE_PAGE - 1) / IMAGE_PAGE, 1);
+		if (!pImage->Pages) ddkfail("Unable to allocate page tracking");
+	}
+
+	for (int i = 0; i < pImage->Header->FileHeader.NumberOfSections; i++) {
+		if (!isSaveData(&pSection[i])) continue;
+
+		char *pBase = (char *)(pImage->h) + pSection[i].VirtualAddress;
+		DWORD len = pSection[i].Misc.VirtualSize, prot;
+		BYTE *pState = (pImage->Pages) ? &pImage->Pages[pSection[i].VirtualAddress / IMAGE_PAGE] : NULL;
+		bool exec = (pSection[i].Characteristics & IMAGE_SCN_MEM_EXECUTE) != 0;
+
+		for (DWORD offset = 0, page = 0; offset < len; offset += IMAGE_PAGE, page++) {
+			BYTE state = (pState) ? pState[page] : 0;
+
+			if (!all && !(state & PageDirty)) continue;
+
+			DWORD n = (len - offset < IMAGE_PAGE) ? len - offset : IMAGE_PAGE;
+
+			if (save) memcpy(cp + offset, pBase + offset, n);
+
+			else {
+				if ((state & PageTracked) && !(state & PageDirty))
+					VirtualProtect(pBase + offset, n, (exec) ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE, &prot);
+
+				memcpy(pBase + offset, cp + offset, n);
+			}
+
+			if (pState && VirtualProtect(pBase + offset, n, (exec) ? PAGE_EXECUTE_READ : PAGE_READONLY, &prot))
+				pState[page] = PageTracked | ((exec) ? PageExecute : 0);
 		}
+
+		cp += len;
+	}
+
+	pImage->Synced = pData;
+	ReleaseSRWLockExclusive(&ImageLock);
+}
+
+
+void DdkSnapshotImageData(PIMAGE pImage)
+{
+	// Tracking starts with the first sync, which copies every page
+
+	if (!pImage->State) pImage->State = DdkAllocImageData(pImage);
+	DdkCopyImageData(pImage, pImage->State, true);
+}
+
+
+void DdkResetImageData(PIMAGE pImage)
+{
+	DdkSyncImageData(pImage, pImage->State, false);
+}
+
+
+void DdkCheckpointImages()
+{
+	for (PIMAGE p = DdkImageList; p; p = p->Next) {
+		if (!p->Saved) p->Saved = DdkAllocImageData(p);
+		DdkSyncImageData(p, p->Saved, true);
+	}
+}
+
+
+void DdkRestoreImages()
+{
+	// Images loaded since the checkpoint are left alone
+
+	for (PIMAGE p = DdkImageList; p; p = p->Next)
+		DdkSyncImageData(p, p->Saved, false);
 }
 
 
-static char *DdkReadImage(char *pPath, DWORD *pSize)
+bool DdkTrackImageWrite(PVOID pAddr)
+{
+	bool tracked = false;
+
+	AcquireSRWLockShared(&ImageLock);
+
+	for (PIMAGE p = DdkImageList; p; p = p->Next) {
+		ULONG_PTR offset = (ULONG_PTR)pAddr - (ULONG_PTR)p->h;
+
+		if (offset >= p->Header->OptionalHeader.SizeOfImage) continue;
+		if (!p->Pages || !(p->Pages[offset / IMAGE_PAGE] & PageTracked)) break;
+
+		volatile BYTE *pState = &p->Pages[offset / IMAGE_PAGE];
+		char *pPage = (char *)p->h + (offset & ~(ULONG_PTR)(IMAGE_PAGE - 1));
+		DWORD prot;
+
+		// Another thread may have faulted on the same page
+
+		tracked = (*pState & PageDirty) || VirtualProtect(pPage, IMAGE_PAGE,
+			(*pState & PageExecute) ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE, &prot);
+
+		if (tracked) InterlockedOr8((volatile char *)pState, PageDirty);
+		break;
+	}
+
+	ReleaseSRWLockShared(&ImageLock);
+	return tracked;
+}
+
+
+static char *DdkReadImage(char *pPath, DWORD *pSize, FILETIME *pTime)
 {
 	HANDLE h = CreateFile(pPath, GENERIC_READ, FILE_SHARE_READ,
 		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -234,16 +408,96 @@ static char *DdkReadImage(char *pPath, DWORD *pSize)
 	}
 
 	CloseHandle(h);
+	*pTime = info.ftLastWriteTime;
 	return pBuffer;
 }
 
 
+static ULONG64 DdkHash(ULONG64 hash, const void *pData, size_t len)
+{
+	const BYTE *cp = (const BYTE *)pData;
+
+	for (; len >= sizeof(ULONG64); cp += sizeof(ULONG64), len -= sizeof(ULONG64)) {
+		hash = (hash ^ *(const ULONG64 UNALIGNED *)cp) * 0x100000001b3ULL;
+		hash ^= hash >> 32;
+	}
+
+	for (; len; cp++, len--)
+		hash = (hash ^ *cp) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+
+static ULONG64 DdkHashImage(char *pBuffer, DWORD size, FILETIME *pTime)
+{
+	// Prepared images depend on the driver, the version of ddk.dll and
+	// the shared data page that its references were redirected to
+
+	HMODULE ddk = DdkFindModule((PVOID)DdkHashImage);
+	ULONG64 hash = 0xcbf29ce484222325ULL;
+
+	if (ddk) {
+		PIMAGE_NT_HEADERS64 pHdr = (PIMAGE_NT_HEADERS64)((ULONG_PTR)ddk
+			+ ((PIMAGE_DOS_HEADER)ddk)->e_lfanew);
+
+		hash = DdkHash(hash, &pHdr->FileHeader.TimeDateStamp, sizeof(DWORD));
+		hash = DdkHash(hash, &pHdr->OptionalHeader.SizeOfImage, sizeof(DWORD));
+	}
+
+	hash = DdkHash(hash, &DdkSharedUserData, sizeof(ULONG64));
+	hash = DdkHash(hash, pTime, sizeof(FILETIME));
+	return DdkHash(hash, pBuffer, size);
+}
+
+
+char *DdkFileAddress(char *pBuffer, DWORD size, DWORD rva, DWORD len)
+{
+	PIMAGE_NT_HEADERS64 pHdr = (PIMAGE_NT_HEADERS64)(&pBuffer[((PIMAGE_DOS_HEADER)pBuffer)->e_lfanew]);
+	PIMAGE_SECTION_HEADER pSection = IMAGE_FIRST_SECTION(pHdr);
+	DWORD offset = rva;
+
+	// Convert a relative virtual address to an offset in the file
+
+	if (rva >= pHdr->OptionalHeader.SizeOfHeaders) {
+		int i;
+
+		for (i = 0; i < pHdr->FileHeader.NumberOfSections; i++)
+			if (rva >= pSection[i].VirtualAddress
+					&& rva - pSection[i].VirtualAddress < pSection[i].SizeOfRawData) break;
+
+		if (i == pHdr->FileHeader.NumberOfSections) return NULL;
+		offset = rva - pSection[i].VirtualAddress + pSection[i].PointerToRawData;
+	}
+
+	if (offset > size || len > size - offset) return NULL;
+	return &pBuffer[offset];
+}
+
+
+static void DdkRenameImport(char *pBuffer, DWORD size, DWORD rva)
+{
+	static const char *kernel[] = { "ntoskrnl.exe", "hal.dll", "wmilib.sys" };
+
+	for (size_t i = 0; i < sizeof(kernel) / sizeof(kernel[0]); i++) {
+		DWORD len = (DWORD)strlen(kernel[i]) + 1;
+		char *pName = DdkFileAddress(pBuffer, size, rva, len);
+
+		if (pName && !_strnicmp(pName, kernel[i], len)) {
+			strcpy(pName, "ddk.dll");
+			return;
+		}
+	}
+}
+
+
 static void DdkUpdateImage(char *pBuffer, DWORD size, DWORD *pEntry)
 {
 	// Set DLL flag
 
 	PIMAGE_DOS_HEADER pDos = (PIMAGE_DOS_HEADER)pBuffer;
 	PIMAGE_NT_HEADERS64 pHdr = (PIMAGE_NT_HEADERS64)(&pBuffer[pDos->e_lfanew]);
+	IMAGE_DATA_DIRECTORY *pDir = pHdr->OptionalHeader.DataDirectory;
 
 	pHdr->FileHeader.Characteristics |= IMAGE_FILE_DLL;
 
@@ -254,26 +508,31 @@ static void DdkUpdateImage(char *pBuffer, DWORD size, DWORD *pEntry)
 
 	// Link against ddk.dll
 
-	for (DWORD i = 0; i < size; i++) {
-		if (!_strnicmp(&pBuffer[i], "ntoskrnl.exe", 12))
-			strcpy(&pBuffer[i], "ddk.dll");
-		
-		else if (!_strnicmp(&pBuffer[i], "hal.dll", 7))
-			strcpy(&pBuffer[i], "ddk.dll");
+	PIMAGE_IMPORT_DESCRIPTOR pImport;
+	DWORD rva = pDir[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress;
 
-		else if (!_strnicmp(&pBuffer[i], "wmilib.sys", 10))
-			strcpy(&pBuffer[i], "ddk.dll");
-	}
+	if (pDir[IMAGE_DIRECTORY_ENTRY_IMPORT].Size)
+		for (; (pImport = (PIMAGE_IMPORT_DESCRIPTOR)DdkFileAddress(pBuffer, size,
+				rva, sizeof(*pImport))) != NULL && pImport->Name; rva += sizeof(*pImport))
+			DdkRenameImport(pBuffer, size, pImport->Name);
 
-	// Edit references to USER_SHARED_DATA
+	PImgDelayDescr pDelay;
+	rva = pDir[IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT].VirtualAddress;
+
+	if (pDir[IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT].Size)
+		for (; (pDelay = (PImgDelayDescr)DdkFileAddress(pBuffer, size,
+				rva, sizeof(*pDelay))) != NULL && pDelay->rvaDLLName; rva += sizeof(*pDelay))
+			DdkRenameImport(pBuffer, size, (pDelay->grAttrs & dlattrRva) ? pDelay->rvaDLLName
+				: pDelay->rvaDLLName - (DWORD)pHdr->OptionalHeader.ImageBase);
 
-	unsigned char from[] = { 0x00, 0x00, 0x80, 0xf7, 0xff, 0xff };
-	unsigned char to[] = { 0xfe, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+	// Bound imports refer to the original module names
 
-	for (DWORD i = 0; i < size; i++)
-		if (!memcmp(&pBuffer[i], from, sizeof(from)))
-			if (i > 1 && (unsigned char)pBuffer[i-1] < 0x80)
-				memcpy(&pBuffer[i], to, sizeof(to));
+	pDir[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT].VirtualAddress = 0;
+	pDir[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT].Size = 0;
+
+	// Edit references to USER_SHARED_DATA
+
+	DdkPatchSharedData(pBuffer, size);
 }
 
 
@@ -297,10 +556,30 @@ static bool DdkWriteImage(char *pBuffer, char *pLoad, DWORD size)
 }
 
 
+static bool DdkCacheImage(char *pBuffer, char *pLoad, DWORD size)
+{
+	char tmp[MAX_PATH+1];
+
+	// Write under a private name, so other processes never see a partial image
+
+	size_t n = snprintf(tmp, sizeof(tmp), "%s.%x", pLoad, GetCurrentProcessId());
+	if (n > sizeof(tmp) - 1 || !DdkWriteImage(pBuffer, tmp, size)) return false;
+
+	if (!MoveFileEx(tmp, pLoad, 0)) {
+		DeleteFile(tmp);
+		return GetFileAttributes(pLoad) != INVALID_FILE_ATTRIBUTES;
+	}
+
+	return true;
+}
+
+
 VOID DdkUnloadImage(PIMAGE pImage)
 {
 	IMAGE_OPTIONAL_HEADER64 *pOpt = &pImage->Header->OptionalHeader;
 	PDELAYLOAD pDelay = pImage->DelayLoad;
+	PVOID base = (PVOID)pImage->h;
+	size_t size = pOpt->SizeOfImage;
 	HMODULE h;
 
 	// Check for residual references
@@ -319,17 +598,29 @@ VOID DdkUnloadImage(PIMAGE pImage)
 	FreeLibrary(pImage->h);
 
 	if (GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)pImage->h, &h)) {
-		DdkRestoreImageData(pImage);
+		if (pImage->Pages) DdkSyncImageData(pImage, pImage->Data, false);
+		else DdkCopyImageData(pImage, pImage->Data, false);
 		return;
 	}
 
+	AcquireSRWLockExclusive(&ImageLock);
+
 	for (PIMAGE *ppEntry = &DdkImageList; *ppEntry; ppEntry = &(*ppEntry)->Next)
 		if (*ppEntry == pImage) {
 			*ppEntry = pImage->Next;
 			break;
 		}
 
+	ReleaseSRWLockExclusive(&ImageLock);
+
+	DdkFlushFaultSites(base, size);
+	DdkUnpatchImage(pImage->Patch);
+	if (pImage->Shared) DdkReleaseSharedData();
+
 	if (pImage->Data) free(pImage->Data);
+	if (pImage->State) free(pImage->State);
+	if (pImage->Saved) free(pImage->Saved);
+	if (pImage->Pages) free(pImage->Pages);
 	free(pImage);
 }
 
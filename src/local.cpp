@@ -27,6 +27,7 @@ void DdkDeleteDirectory(char *pDir);
 
 static HANDLE TempLock;
 static char TempBase[MAX_PATH+1], TempDir[MAX_PATH+1];
+static char CheckpointDir[MAX_PATH+1];
 
 
 void DdkLocalInit()
@@ -68,6 +69,7 @@ void DdkLocalDeinit()
 
 	WaitForSingleObject(TempLock, INFINITE);
 	DdkDeleteDirectory(TempDir);
+	if (*CheckpointDir) DdkDeleteDirectory(CheckpointDir);
 	RemoveDirectory(TempBase);
 	ReleaseMutex(TempLock);
 }
@@ -105,6 +107,137 @@ static void DdkDeleteDirectory(char *pDir)
 }
 
 
+static void DdkCopyDirectory(char *pFrom, char *pTo)
+{
+	char from[MAX_PATH+1], to[MAX_PATH+1];
+	WIN32_FIND_DATA find;
+
+	CreateDirectory(pTo, NULL);
+
+	size_t n = snprintf(from, sizeof(from), "%s\\*.*", pFrom);
+	if (n > sizeof(from) - 1) return;
+
+	HANDLE h = FindFirstFile(from, &find);
+	if (h == INVALID_HANDLE_VALUE) return;
+
+	do {
+		if (strcmp(find.cFileName, ".") && strcmp(find.cFileName, "..")) {
+			size_t i = snprintf(from, sizeof(from), "%s\\%s", pFrom, find.cFileName);
+			size_t j = snprintf(to, sizeof(to), "%s\\%s", pTo, find.cFileName);
+			if (i > sizeof(from) - 1 || j > sizeof(to) - 1) continue;
+
+			// Files in use, such as the registry hive, are skipped
+
+			if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				DdkCopyDirectory(from, to);
+
+			else CopyFile(from, to, FALSE);
+		}
+	} while (FindNextFile(h, &find));
+
+	FindClose(h);
+}
+
+
+void DdkCheckpointFiles()
+{
+	if (!*CheckpointDir)
+		sprintf(CheckpointDir, "%s%x.checkpoint", TempBase, GetCurrentProcessId());
+
+	DdkDeleteDirectory(CheckpointDir);
+	DdkCopyDirectory(TempDir, CheckpointDir);
+}
+
+
+/*
+ *	Bring a directory back to its checkpoint copy in place, as drivers and
+ *	tests may hold open handles to it or to unchanged files within it.
+ */
+
+static void DdkSyncDirectory(char *pFrom, char *pTo)
+{
+	char from[MAX_PATH+1], to[MAX_PATH+1];
+	WIN32_FIND_DATA find, copy;
+
+	CreateDirectory(pTo, NULL);
+
+	// Remove entries created since the checkpoint
+
+	size_t n = snprintf(to, sizeof(to), "%s\\*.*", pTo);
+	if (n > sizeof(to) - 1) return;
+
+	HANDLE h = FindFirstFile(to, &find);
+
+	if (h != INVALID_HANDLE_VALUE) {
+		do {
+			if (strcmp(find.cFileName, ".") && strcmp(find.cFileName, "..")) {
+				size_t i = snprintf(from, sizeof(from), "%s\\%s", pFrom, find.cFileName);
+				size_t j = snprintf(to, sizeof(to), "%s\\%s", pTo, find.cFileName);
+				if (i > sizeof(from) - 1 || j > sizeof(to) - 1) continue;
+
+				DWORD attr = GetFileAttributes(from);
+				bool dir = (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+				if (attr != INVALID_FILE_ATTRIBUTES
+						&& dir == ((attr & FILE_ATTRIBUTE_DIRECTORY) != 0))
+					continue;
+
+				if (dir) DdkDeleteDirectory(to);
+				else DeleteFile(to);
+			}
+		} while (FindNextFile(h, &find));
+
+		FindClose(h);
+	}
+
+	// Copy back whatever differs from the checkpoint
+
+	n = snprintf(from, sizeof(from), "%s\\*.*", pFrom);
+	if (n > sizeof(from) - 1) return;
+
+	h = FindFirstFile(from, &find);
+	if (h == INVALID_HANDLE_VALUE) return;
+
+	do {
+		if (strcmp(find.cFileName, ".") && strcmp(find.cFileName, "..")) {
+			size_t i = snprintf(from, sizeof(from), "%s\\%s", pFrom, find.cFileName);
+			size_t j = snprintf(to, sizeof(to), "%s\\%s", pTo, find.cFileName);
+			if (i > sizeof(from) - 1 || j > sizeof(to) - 1) continue;
+
+			if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				DdkSyncDirectory(from, to);
+				continue;
+			}
+
+			HANDLE f = FindFirstFile(to, &copy);
+
+			if (f != INVALID_HANDLE_VALUE) {
+				FindClose(f);
+
+				if (copy.nFileSizeLow == find.nFileSizeLow
+						&& copy.nFileSizeHigh == find.nFileSizeHigh
+						&& !CompareFileTime(&copy.ftLastWriteTime, &find.ftLastWriteTime))
+					continue;
+			}
+
+			// Files in use, such as the registry hive, are skipped
+
+			CopyFile(from, to, FALSE);
+		}
+	} while (FindNextFile(h, &find));
+
+	FindClose(h);
+}
+
+
+void DdkRestoreFiles()
+{
+	if (!*CheckpointDir) return;
+
+	DdkSyncDirectory(CheckpointDir, TempDir);
+}
+
+
 DWORD DdkGetFileDisposition(ULONG Disposition, ULONG *pInfo)
 {
 	switch (Disposition) {
@@ -265,3 +398,101 @@ DdkGetLocalPath(char *buffer, size_t len, char *path, char *file, char *suffix)
 		buffer[i] = '\\';
 	}
 }
+
+
+#define CACHE_DAYS	30			// Prepared images unused for longer are pruned
+
+
+static void DdkTouchDirectory(char *pDir)
+{
+	FILETIME now;
+
+	HANDLE h = CreateFile(pDir, FILE_WRITE_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+
+	if (h == INVALID_HANDLE_VALUE) return;
+
+	GetSystemTimeAsFileTime(&now);
+	SetFileTime(h, NULL, NULL, &now);
+	CloseHandle(h);
+}
+
+
+/*
+ *	Remove cache entries that have not been used for CACHE_DAYS. Each use
+ *	touches the entry, and images still mapped by another process cannot
+ *	be deleted, so only stale entries go.
+ */
+
+static void DdkPruneCache(char *pCache)
+{
+	const ULONG64 age = CACHE_DAYS * 24 * 3600 * 10000000ULL;
+	char path[MAX_PATH+1];
+	WIN32_FIND_DATA find;
+	FILETIME now;
+
+	size_t n = snprintf(path, sizeof(path), "%s*.*", pCache);
+	if (n > sizeof(path) - 1) return;
+
+	HANDLE h = FindFirstFile(path, &find);
+	if (h == INVALID_HANDLE_VALUE) return;
+
+	GetSystemTimeAsFileTime(&now);
+	ULONG64 limit = (((ULONG64)now.dwHighDateTime << 32) | now.dwLowDateTime) - age;
+
+	do {
+		ULONG64 t = ((ULONG64)find.ftLastWriteTime.dwHighDateTime << 32)
+			| find.ftLastWriteTime.dwLowDateTime;
+
+		if (!(find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || t >= limit
+				|| !strcmp(find.cFileName, ".") || !strcmp(find.cFileName, ".."))
+			continue;
+
+		size_t i = snprintf(path, sizeof(path), "%s%s", pCache, find.cFileName);
+		if (i <= sizeof(path) - 1) DdkDeleteDirectory(path);
+	} while (FindNextFile(h, &find));
+
+	FindClose(h);
+}
+
+
+bool
+DdkGetCachePath(char *buffer, size_t len, ULONG64 key, char *file, char *suffix)
+{
+	// The cache is shared between processes, so is kept beside TempBase
+
+	size_t n = strlen(TempBase);
+	if (n < 2 || n + 40 + strlen(file) + strlen(suffix) > len) return false;
+
+	memcpy(buffer, TempBase, n - 1);
+	buffer[n - 1] = 0;
+
+	char *cp = strrchr(buffer, '\\');
+	if (!cp) return false;
+
+	strcpy(cp + 1, "ddkcache\\");
+
+	if (!CreateDirectory(buffer, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		return false;
+
+	size_t m = strlen(buffer);
+	sprintf(&buffer[m], "%016llx\\", key);
+
+	// A new entry is the time to clear out old ones, an existing one is
+	// marked as used
+
+	if (CreateDirectory(buffer, NULL)) {
+		buffer[m] = 0;
+		DdkPruneCache(buffer);
+		sprintf(&buffer[m], "%016llx\\", key);
+	}
+
+	else if (GetLastError() == ERROR_ALREADY_EXISTS)
+		DdkTouchDirectory(buffer);
+
+	else return false;
+
+	sprintf(&buffer[strlen(buffer)], "%s%s", file, suffix);
+	return true;
+}
@@ -0,0 +1,284 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Lock Statistics Routines
+ */
+
+#include "stdafx.h"
+
+
+/*
+ *	When enabled, every lock acquire is recorded against the lock and the
+ *	driver address that acquired it. Entries are claimed with a 128-bit
+ *	interlocked exchange so that recording never takes a lock. Hold times
+ *	are measured from a small per-thread stack of the locks being held.
+ *	Releases are seen while a thread has anything on its stack, even once
+ *	stats are disabled, and a thread empties its stack at the next lock
+ *	it takes or releases after stats have been enabled or disabled.
+ */
+
+#define STAT_COUNT		4096
+#define STAT_PROBES		16
+#define STAT_BUCKETS	16
+#define STAT_NESTING	16
+
+typedef struct DECLSPEC_ALIGN(16) _LOCKSTAT {
+	PVOID volatile	lock;			// Lock address
+	PVOID volatile	caller;			// Acquiring instruction
+	ULONG			type;
+	volatile LONG64	acquires;
+	volatile LONG64	contended;
+	volatile LONG64	waittime;		// Performance counter ticks
+	volatile LONG64	holdtime;
+	volatile LONG64	hold[STAT_BUCKETS];	// Hold time in power of 2 microseconds
+} LOCKSTAT;
+
+typedef struct _LOCKHELD {
+	PVOID			lock;
+	LOCKSTAT		*pStat;
+	LONG64			start;
+} LOCKHELD;
+
+
+volatile LONG DdkLockStats;
+
+static LOCKSTAT statv[STAT_COUNT];
+static volatile LONG64 dropped;
+static LONG64 frequency;
+static volatile LONG generation;		// Changes as stats are enabled or disabled
+
+static __declspec(thread) LOCKHELD heldv[STAT_NESTING];
+static __declspec(thread) LONG heldgen;
+__declspec(thread) int DdkLocksHeld;
+
+
+DDKAPI
+VOID DdkEnableLockStats(BOOLEAN Enable)
+{
+	LARGE_INTEGER f;
+
+	if (!frequency && QueryPerformanceFrequency(&f))
+		frequency = f.QuadPart;
+
+	InterlockedExchange(&DdkLockStats, (Enable) ? 1 : 0);
+	InterlockedIncrement(&generation);
+}
+
+
+static bool DdkLockStatCurrent()
+{
+	if (heldgen == generation) return true;
+
+	heldgen = generation;
+	DdkLocksHeld = 0;
+	return false;
+}
+
+
+LONG64 DdkLockStatTime()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+
+static LOCKSTAT *DdkFindLockStat(PVOID pLock, PVOID pCaller)
+{
+	ULONG64 key = (ULONG64)pLock ^ ((ULONG64)pCaller << 7);
+	ULONG i = (ULONG)((key * 0x9E3779B97F4A7C15ULL) >> 52);
+
+	for (int n = 0; n < STAT_PROBES; n++, i = (i + 1) % STAT_COUNT) {
+		LOCKSTAT *pStat = &statv[i];
+
+		if (pStat->lock == pLock && pStat->caller == pCaller)
+			return pStat;
+
+		if (!pStat->lock) {
+			LONG64 compare[2] = { 0, 0 };
+
+			if (InterlockedCompareExchange128((volatile LONG64 *)pStat,
+					(LONG64)pCaller, (LONG64)pLock, compare))
+				return pStat;
+
+			if (pStat->lock == pLock && pStat->caller == pCaller)
+				return pStat;
+		}
+	}
+
+	InterlockedIncrement64(&dropped);
+	return NULL;
+}
+
+
+void DdkLockStatAcquire(PVOID pLock, PVOID pCaller, ULONG type, LONG64 start, bool contended)
+{
+	LONG64 now = DdkLockStatTime();
+	LOCKSTAT *pStat = DdkFindLockStat(pLock, pCaller);
+
+	if (pStat) {
+		pStat->type = type;
+		InterlockedIncrement64(&pStat->acquires);
+		InterlockedAdd64(&pStat->waittime, now - start);
+		if (contended) InterlockedIncrement64(&pStat->contended);
+	}
+
+	DdkLockStatCurrent();
+
+	if (DdkLocksHeld < STAT_NESTING) {
+		heldv[DdkLocksHeld].lock = pLock;
+		heldv[DdkLocksHeld].pStat = pStat;
+		heldv[DdkLocksHeld].start = now;
+		DdkLocksHeld++;
+	}
+}
+
+
+void DdkLockStatRelease(PVOID pLock)
+{
+	int i;
+
+	// Locks held across an enable or disable are not timed
+
+	if (!DdkLockStatCurrent()) return;
+
+	for (i = DdkLocksHeld - 1; i >= 0; i--)
+		if (heldv[i].lock == pLock) break;
+
+	// Released by another thread, or acquired before stats were enabled
+
+	if (i < 0) return;
+
+	LOCKSTAT *pStat = heldv[i].pStat;
+	LONG64 ticks = DdkLockStatTime() - heldv[i].start;
+
+	memmove(&heldv[i], &heldv[i + 1], (DdkLocksHeld - i - 1) * sizeof(LOCKHELD));
+	DdkLocksHeld--;
+
+	if (!pStat || !frequency) return;
+
+	ULONG64 us = (ULONG64)ticks * 1000000 / frequency;
+	int bucket = 0;
+
+	while (us && bucket < STAT_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	InterlockedAdd64(&pStat->holdtime, ticks);
+	InterlockedIncrement64(&pStat->hold[bucket]);
+}
+
+
+/*
+ *	BOOLEAN DdkQueryLockStats(PVOID Lock, PULONG64 Acquires,
+ *			PULONG64 Contended, PULONG64 WaitTime, PULONG64 HoldTime)
+ *
+ *	Return the acquires of a lock, from every caller, how many of them
+ *	were contended, and the total wait and hold times in microseconds.
+ */
+
+DDKAPI
+BOOLEAN DdkQueryLockStats(PVOID Lock, PULONG64 Acquires, PULONG64 Contended, PULONG64 WaitTime, PULONG64 HoldTime)
+{
+	LONG64 acquires = 0, contended = 0, waittime = 0, holdtime = 0;
+	LONG64 f = (frequency) ? frequency : 1;
+
+	for (int i = 0; i < STAT_COUNT; i++)
+		if (statv[i].lock == Lock) {
+			acquires += statv[i].acquires;
+			contended += statv[i].contended;
+			waittime += statv[i].waittime;
+			holdtime += statv[i].holdtime;
+		}
+
+	if (!acquires) return FALSE;
+
+	if (Acquires) *Acquires = (ULONG64)acquires;
+	if (Contended) *Contended = (ULONG64)contended;
+	if (WaitTime) *WaitTime = (ULONG64)(waittime * 1000000 / f);
+	if (HoldTime) *HoldTime = (ULONG64)(holdtime * 1000000 / f);
+	return TRUE;
+}
+
+
+static int __cdecl DdkCompareLockStats(const void *p1, const void *p2)
+{
+	const LOCKSTAT *s1 = *(const LOCKSTAT **)p1, *s2 = *(const LOCKSTAT **)p2;
+
+	if (s1->contended != s2->contended) return (s1->contended < s2->contended) ? 1 : -1;
+	if (s1->acquires != s2->acquires) return (s1->acquires < s2->acquires) ? 1 : -1;
+	return 0;
+}
+
+
+DDKAPI
+VOID DdkReportLockStats()
+{
+	static const char *type[] = { "spin", "queued", "shared", "exclusive", "mutex", "fast mutex", "push lock" };
+	LOCKSTAT **vec = (LOCKSTAT **)malloc(STAT_COUNT * sizeof(LOCKSTAT *));
+	LONG64 f = (frequency) ? frequency : 1;
+	int n = 0;
+
+	if (!vec) return;
+
+	for (int i = 0; i < STAT_COUNT; i++)
+		if (statv[i].lock && statv[i].acquires) vec[n++] = &statv[i];
+
+	qsort(vec, n, sizeof(vec[0]), DdkCompareLockStats);
+
+	for (int i = 0; i < n; i++) {
+		LOCKSTAT *p = vec[i];
+		char addr[MAX_PATH + 32], hist[STAT_BUCKETS * 24], *cp = hist;
+
+		DdkPrint("DDK: lock %p (%s) at %s acquires %I64d contended %I64d wait %I64dus hold %I64dus",
+			p->lock, type[(p->type < LockTypes) ? p->type : 0],
+			DdkFormatAddress(p->caller, addr, sizeof(addr)), p->acquires, p->contended,
+			p->waittime * 1000000 / f, p->holdtime * 1000000 / f);
+
+		*cp = 0;
+
+		for (int b = 0; b < STAT_BUCKETS; b++)
+			if (p->hold[b])
+				cp += sprintf(cp, " <%I64dus:%I64d", 1LL << b, p->hold[b]);
+
+		if (*hist) DdkPrint("DDK:   hold%s", hist);
+	}
+
+	free(vec);
+
+	if (dropped) DdkPrint("DDK: lock stats dropped %I64d acquires", dropped);
+}
+
+
+/*
+ *	Other threads may still be recording, so the counters are zeroed with
+ *	interlocked stores. Entries keep their lock and caller, which keeps
+ *	the probe sequences intact.
+ */
+
+void DdkResetLockStats()
+{
+	for (int i = 0; i < STAT_COUNT; i++) {
+		LOCKSTAT *pStat = &statv[i];
+
+		if (!pStat->lock) continue;
+
+		InterlockedExchange64(&pStat->acquires, 0);
+		InterlockedExchange64(&pStat->contended, 0);
+		InterlockedExchange64(&pStat->waittime, 0);
+		InterlockedExchange64(&pStat->holdtime, 0);
+
+		for (int b = 0; b < STAT_BUCKETS; b++)
+			InterlockedExchange64(&pStat->hold[b], 0);
+	}
+
+	InterlockedExchange64(&dropped, 0);
+}
@@ -14,9 +14,9 @@
 #include "stdafx.h"
 
 
-typedef struct _MUTEX : public OBJECT {
+typedef struct _MUTEX : public DISPATCH {
 	DWORD			threadid;
-	volatile LONG	count;
+	LONG			count;			// Recursion count of the owner
 } MUTEX, *PMUTEX;
 
 
@@ -27,10 +27,21 @@ VOID KeInitializeMutex(PRKMUTEX Mutex, ULONG Level)
 
 	DdkInitializeObject(pMutex, sizeof(MUTEX), _SizeofMutex_);
 
-	pMutex->h = CreateMutex(NULL, FALSE, NULL);
 	pMutex->type = MutexType;
+	pMutex->signal = 1;
+}
+
+
+LONG DdkReleaseMutex(OBJECT *pObj)
+{
+	MUTEX *pMutex = (MUTEX *)pObj;
+
+	if (pMutex->threadid != GetCurrentThreadId() || --pMutex->count)
+		return 1;
 
-	if (!pMutex->h) ddkfail("Unable to initialize Mutex");
+	pMutex->threadid = 0;
+	DdkSignalObject(pMutex);
+	return 0;
 }
 
 
@@ -38,18 +49,12 @@ DDKAPI
 LONG KeReleaseMutex(PRKMUTEX Mutex, BOOLEAN Wait)
 {
 	MUTEX *pMutex = (MUTEX *)Mutex;
-	LONG rc = 1;
 
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
 
-	if (pMutex->threadid == GetCurrentThreadId())
-		if (!--pMutex->count) {
-			pMutex->threadid = 0;
-			rc = 0;
-		}
+	if (DdkLocksHeld) DdkLockStatRelease(pMutex);
 
-	if (!ReleaseMutex(pMutex->h)) return 1;
-	return rc;
+	return DdkReleaseMutex(pMutex);
 }
 
 
@@ -59,20 +64,33 @@ LONG KeReadStateMutex(PRKMUTEX Mutex)
 	MUTEX *pMutex = (MUTEX *)Mutex;
 
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-	return (pMutex->count == 0);
+	return pMutex->signal;
 }
 
 
-void DdkUpdateMutex(OBJECT *pObj)
+bool DdkAcquireMutex(OBJECT *pObj)
 {
 	MUTEX *pMutex = (MUTEX *)pObj;
 	DWORD id = GetCurrentThreadId();
 
-	if (pMutex->threadid != id) {
-		pMutex->threadid = id;
-		pMutex->count = 1;
+	if (pMutex->threadid == id) {
+		pMutex->count++;
+		return true;
 	}
 
-	else pMutex->count++;
+	if (InterlockedCompareExchange(&pMutex->signal, 0, 1) != 1)
+		return false;
+
+	pMutex->threadid = id;
+	pMutex->count = 1;
+	return true;
 }
 
+
+bool DdkIsMutexContended(OBJECT *pObj)
+{
+	MUTEX *pMutex = (MUTEX *)pObj;
+	DWORD id = pMutex->threadid;
+
+	return (id != 0 && id != GetCurrentThreadId());
+}
@@ -24,6 +24,7 @@ typedef struct _NAME {
 
 
 NAME *DdkNameList;
+static NAME *CheckpointList;
 static CRITICAL_SECTION Lock;
 
 
@@ -53,6 +54,17 @@ void DdkCreatePath(PUNICODE_STRING Out, PUNICODE_STRING Name, PWCH Dir, PWCH Pre
 }
 
 
+static bool isNameInList(PNAME pList, PNAME pName)
+{
+	for (; pList; pList = pList->Next)
+		if (pList->Object == pName->Object
+				&& RtlCompareUnicodeString(&pList->Name, &pName->Name, TRUE) == 0)
+			return true;
+
+	return false;
+}
+
+
 static POBJECT DdkFindName(PUNICODE_STRING Path, PWCH *pPath = 0)
 {
 	for (PNAME pEntry = DdkNameList; pEntry; pEntry = pEntry->Next)
@@ -185,3 +197,129 @@ POBJECT DdkLookupName(char *Name, PWCH Dir)
 	return DdkLookupName(wname, Dir);
 }
 
+
+/*
+ *	Return the objects of a type that have names, each with a reference.
+ *	The count may be more than the array holds.
+ */
+
+ULONG DdkFindNamedObjects(USHORT type, POBJECT *pv, ULONG max)
+{
+	ULONG n = 0;
+
+	EnterCriticalSection(&Lock);
+
+	for (PNAME pEntry = DdkNameList; pEntry; pEntry = pEntry->Next)
+		if (pEntry->Object->type == type && pEntry->Object->refcount) {
+			if (n < max) {
+				DdkReferenceObject(pEntry->Object);
+				pv[n] = pEntry->Object;
+			}
+
+			n++;
+		}
+
+	LeaveCriticalSection(&Lock);
+	return n;
+}
+
+
+/*
+ *	Return the name of an object, which is valid while the name remains.
+ */
+
+PWCH DdkFindObjectName(POBJECT Object)
+{
+	PWCH pName = NULL;
+
+	EnterCriticalSection(&Lock);
+
+	for (PNAME pEntry = DdkNameList; pEntry; pEntry = pEntry->Next)
+		if (pEntry->Object == Object) {
+			pName = pEntry->Buffer;
+			break;
+		}
+
+	LeaveCriticalSection(&Lock);
+	return pName;
+}
+
+
+/*
+ *	The checkpoint records which names existed, with a reference on each
+ *	object, so that a restore can remove the names created since and put
+ *	back those removed since.
+ */
+
+static PNAME DdkCopyName(PNAME pEntry)
+{
+	PNAME pCopy = (PNAME)calloc(1, sizeof(NAME) + pEntry->Name.Length);
+	if (!pCopy) ddkfail("Unable to copy name");
+
+	memcpy(pCopy->Buffer, pEntry->Buffer, pEntry->Name.Length);
+	RtlInitUnicodeString(&pCopy->Name, pCopy->Buffer);
+	pCopy->Object = pEntry->Object;
+	DdkReferenceObject(pCopy->Object);
+	return pCopy;
+}
+
+
+void DdkDiscardNames()
+{
+	EnterCriticalSection(&Lock);
+	PNAME pList = CheckpointList;
+	CheckpointList = NULL;
+	LeaveCriticalSection(&Lock);
+
+	for (PNAME pEntry; (pEntry = pList) != NULL; free(pEntry)) {
+		pList = pEntry->Next;
+		DdkDereferenceObject(pEntry->Object);
+	}
+}
+
+
+void DdkCheckpointNames()
+{
+	DdkDiscardNames();
+	EnterCriticalSection(&Lock);
+
+	PNAME *ppTail = &CheckpointList;
+
+	for (PNAME pEntry = DdkNameList; pEntry; pEntry = pEntry->Next) {
+		PNAME pCopy = DdkCopyName(pEntry);
+
+		*ppTail = pCopy;
+		ppTail = &pCopy->Next;
+	}
+
+	LeaveCriticalSection(&Lock);
+}
+
+
+void DdkRestoreNames()
+{
+	EnterCriticalSection(&Lock);
+	PNAME *ppEntry = &DdkNameList, *ppNext;
+
+	for (PNAME pEntry; (pEntry = *ppEntry) != 0; ppEntry = ppNext) {
+		ppNext = &(*ppEntry)->Next;
+
+		if (!isNameInList(CheckpointList, pEntry)) {
+			*ppEntry = pEntry->Next;
+			ppNext = ppEntry;
+			DdkDereferenceObject(pEntry->Object);
+			free(pEntry);
+		}
+	}
+
+	for (PNAME pEntry = CheckpointList; pEntry; pEntry = pEntry->Next) {
+		if (isNameInList(DdkNameList, pEntry)) continue;
+
+		PNAME pCopy = DdkCopyName(pEntry);
+
+		pCopy->Next = DdkNameList;
+		DdkNameList = pCopy;
+	}
+
+	LeaveCriticalSection(&Lock);
+}
@@ -24,6 +24,7 @@ static VOID DdkObjectCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP
 
 	DdkFreeObject(pObj);
 	CloseThreadpoolWork(Work);
+	DdkEndDeferred();
 }
 
 
@@ -249,6 +250,7 @@ VOID ObDereferenceObjectDeferDeleteWithTag(PVOID Object, ULONG Tag)
 	if (!Work)
 		ddkfail("Unable to defer object deletion");
 
+	DdkBeginDeferred();
 	SubmitThreadpoolWork(Work);
 }
 
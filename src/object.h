@@ -27,7 +27,7 @@ enum _OBJECTTYPE {
 	TimerType, ProcessType, SecurityTokenType, EnlistmentType,
 	ResourceManagerType, TransactionManagerType, TransactionType, CmKeyType,
 	IoFileType, IoDeviceType, IoDriverType, IoSymbolicLinkType, KeyType,
-	MaxObjectType
+	QueueType, ResourceType, MaxObjectType
 };
 
 typedef struct _OBJECT_TYPE {
@@ -35,6 +35,25 @@ typedef struct _OBJECT_TYPE {
 } OBJECT_TYPE, *POBJECT_TYPE;
 
 
+/*
+ *	Dispatcher objects keep their signal state in the object, where it is
+ *	read and changed with interlocked operations. It must fit in a KEVENT.
+ *	The state and the waiter count share a word, so that a signal can be
+ *	set and its waiters counted in one operation.
+ */
+
+typedef struct _DISPATCH : public OBJECT {
+	union {
+		struct {
+			volatile LONG	signal;		// Signal state, or count for a semaphore
+			volatile SHORT	waiters;	// Threads parked on the object
+			bool			notify;		// Satisfying a wait leaves it signalled
+		};
+		volatile LONG64		state;
+	};
+} DISPATCH, *PDISPATCH;
+
+
 /*
  *	Object Validation
  */
@@ -46,7 +65,8 @@ inline bool isPublicObject(OBJECT *pObj) {
 
 inline bool isDispatchObject(OBJECT *pObj) {
 	return (pObj && (pObj->type == EventType || pObj->type == MutexType
-		|| pObj->type == SemaphoreType || pObj->type == ThreadType || pObj->type == TimerType));
+		|| pObj->type == SemaphoreType || pObj->type == ThreadType || pObj->type == TimerType
+		|| pObj->type == QueueType));
 }
 
 inline bool isValidObject(OBJECT *pObj) {
@@ -96,3 +116,5 @@ OBJECT *DdkAllocObject(size_t size, USHORT type, bool opt = false);
 void DdkInitializeObject(OBJECT *pObj, size_t size, size_t maxsize);
 void DdkReferenceObject(OBJECT *pObj);
 void DdkDereferenceObject(OBJECT *pObj);
+void DdkWakeWaiters(DISPATCH *pObj);
+LONG DdkSignalObject(DISPATCH *pObj, LONG Adjustment = 0, LONG Limit = 0);
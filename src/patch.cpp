@@ -0,0 +1,892 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Image Patching Routines
+ */
+
+#include "stdafx.h"
+#include "detours.h"
+#include <intrin.h>
+
+
+/*
+ *	Accesses to CR8 (irql value) raise EXCEPTION_PRIV_INSTRUCTION and are
+ *	emulated by DdkPrivException. Drivers that raise and lower IRQL around
+ *	every lock pay for an exception on each transition, so when an image is
+ *	loaded each CR8 access is rewritten as a jump to a stub that accesses
+ *	DdkCurrentIrql directly using the thread local storage block.
+ *
+ *	The jump needs five bytes and the CR8 access is only four, so one or more
+ *	of the following instructions are relocated into the stub. Only simple
+ *	instructions that cannot fault, transfer control or move the stack
+ *	pointer are relocated and the site must not be the target of a branch.
+ *	Branches are collected across the whole section, so that jumps between
+ *	the chained fragments of a function are seen, and the __except blocks
+ *	and filters entered by the exception dispatcher count as targets.
+ *	Any site that cannot be patched safely is left for DdkPrivException.
+ *
+ *	Each stub is described to the unwinder with unwind data chained to the
+ *	function containing the site, so that stack walks, such as those of a
+ *	debugger or profiler, still work while a thread is in the stub.
+ */
+
+#if defined(_AMD64_)
+
+#define STUB_LEN	128
+#define STUB_CODE	64
+#define STUB_FIRST	((sizeof(PATCH) + 15) & ~15)
+#define MAXIMUM_JUMP 0x80000000U
+#define MAXIMUM_SCOPES 256
+#define MAXIMUM_CHAIN 32
+
+#define SITE_BOUNDARY	0x01
+#define SITE_TARGET		0x02
+#define SITE_EXCLUDED	0x04
+
+#define UWOP_PUSH_NONVOL	0
+
+typedef struct _PATCH {
+	struct _PATCH *next;
+	BYTE *base;					// Base for function table RVAs
+	DWORD size;					// Region size
+	DWORD used;					// Bytes used
+} PATCH;
+
+typedef struct _UNWIND_DATA {
+	BYTE VersionAndFlags;
+	BYTE SizeOfProlog;
+	BYTE CountOfCodes;
+	BYTE FrameRegister;
+	USHORT UnwindCode[1];
+} UNWIND_DATA;
+
+typedef struct _STUB {
+	BYTE Code[STUB_CODE];
+	RUNTIME_FUNCTION Function[2];	// Before and after the scratch register is restored
+	ULONG Unwind[10];
+} STUB;
+
+C_ASSERT(sizeof(STUB) <= STUB_LEN);
+
+
+extern __declspec(thread) KIRQL DdkCurrentIrql;
+extern "C" ULONG _tls_index;
+
+static LONG IrqlOffset;
+
+
+static LONG DdkGetIrqlOffset()
+{
+	static const DWORD TebTlsPointer = 0x58;
+
+	char *pBlock = ((char **)__readgsqword(TebTlsPointer))[_tls_index];
+	return (LONG)((char *)&DdkCurrentIrql - pBlock);
+}
+
+
+static bool isPatchWithinJumpBounds(PATCH *pPatch, BYTE *pAddr)
+{
+	const ULONG_PTR maxjump = MAXIMUM_JUMP - 0x100;
+	ULONG_PTR start = (ULONG_PTR)pPatch, end = start + pPatch->size;
+	ULONG_PTR addr = (ULONG_PTR)pAddr;
+
+	return (addr >= start) ? (addr - start <= maxjump) : (end - addr <= maxjump);
+}
+
+
+static PRUNTIME_FUNCTION CALLBACK DdkLookupStub(DWORD64 ControlPc, PVOID Context)
+{
+	PATCH *pPatch = (PATCH *)Context;
+	DWORD64 offset = ControlPc - (DWORD64)pPatch;
+
+	if (ControlPc < (DWORD64)pPatch || offset < STUB_FIRST || offset >= pPatch->used)
+		return NULL;
+
+	STUB *pStub = (STUB *)((BYTE *)pPatch + offset - (offset - STUB_FIRST) % STUB_LEN);
+	DWORD rva = (DWORD)(ControlPc - (DWORD64)pPatch->base);
+
+	for (int i = 0; i < 2; i++)
+		if (rva >= pStub->Function[i].BeginAddress && rva < pStub->Function[i].EndAddress)
+			return &pStub->Function[i];
+
+	return NULL;
+}
+
+
+static STUB *DdkAllocateStub(PATCH **ppList, BYTE *pSite, BYTE *h, BYTE **ppTable)
+{
+	PATCH *pPatch;
+
+	for (pPatch = *ppList; pPatch; pPatch = pPatch->next)
+		if (pPatch->used + STUB_LEN <= pPatch->size
+				&& isPatchWithinJumpBounds(pPatch, pSite)) break;
+
+	if (!pPatch) {
+		DWORD size;
+		pPatch = (PATCH *)DetourAllocateRegionWithinJumpBounds(pSite, &size);
+
+		if (!pPatch) return NULL;
+
+		// RVAs in the function table must be positive for both the stubs
+		// and the image functions they are chained to
+
+		pPatch->size = size;
+		pPatch->used = STUB_FIRST;
+		pPatch->base = ((BYTE *)pPatch < h) ? (BYTE *)pPatch : h;
+
+		if (size < STUB_FIRST + STUB_LEN || !RtlInstallFunctionTableCallback(
+				(DWORD64)pPatch | 3, (DWORD64)pPatch->base,
+				(DWORD)((BYTE *)pPatch + size - pPatch->base), DdkLookupStub, pPatch, NULL)) {
+			VirtualFree(pPatch, 0, MEM_RELEASE);
+			return NULL;
+		}
+
+		pPatch->next = *ppList;
+		*ppList = pPatch;
+	}
+
+	STUB *pStub = (STUB *)((BYTE *)pPatch + pPatch->used);
+	pPatch->used += STUB_LEN;
+	*ppTable = pPatch->base;
+	return pStub;
+}
+
+
+/*
+ *	Return the length of an instruction that is safe to relocate, or
+ *	zero if it may fault, transfer control, be position dependent or
+ *	change the stack pointer. Memory operands are only accepted relative
+ *	to the stack pointer.
+ */
+
+static int DdkRelocatableLength(const BYTE *op)
+{
+	const BYTE *cp = op;
+	bool opsize = false, modrm = false, twobyte = false, group = false;
+	BYTE rex = 0;
+	int imm = 0;
+
+	if (*cp == 0x66) { opsize = true; cp++; }
+	if ((*cp & 0xf0) == 0x40) rex = *cp++;
+
+	BYTE opc = *cp++;
+
+	if (opc == 0x0f) {
+		twobyte = true;
+		opc = *cp++;
+
+		// cmovcc, setcc, imul, movzx and movsx
+
+		if ((opc & 0xf0) != 0x40 && (opc & 0xf0) != 0x90 && opc != 0xaf
+				&& opc != 0xb6 && opc != 0xb7 && opc != 0xbe && opc != 0xbf)
+			return 0;
+
+		modrm = true;
+	}
+
+	else if (opc < 0x40 && (opc & 7) < 4) modrm = true;
+	else if (opc < 0x40 && (opc & 7) == 4) imm = 1;
+	else if (opc < 0x40 && (opc & 7) == 5) imm = opsize ? 2 : 4;
+	else if (opc == 0x63 || (opc >= 0x84 && opc <= 0x8b) || opc == 0x8d) modrm = true;
+	else if (opc == 0x80 || opc == 0x83 || opc == 0xc0 || opc == 0xc1 || opc == 0xc6) modrm = group = true, imm = 1;
+	else if (opc == 0x81 || opc == 0xc7) modrm = group = true, imm = opsize ? 2 : 4;
+	else if (opc >= 0xd0 && opc <= 0xd3) modrm = group = true;
+	else if (opc == 0x90 || opc == 0x98 || opc == 0x99) ;
+	else if (opc == 0xa8) imm = 1;
+	else if (opc == 0xa9) imm = opsize ? 2 : 4;
+	else if (opc >= 0xb0 && opc <= 0xbf && (opc & 7) == 4 && !(rex & 1)) return 0;
+	else if (opc >= 0xb0 && opc <= 0xb7) imm = 1;
+	else if (opc >= 0xb8 && opc <= 0xbf) imm = (rex & 8) ? 8 : opsize ? 2 : 4;
+	else return 0;
+
+	if (modrm) {
+		BYTE m = *cp++;
+		BYTE mod = (m >> 6), reg = ((m >> 3) & 7), rm = (m & 7);
+		bool lea = (!twobyte && opc == 0x8d);
+
+		if (!twobyte && (opc == 0xc6 || opc == 0xc7) && reg)
+			return 0;
+
+		// Leave anything naming the stack pointer as a register operand
+
+		if ((!group && reg == 4 && !(rex & 4)) || (mod == 3 && rm == 4 && !(rex & 1)))
+			return 0;
+
+		if (mod != 3) {
+			if (rm == 4) {
+				BYTE sib = *cp++;
+
+				// Only [rsp + disp] is guaranteed not to fault
+
+				if (!lea && ((sib & 7) != 4 || ((sib >> 3) & 7) != 4 || (rex & 3)))
+					return 0;
+
+				if (mod == 0 && (sib & 7) == 5) cp += 4;
+			}
+
+			else if (mod == 0 && rm == 5) return 0;
+			else if (!lea) return 0;
+
+			cp += (mod == 1) ? 1 : (mod == 2) ? 4 : 0;
+		}
+	}
+
+	return (int)(cp - op) + imm;
+}
+
+
+static BYTE *DdkEmitOperand(BYTE *cp, UCHAR reg, UCHAR base, LONG disp)
+{
+	// [base + disp32]
+
+	*cp++ = 0x80 | ((reg & 7) << 3) | (base & 7);
+	if ((base & 7) == 4) *cp++ = 0x24;
+
+	*(LONG UNALIGNED *)cp = disp;
+	return cp + sizeof(LONG);
+}
+
+
+static BYTE *DdkEmitTlsBlock(BYTE *cp, UCHAR reg)
+{
+	// mov reg, gs:[58h]
+
+	*cp++ = 0x65;
+	*cp++ = 0x48 | ((reg >> 3) << 2);
+	*cp++ = 0x8b;
+	*cp++ = 0x04 | ((reg & 7) << 3);
+	*cp++ = 0x25;
+	*(LONG UNALIGNED *)cp = 0x58;
+	cp += sizeof(LONG);
+
+	// mov reg, [reg + _tls_index * 8]
+
+	*cp++ = 0x48 | ((reg >> 3) << 2) | (reg >> 3);
+	*cp++ = 0x8b;
+	return DdkEmitOperand(cp, reg, reg, (LONG)(_tls_index * sizeof(PVOID)));
+}
+
+
+static BYTE *DdkEmitReadIrql(BYTE *cp, UCHAR reg)
+{
+	cp = DdkEmitTlsBlock(cp, reg);
+
+	// movzx reg32, byte ptr [reg + IrqlOffset]
+
+	*cp++ = 0x40 | ((reg >> 3) << 2) | (reg >> 3);
+	*cp++ = 0x0f;
+	*cp++ = 0xb6;
+	return DdkEmitOperand(cp, reg, reg, IrqlOffset);
+}
+
+
+static BYTE *DdkEmitWriteIrql(BYTE *cp, UCHAR reg, UCHAR tmp)
+{
+	*cp++ = 0x50 + tmp;
+	cp = DdkEmitTlsBlock(cp, tmp);
+
+	// mov byte ptr [tmp + IrqlOffset], reg8
+
+	*cp++ = 0x40 | ((reg >> 3) << 2);
+	*cp++ = 0x88;
+	cp = DdkEmitOperand(cp, reg, tmp, IrqlOffset);
+
+	*cp++ = 0x58 + tmp;
+	return cp;
+}
+
+
+static UNWIND_DATA *DdkGetUnwindData(BYTE *h, PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc)
+{
+	DWORD rva = pFunc->UnwindData;
+
+	// An odd value refers to another entry holding the unwind data
+
+	if (rva & 1) rva = ((PIMAGE_RUNTIME_FUNCTION_ENTRY)(h + (rva & ~1)))->UnwindData;
+	return (UNWIND_DATA *)(h + rva);
+}
+
+
+static PIMAGE_RUNTIME_FUNCTION_ENTRY DdkGetChainedFunction(UNWIND_DATA *pInfo)
+{
+	if (!((pInfo->VersionAndFlags >> 3) & UNW_FLAG_CHAININFO)) return NULL;
+	return (PIMAGE_RUNTIME_FUNCTION_ENTRY)&pInfo->UnwindCode[(pInfo->CountOfCodes + 1) & ~1];
+}
+
+
+static DWORD DdkGetPrimaryFunction(BYTE *h, PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc)
+{
+	PIMAGE_RUNTIME_FUNCTION_ENTRY pChain;
+
+	for (int i = 0; i < MAXIMUM_CHAIN
+			&& (pChain = DdkGetChainedFunction(DdkGetUnwindData(h, pFunc))); i++)
+		pFunc = pChain;
+
+	return pFunc->BeginAddress;
+}
+
+
+/*
+ *	Emit unwind data for part of a stub, optionally with the push of the
+ *	scratch register as its prologue, chained to the function containing
+ *	the site. The chained function is unwound as if its prologue has
+ *	completed, which holds as sites within a prologue are not patched.
+ */
+
+static ULONG *DdkEmitUnwind(ULONG *up, int push, BYTE *pBase, BYTE *h,
+	PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc)
+{
+	UNWIND_DATA *pInfo = (UNWIND_DATA *)up;
+	DWORD delta = (DWORD)(h - pBase);
+
+	pInfo->VersionAndFlags = 1 | (UNW_FLAG_CHAININFO << 3);
+	pInfo->SizeOfProlog = (push >= 0) ? 1 : 0;
+	pInfo->CountOfCodes = (push >= 0) ? 1 : 0;
+	pInfo->FrameRegister = 0;
+
+	// push tmp is a single byte instruction at the start of the stub
+
+	if (push >= 0)
+		pInfo->UnwindCode[0] = (USHORT)(1 | (UWOP_PUSH_NONVOL << 8) | (push << 12));
+
+	PIMAGE_RUNTIME_FUNCTION_ENTRY pChain = DdkGetChainedFunction(pInfo);
+	pChain->BeginAddress = pFunc->BeginAddress + delta;
+	pChain->EndAddress = pFunc->EndAddress + delta;
+	pChain->UnwindData = pFunc->UnwindData + delta;
+
+	return (ULONG *)(pChain + 1);
+}
+
+
+static bool isIndirectJump(const BYTE *op)
+{
+	while (*op == 0x66 || *op == 0x67 || *op == 0xf2 || *op == 0xf3
+		|| *op == 0x2e || *op == 0x3e) op++;
+
+	if ((*op & 0xf0) == 0x40) op++;
+
+	// jmp [rip+disp] is used for tail calls through the import table
+
+	return (op[0] == 0xff && ((op[1] >> 3) & 7) >= 4
+		&& ((op[1] >> 3) & 7) <= 5 && op[1] != 0x25);
+}
+
+
+/*
+ *	Decode a function, or a fragment of one, marking instruction boundaries
+ *	and any branch targets within the section, which flags covers.
+ */
+
+static bool DdkDecodeFunction(BYTE *pBase, BYTE *pLimit, BYTE *pStart, BYTE *pEnd, BYTE *flags)
+{
+	// Fragments are entered from their parent and funclets by the dispatcher
+
+	flags[pStart - pBase] |= SITE_TARGET;
+
+	for (BYTE *cp = pStart, *next; cp < pEnd; cp = next) {
+		PVOID pTarget = NULL;
+
+		flags[cp - pBase] |= SITE_BOUNDARY;
+		next = (BYTE *)DetourCopyInstruction(NULL, NULL, cp, &pTarget, NULL);
+
+		if (!next || next <= cp || next > pEnd)
+			return false;
+
+		// Give up on functions with computed jumps (switch tables)
+
+		if (pTarget == DETOUR_INSTRUCTION_TARGET_DYNAMIC) {
+			if (isIndirectJump(cp)) return false;
+		}
+
+		else if ((BYTE *)pTarget >= pBase && (BYTE *)pTarget < pLimit)
+			flags[(BYTE *)pTarget - pBase] |= SITE_TARGET;
+	}
+
+	return true;
+}
+
+
+/*
+ *	Mark the __except blocks and filters of a function as branch targets.
+ *	The language specific data of __C_specific_handler is a scope table,
+ *	which is validated before use. Drivers are built without C++ exception
+ *	handling, and any other handler that does not have a valid scope table
+ *	may resume at an unknown address, so the function is not patched.
+ */
+
+static bool DdkMarkHandlers(BYTE *h, DWORD limit, PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc,
+	BYTE *pBase, BYTE *pLimit, BYTE *flags)
+{
+	UNWIND_DATA *pInfo = DdkGetUnwindData(h, pFunc);
+
+	if ((BYTE *)pInfo < h || (BYTE *)pInfo + sizeof(UNWIND_DATA) > h + limit)
+		return false;
+
+	if (!((pInfo->VersionAndFlags >> 3) & (UNW_FLAG_EHANDLER | UNW_FLAG_UHANDLER)))
+		return true;
+
+	// The handler address is followed by the count and the scope records
+
+	ULONG *pData = (ULONG *)&pInfo->UnwindCode[(pInfo->CountOfCodes + 1) & ~1];
+	DWORD start = (DWORD)(pBase - h), end = (DWORD)(pLimit - h);
+
+	if ((BYTE *)&pData[2] > h + limit || pData[1] == 0 || pData[1] > MAXIMUM_SCOPES
+			|| (BYTE *)&pData[2 + 4 * pData[1]] > h + limit)
+		return false;
+
+	ULONG n = pData[1], *pScope = &pData[2];
+
+	for (ULONG i = 0; i < n; i++) {
+		ULONG *cp = &pScope[i * 4];
+
+		if (cp[0] < start || cp[1] > end || cp[0] >= cp[1]
+				|| (cp[3] && (cp[3] < start || cp[3] >= end)))
+			return false;
+	}
+
+	for (ULONG i = 0; i < n; i++) {
+		ULONG *cp = &pScope[i * 4];
+
+		if (cp[3]) flags[cp[3] - start] |= SITE_TARGET;
+
+		if (cp[2] > EXCEPTION_EXECUTE_HANDLER && cp[2] >= start && cp[2] < end)
+			flags[cp[2] - start] |= SITE_TARGET;
+	}
+
+	return true;
+}
+
+
+static int DdkPatchSite(PATCH **ppList, BYTE *h, PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc,
+	BYTE *pSite, BYTE *pEnd, BYTE *pBase, BYTE *flags)
+{
+	UCHAR reg = ((pSite[0] & 1) << 3) | (pSite[3] & 7);
+	UCHAR tmp = (reg == 0) ? 1 : 0;
+	bool write = (pSite[2] & 0x02) != 0;
+	int len = 4;
+
+	if (reg == 4) return 0;
+
+	// Relocate following instructions until there is room for a jump
+
+	while (len < 5) {
+		BYTE *cp = pSite + len;
+
+		if (cp >= pEnd || flags[cp - pBase] != SITE_BOUNDARY)
+			return 0;
+
+		int n = DdkRelocatableLength(cp);
+
+		if (!n || cp + n > pEnd || (cp + n < pEnd
+				&& !(flags[cp + n - pBase] & SITE_BOUNDARY)))
+			return 0;
+
+		len += n;
+	}
+
+	BYTE *pTable;
+	STUB *pStub = DdkAllocateStub(ppList, pSite, h, &pTable);
+	if (!pStub) return 0;
+
+	BYTE *cp = (write) ? DdkEmitWriteIrql(pStub->Code, reg, tmp) : DdkEmitReadIrql(pStub->Code, reg);
+	BYTE *pRestored = cp;
+
+	memcpy(cp, pSite + 4, len - 4);
+	cp += len - 4;
+
+	// Return with complementary conditional jumps, as an unconditional jump
+	// out of the stub looks like the tail call of an epilogue to the unwinder
+
+	for (BYTE cc = 0x80; cc <= 0x81; cc++) {
+		*cp++ = 0x0f;
+		*cp++ = cc;
+		*(LONG UNALIGNED *)cp = (LONG)((pSite + len) - (cp + sizeof(LONG)));
+		cp += sizeof(LONG);
+	}
+
+	// The scratch register of a write is on the stack until it is popped
+
+	ULONG *up = pStub->Unwind;
+	DWORD start = (DWORD)(pStub->Code - pTable);
+	DWORD split = (DWORD)(pRestored - pTable);
+
+	pStub->Function[0].BeginAddress = start;
+	pStub->Function[0].EndAddress = (write) ? split : (DWORD)(cp - pTable);
+	pStub->Function[0].UnwindData = (DWORD)((BYTE *)up - pTable);
+	up = DdkEmitUnwind(up, (write) ? tmp : -1, pTable, h, pFunc);
+
+	if (write) {
+		pStub->Function[1].BeginAddress = split;
+		pStub->Function[1].EndAddress = (DWORD)(cp - pTable);
+		pStub->Function[1].UnwindData = (DWORD)((BYTE *)up - pTable);
+		DdkEmitUnwind(up, -1, pTable, h, pFunc);
+	}
+
+	// Replace the site with a jump to the stub
+
+	pSite[0] = 0xe9;
+	*(LONG UNALIGNED *)&pSite[1] = (LONG)(pStub->Code - (pSite + 5));
+	memset(&pSite[5], 0xcc, len - 5);
+	return len;
+}
+
+
+static void DdkPatchFunction(PATCH **ppList, BYTE *h, PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc,
+	BYTE *pBase, BYTE *pLimit, BYTE *flags)
+{
+	BYTE *pStart = h + pFunc->BeginAddress, *pEnd = h + pFunc->EndAddress;
+	BYTE *pPrimary = h + DdkGetPrimaryFunction(h, pFunc);
+
+	// Fragments are only patched along with the function they belong to
+
+	if (pPrimary < pBase || pPrimary >= pLimit || (flags[pPrimary - pBase] & SITE_EXCLUDED))
+		return;
+
+	// The stub unwind data describes the frame after the prologue
+
+	for (BYTE *cp = pStart + DdkGetUnwindData(h, pFunc)->SizeOfProlog; cp + 4 <= pEnd; cp++) {
+		if (!(flags[cp - pBase] & SITE_BOUNDARY)) continue;
+
+		// mov reg, cr8 (0x44 0x0F 0x20 0xC0) or mov cr8, reg (0x44 0x0F 0x22 0xC0)
+
+		if ((cp[0] & 0xf6) == 0x44 && cp[1] == 0x0f
+				&& (cp[2] & 0xfd) == 0x20 && (cp[3] & 0xf8) == 0xc0) {
+			int len = DdkPatchSite(ppList, h, pFunc, cp, pEnd, pBase, flags);
+			if (len) cp += len - 1;
+		}
+	}
+}
+
+
+static bool isFunctionInSection(PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc, PIMAGE_SECTION_HEADER pSection)
+{
+	return pFunc->BeginAddress >= pSection->VirtualAddress
+		&& pFunc->EndAddress <= pSection->VirtualAddress + pSection->Misc.VirtualSize
+		&& pFunc->EndAddress > pFunc->BeginAddress;
+}
+
+
+/*
+ *	PVOID DdkPatchImage(PVOID pImage)
+ *
+ *	Rewrite the CR8 accesses in a loaded image, returning the list of stub
+ *	regions to be released by DdkUnpatchImage once the image is unloaded.
+ *	This is done by DdkLoadDriver and may be used for a driver linked into
+ *	a test module.
+ */
+
+DDKAPI
+PVOID DdkPatchImage(PVOID pImage)
+{
+	BYTE *h = (BYTE *)pImage;
+	PIMAGE_NT_HEADERS64 pHdr = (PIMAGE_NT_HEADERS64)(h + ((PIMAGE_DOS_HEADER)h)->e_lfanew);
+
+	IMAGE_DATA_DIRECTORY *pDir =
+		&pHdr->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+
+	if (!pDir->Size) return NULL;
+
+	PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc = (PIMAGE_RUNTIME_FUNCTION_ENTRY)(h + pDir->VirtualAddress);
+	DWORD count = pDir->Size / sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY);
+	DWORD limit = pHdr->OptionalHeader.SizeOfImage;
+
+	PIMAGE_SECTION_HEADER pSection = IMAGE_FIRST_SECTION(pHdr);
+	PATCH *pList = NULL;
+
+	IrqlOffset = DdkGetIrqlOffset();
+
+	for (int i = 0; i < pHdr->FileHeader.NumberOfSections; i++) {
+		if (!(pSection[i].Characteristics & IMAGE_SCN_MEM_EXECUTE)) continue;
+
+		BYTE *pBase = h + pSection[i].VirtualAddress;
+		DWORD size = pSection[i].Misc.VirtualSize, prot;
+		BYTE *pLimit = pBase + size;
+
+		BYTE *flags = (BYTE *)calloc(size + 1, 1);
+		if (!flags) ddkfail("Unable to allocate patch buffer");
+
+		if (!VirtualProtect(pBase, size, PAGE_EXECUTE_READWRITE, &prot)) {
+			free(flags);
+			continue;
+		}
+
+		// Decode every function before patching any, so that branches
+		// from other fragments and the exception handlers are known
+
+		for (DWORD j = 0; j < count; j++) {
+			if (!isFunctionInSection(&pFunc[j], &pSection[i])) continue;
+
+			if (!DdkDecodeFunction(pBase, pLimit, h + pFunc[j].BeginAddress,
+					h + pFunc[j].EndAddress, flags)
+					|| !DdkMarkHandlers(h, limit, &pFunc[j], pBase, pLimit, flags)) {
+				BYTE *pPrimary = h + DdkGetPrimaryFunction(h, &pFunc[j]);
+
+				if (pPrimary >= pBase && pPrimary < pLimit)
+					flags[pPrimary - pBase] |= SITE_EXCLUDED;
+			}
+		}
+
+		for (DWORD j = 0; j < count; j++)
+			if (isFunctionInSection(&pFunc[j], &pSection[i]))
+				DdkPatchFunction(&pList, h, &pFunc[j], pBase, pLimit, flags);
+
+		VirtualProtect(pBase, size, prot, &prot);
+		FlushInstructionCache(GetCurrentProcess(), pBase, size);
+		free(flags);
+	}
+
+	return pList;
+}
+
+
+/*
+ *	VOID DdkUnpatchImage(PVOID pPatch)
+ *
+ *	Release the stubs created by DdkPatchImage.
+ */
+
+DDKAPI
+VOID DdkUnpatchImage(PVOID pPatch)
+{
+	for (PATCH *p = (PATCH *)pPatch, *next; p; p = next) {
+		next = p->next;
+		RtlDeleteFunctionTable((PRUNTIME_FUNCTION)((DWORD64)p | 3));
+		VirtualFree(p, 0, MEM_RELEASE);
+	}
+}
+
+#else
+
+DDKAPI
+PVOID DdkPatchImage(PVOID pImage)
+{
+	UNREFERENCED_PARAMETER(pImage);
+	return NULL;
+}
+
+
+DDKAPI
+VOID DdkUnpatchImage(PVOID pPatch)
+{
+	UNREFERENCED_PARAMETER(pPatch);
+}
+
+#endif
+
+
+/*
+ *	Drivers reference KUSER_SHARED_DATA at its kernel address, which is
+ *	redirected to DdkSharedUserData before the image is loaded. Code
+ *	is decoded to find 64-bit immediates and absolute addresses, and data
+ *	sections are searched for aligned pointers. ARM64 code loads such
+ *	constants from literal pools within the code, so its code sections
+ *	are searched in the same way. Values covered by a base relocation are
+ *	addresses within the image and are left alone.
+ */
+
+#define KERNEL_SHARED_DATA	0xFFFFF78000000000ULL
+#define SHARED_DATA_MASK	0xFFFFFFFFFFFF8000ULL
+
+char *DdkFileAddress(char *pBuffer, DWORD size, DWORD rva, DWORD len);
+
+
+static int __cdecl DdkCompareRva(const void *p1, const void *p2)
+{
+	DWORD rva1 = *(const DWORD *)p1, rva2 = *(const DWORD *)p2;
+	return (rva1 < rva2) ? -1 : (rva1 > rva2) ? 1 : 0;
+}
+
+
+static DWORD *DdkGetRelocations(char *pBuffer, DWORD size, DWORD *pCount)
+{
+	PIMAGE_NT_HEADERS64 pHdr = (PIMAGE_NT_HEADERS64)(&pBuffer[((PIMAGE_DOS_HEADER)pBuffer)->e_lfanew]);
+	IMAGE_DATA_DIRECTORY *pDir = &pHdr->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
+	DWORD rva = pDir->VirtualAddress, end = rva + pDir->Size, count = 0;
+
+	*pCount = 0;
+	if (!pDir->Size) return NULL;
+
+	DWORD *relocs = (DWORD *)malloc(pDir->Size / sizeof(WORD) * sizeof(DWORD));
+	if (!relocs) ddkfail("Unable to allocate relocation table");
+
+	while (rva < end) {
+		PIMAGE_BASE_RELOCATION pBlock = (PIMAGE_BASE_RELOCATION)
+			DdkFileAddress(pBuffer, size, rva, sizeof(IMAGE_BASE_RELOCATION));
+
+		if (!pBlock || pBlock->SizeOfBlock < sizeof(IMAGE_BASE_RELOCATION)
+				|| !DdkFileAddress(pBuffer, size, rva, pBlock->SizeOfBlock))
+			break;
+
+		WORD *pEntry = (WORD *)(pBlock + 1);
+		DWORD n = (pBlock->SizeOfBlock - sizeof(IMAGE_BASE_RELOCATION)) / sizeof(WORD);
+
+		for (DWORD i = 0; i < n && count < pDir->Size / sizeof(WORD); i++)
+			if ((pEntry[i] >> 12) == IMAGE_REL_BASED_DIR64)
+				relocs[count++] = pBlock->VirtualAddress + (pEntry[i] & 0xfff);
+
+		rva += pBlock->SizeOfBlock;
+	}
+
+	qsort(relocs, count, sizeof(DWORD), DdkCompareRva);
+	*pCount = count;
+	return relocs;
+}
+
+
+static void DdkPatchSharedValue(BYTE *pValue, DWORD rva, DWORD *relocs, DWORD count)
+{
+	ULONG64 value = *(ULONG64 UNALIGNED *)pValue;
+
+	if ((value & SHARED_DATA_MASK) != KERNEL_SHARED_DATA) return;
+	if (bsearch(&rva, relocs, count, sizeof(DWORD), DdkCompareRva)) return;
+
+	*(ULONG64 UNALIGNED *)pValue = DdkSharedUserData | (value & ~SHARED_DATA_MASK);
+}
+
+
+static void DdkPatchSharedSection(BYTE *pStart, DWORD len, DWORD rva, DWORD *relocs, DWORD count)
+{
+	DWORD i = 0;
+
+#if defined(_AMD64_)
+
+	// Compare two aligned values at a time
+
+	const __m128i mask = _mm_set1_epi64x((LONG64)SHARED_DATA_MASK);
+	const __m128i shared = _mm_set1_epi64x((LONG64)KERNEL_SHARED_DATA);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(pStart + i)), mask);
+		int match = _mm_movemask_epi8(_mm_cmpeq_epi8(v, shared));
+
+		if ((match & 0x00ff) == 0x00ff) DdkPatchSharedValue(pStart + i, rva + i, relocs, count);
+		if ((match & 0xff00) == 0xff00) DdkPatchSharedValue(pStart + i + 8, rva + i + 8, relocs, count);
+	}
+
+#endif
+
+	for (; i + 8 <= len; i += 8)
+		DdkPatchSharedValue(pStart + i, rva + i, relocs, count);
+}
+
+
+#if defined(_AMD64_)
+
+static bool isAbsoluteOperand(const BYTE *op, const BYTE *next)
+{
+	bool addrsize = false;
+	BYTE rex = 0;
+
+	for (;; op++) {
+		if (*op == 0x67) addrsize = true;
+		else if (*op == 0x64 || *op == 0x65) return false;
+		else if (*op != 0x66 && *op != 0xf2 && *op != 0xf3 && *op != 0x26
+			&& *op != 0x2e && *op != 0x36 && *op != 0x3e) break;
+	}
+
+	if ((*op & 0xf0) == 0x40) rex = *op++;
+
+	// The opcode must be followed by the eight byte operand
+
+	if (next - op != 9) return false;
+
+	// mov reg, imm64
+
+	if ((rex & 8) && (*op & 0xf8) == 0xb8) return true;
+
+	// mov acc, [moffs64] or mov [moffs64], acc
+
+	return !addrsize && *op >= 0xa0 && *op <= 0xa3;
+}
+
+
+static void DdkPatchSharedCode(BYTE *pStart, BYTE *pEnd, DWORD rva, DWORD *relocs, DWORD count)
+{
+	for (BYTE *cp = pStart, *next; cp < pEnd; cp = next) {
+		next = (BYTE *)DetourCopyInstruction(NULL, NULL, cp, NULL, NULL);
+
+		if (!next || next <= cp || next > pEnd) return;
+
+		if (isAbsoluteOperand(cp, next))
+			DdkPatchSharedValue(next - 8, rva + (DWORD)(next - 8 - pStart), relocs, count);
+	}
+}
+
+
+static void DdkPatchSharedFunctions(char *pBuffer, DWORD size, PIMAGE_SECTION_HEADER pSection,
+	DWORD len, DWORD *relocs, DWORD count)
+{
+	PIMAGE_NT_HEADERS64 pHdr = (PIMAGE_NT_HEADERS64)(&pBuffer[((PIMAGE_DOS_HEADER)pBuffer)->e_lfanew]);
+	IMAGE_DATA_DIRECTORY *pDir = &pHdr->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+	DWORD nfunc = pDir->Size / sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY);
+
+	PIMAGE_RUNTIME_FUNCTION_ENTRY pFunc = (PIMAGE_RUNTIME_FUNCTION_ENTRY)
+		DdkFileAddress(pBuffer, size, pDir->VirtualAddress, pDir->Size);
+
+	BYTE *pBase = (BYTE *)pBuffer + pSection->PointerToRawData;
+	DWORD start = pSection->VirtualAddress, end = start + len;
+
+	// Decode from each function start to the next, which also covers
+	// leaf functions that have no unwind data
+
+	for (DWORD j = 0; pFunc && j <= nfunc; j++) {
+		DWORD next = end;
+
+		for (; j < nfunc; j++)
+			if (pFunc[j].BeginAddress > start && pFunc[j].BeginAddress < end) {
+				next = pFunc[j].BeginAddress;
+				break;
+			}
+
+		DdkPatchSharedCode(pBase + (start - pSection->VirtualAddress),
+			pBase + (next - pSection->VirtualAddress), start, relocs, count);
+
+		start = next;
+	}
+
+	if (!pFunc)
+		DdkPatchSharedCode(pBase, pBase + len, start, relocs, count);
+}
+
+#endif
+
+
+void DdkPatchSharedData(char *pBuffer, DWORD size)
+{
+	PIMAGE_NT_HEADERS64 pHdr = (PIMAGE_NT_HEADERS64)(&pBuffer[((PIMAGE_DOS_HEADER)pBuffer)->e_lfanew]);
+	PIMAGE_SECTION_HEADER pSection = IMAGE_FIRST_SECTION(pHdr);
+	DWORD count, *relocs = DdkGetRelocations(pBuffer, size, &count);
+
+	for (int i = 0; i < pHdr->FileHeader.NumberOfSections; i++) {
+		DWORD len = pSection[i].SizeOfRawData;
+
+		if (pSection[i].Misc.VirtualSize && pSection[i].Misc.VirtualSize < len)
+			len = pSection[i].Misc.VirtualSize;
+
+		if (!DdkFileAddress(pBuffer, size, pSection[i].VirtualAddress, len))
+			continue;
+
+		if (pSection[i].Characteristics & IMAGE_SCN_MEM_EXECUTE) {
+#if defined(_AMD64_)
+			DdkPatchSharedFunctions(pBuffer, size, &pSection[i], len, relocs, count);
+#elif defined(_ARM64_)
+			DdkPatchSharedSection((BYTE *)pBuffer + pSection[i].PointerToRawData,
+				len, pSection[i].VirtualAddress, relocs, count);
+#endif
+		}
+
+		else if ((pSection[i].Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA)
+				&& !(pSection[i].Characteristics & IMAGE_SCN_MEM_DISCARDABLE))
+			DdkPatchSharedSection((BYTE *)pBuffer + pSection[i].PointerToRawData,
+				len, pSection[i].VirtualAddress, relocs, count);
+	}
+
+	free(relocs);
+}
@@ -0,0 +1,489 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Queue Routines
+ */
+
+#include "stdafx.h"
+
+
+/*
+ *	A queue counts the running threads associated with it, and only hands
+ *	out entries while the count is below its maximum. A thread joins a
+ *	queue by removing from it, and stops being counted when it comes back
+ *	for another entry. An associated thread that blocks in any other wait
+ *	gives up its place, so that a waiting thread may run instead.
+ *
+ *	Waiting threads are woken last in, first out, as the most recent is
+ *	the most likely to still be in cache, and the entry is handed straight
+ *	to the thread that is woken. A batch is taken under a single lock.
+ *
+ *	A thread's association only changes under the queue lock, and the
+ *	rundown of a queue may end it from another thread. A thread reads
+ *	its own queue under ThreadLock, which the rundown holds exclusive,
+ *	so that the queue cannot change or go away while it takes the lock.
+ */
+
+typedef struct _QUEUE QUEUE;
+
+typedef struct _QTHREAD {
+	struct _QTHREAD	*next;			// Threads associated with the queue
+	struct _QTHREAD	**pprev;
+	QUEUE			*queue;
+	bool			active;			// Counted in the queue
+	bool			blocked;		// Gave up its place to wait
+} QTHREAD;
+
+typedef struct _QWAIT {
+	DISPATCH		event;			// Synchronization event
+	struct _QWAIT	*next;
+	PLIST_ENTRY		entry;			// Handed over by the waker
+	volatile LONG	*abandoned;		// Set by the rundown, until released
+} QWAIT;
+
+struct _QUEUE : public DISPATCH {
+	SRWLOCK			Lock;
+	PLIST_ENTRY		first;			// Circular list of entries, without a head
+	QWAIT			*waits;			// Most recent first
+	QTHREAD			*threads;
+	LONG			current;		// Associated threads running
+	LONG			maximum;
+	volatile LONG	handed;			// Woken with an entry, yet to retake the lock
+};
+
+
+static __declspec(thread) QTHREAD DdkQueueThread;
+static SRWLOCK ThreadLock = SRWLOCK_INIT;
+
+
+static QUEUE *GetQueue(PRKQUEUE Queue)
+{
+	QUEUE *pQueue = (QUEUE *)Queue;
+
+	if (!pQueue || pQueue->type != QueueType)
+		ddkfail("Invalid queue specified");
+
+	return pQueue;
+}
+
+
+static void DdkLinkEntry(QUEUE *pQueue, PLIST_ENTRY Entry, bool head)
+{
+	PLIST_ENTRY first = pQueue->first;
+
+	if (!first) {
+		Entry->Flink = Entry->Blink = Entry;
+		pQueue->first = Entry;
+	}
+
+	else {
+		Entry->Flink = first;
+		Entry->Blink = first->Blink;
+		first->Blink->Flink = Entry;
+		first->Blink = Entry;
+		if (head) pQueue->first = Entry;
+	}
+
+	pQueue->signal++;
+}
+
+
+static PLIST_ENTRY DdkUnlinkEntry(QUEUE *pQueue)
+{
+	PLIST_ENTRY Entry = pQueue->first;
+
+	if (Entry->Flink == Entry) pQueue->first = NULL;
+
+	else {
+		Entry->Blink->Flink = Entry->Flink;
+		Entry->Flink->Blink = Entry->Blink;
+		pQueue->first = Entry->Flink;
+	}
+
+	Entry->Flink = Entry->Blink = NULL;
+	pQueue->signal--;
+	return Entry;
+}
+
+
+/*
+ *	Called with the queue lock held. While there is room, hand entries
+ *	to the most recent waiters. Each woken thread is counted at once, so
+ *	the count never runs over the maximum.
+ */
+
+static void DdkWakeQueue(QUEUE *pQueue)
+{
+	while (pQueue->first && pQueue->waits && pQueue->current < pQueue->maximum) {
+		QWAIT *pWait = pQueue->waits;
+
+		pQueue->waits = pWait->next;
+		pQueue->current++;
+		pQueue->handed++;
+
+		pWait->entry = DdkUnlinkEntry(pQueue);
+		KeSetEvent((PRKEVENT)&pWait->event, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+
+static void DdkLeaveQueue(QTHREAD *t)
+{
+	AcquireSRWLockShared(&ThreadLock);
+	QUEUE *pQueue = t->queue;
+
+	if (pQueue) {
+		AcquireSRWLockExclusive(&pQueue->Lock);
+
+		*t->pprev = t->next;
+		if (t->next) t->next->pprev = t->pprev;
+
+		if (t->active) {
+			pQueue->current--;
+			DdkWakeQueue(pQueue);
+		}
+
+		t->queue = NULL;
+		t->active = t->blocked = false;
+		ReleaseSRWLockExclusive(&pQueue->Lock);
+	}
+
+	ReleaseSRWLockShared(&ThreadLock);
+}
+
+
+/*
+ *	Called as an associated thread blocks in another wait, and as it
+ *	returns from it.
+ */
+
+void DdkQueueBlock()
+{
+	QTHREAD *t = &DdkQueueThread;
+
+	if (!t->queue) return;
+
+	AcquireSRWLockShared(&ThreadLock);
+	QUEUE *pQueue = t->queue;
+
+	if (pQueue) {
+		AcquireSRWLockExclusive(&pQueue->Lock);
+
+		if (t->active) {
+			t->active = false;
+			t->blocked = true;
+			pQueue->current--;
+			DdkWakeQueue(pQueue);
+		}
+
+		ReleaseSRWLockExclusive(&pQueue->Lock);
+	}
+
+	ReleaseSRWLockShared(&ThreadLock);
+}
+
+
+void DdkQueueUnblock()
+{
+	QTHREAD *t = &DdkQueueThread;
+
+	if (!t->queue) return;
+
+	AcquireSRWLockShared(&ThreadLock);
+	QUEUE *pQueue = t->queue;
+
+	if (pQueue) {
+		AcquireSRWLockExclusive(&pQueue->Lock);
+
+		if (t->blocked) {
+			t->active = true;
+			t->blocked = false;
+			pQueue->current++;
+		}
+
+		ReleaseSRWLockExclusive(&pQueue->Lock);
+	}
+
+	ReleaseSRWLockShared(&ThreadLock);
+}
+
+
+void DdkQueueThreadExit()
+{
+	if (DdkQueueThread.queue) DdkLeaveQueue(&DdkQueueThread);
+}
+
+
+void DdkInitializeQueue(PRKQUEUE Queue, ULONG Count)
+{
+	QUEUE *pQueue = (QUEUE *)Queue;
+
+	DdkInitializeObject(pQueue, sizeof(QUEUE), _SizeofQueue_);
+
+	pQueue->type = QueueType;
+	pQueue->notify = true;
+	pQueue->maximum = (Count) ? Count : DdkGetProcessorCount();
+	InitializeSRWLock(&pQueue->Lock);
+}
+
+
+/*
+ *	Entries are waiting, and there is room to run them, but no thread is
+ *	waiting to take them.
+ */
+
+bool DdkQueueStarved(PRKQUEUE Queue)
+{
+	QUEUE *pQueue = GetQueue(Queue);
+
+	AcquireSRWLockShared(&pQueue->Lock);
+	bool starved = (pQueue->first && !pQueue->waits && pQueue->current < pQueue->maximum);
+	ReleaseSRWLockShared(&pQueue->Lock);
+
+	return starved;
+}
+
+
+DDKAPI
+VOID KeInitializeQueue(PRKQUEUE Queue, ULONG Count)
+{
+	DDKASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+	DdkInitializeQueue(Queue, Count);
+}
+
+
+static LONG DdkInsertQueue(PRKQUEUE Queue, PLIST_ENTRY Entry, bool head)
+{
+	QUEUE *pQueue = GetQueue(Queue);
+
+	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+	AcquireSRWLockExclusive(&pQueue->Lock);
+
+	LONG prev = pQueue->signal;
+
+	DdkLinkEntry(pQueue, Entry, head);
+	DdkWakeQueue(pQueue);
+
+	ReleaseSRWLockExclusive(&pQueue->Lock);
+
+	// A queue is signalled while it holds entries
+
+	DdkWakeWaiters(pQueue);
+	return prev;
+}
+
+
+DDKAPI
+LONG KeInsertQueue(PRKQUEUE Queue, PLIST_ENTRY Entry)
+{
+	return DdkInsertQueue(Queue, Entry, false);
+}
+
+
+DDKAPI
+LONG KeInsertHeadQueue(PRKQUEUE Queue, PLIST_ENTRY Entry)
+{
+	return DdkInsertQueue(Queue, Entry, true);
+}
+
+
+DDKAPI
+LONG KeReadStateQueue(PRKQUEUE Queue)
+{
+	return GetQueue(Queue)->signal;
+}
+
+
+/*
+ *	ULONG KeRemoveQueueEx(PKQUEUE Queue, KPROCESSOR_MODE WaitMode,
+ *			BOOLEAN Alertable, PLARGE_INTEGER Timeout,
+ *			PLIST_ENTRY *EntryArray, ULONG Count)
+ *
+ *	Remove up to Count entries, waiting for the first. A wait that times
+ *	out returns a single entry of STATUS_TIMEOUT, and one ended by the
+ *	rundown of the queue a single entry of STATUS_ABANDONED.
+ */
+
+DDKAPI
+ULONG KeRemoveQueueEx(PKQUEUE Queue, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout, PLIST_ENTRY *EntryArray, ULONG Count)
+{
+	QUEUE *pQueue = GetQueue(Queue);
+	QTHREAD *t = &DdkQueueThread;
+	ULONG n = 0;
+	QWAIT wait;
+
+	DDKASSERT(Count > 0);
+	DDKASSERT(KeGetCurrentIrql() <= ((Timeout && !Timeout->QuadPart) ? DISPATCH_LEVEL : APC_LEVEL));
+
+	if (t->queue && t->queue != pQueue) DdkLeaveQueue(t);
+
+	AcquireSRWLockExclusive(&pQueue->Lock);
+
+	// Coming back for another entry ends the work on the last
+
+	if (t->queue == pQueue) {
+		if (t->active) pQueue->current--;
+	}
+
+	else {
+		t->queue = pQueue;
+		t->next = pQueue->threads;
+		t->pprev = &pQueue->threads;
+		if (t->next) t->next->pprev = &t->next;
+		pQueue->threads = t;
+	}
+
+	t->active = t->blocked = false;
+
+	if (pQueue->first && pQueue->current < pQueue->maximum) {
+		pQueue->current++;
+		t->active = true;
+	}
+
+	else if (!Timeout || Timeout->QuadPart) {
+		KeInitializeEvent((PRKEVENT)&wait.event, SynchronizationEvent, FALSE);
+		wait.entry = NULL;
+		wait.abandoned = NULL;
+		wait.next = pQueue->waits;
+		pQueue->waits = &wait;
+
+		ReleaseSRWLockExclusive(&pQueue->Lock);
+		NTSTATUS rc = KeWaitForSingleObject(&wait.event, WrQueue, WaitMode, Alertable, Timeout);
+		AcquireSRWLockExclusive(&pQueue->Lock);
+
+		// The rundown has already let this thread go, and waits for it
+		// to release the queue
+
+		if (wait.abandoned) {
+			ReleaseSRWLockExclusive(&pQueue->Lock);
+			InterlockedDecrement(wait.abandoned);
+			WakeByAddressSingle((PVOID)wait.abandoned);
+
+			EntryArray[0] = (PLIST_ENTRY)(ULONG_PTR)STATUS_ABANDONED;
+			return 1;
+		}
+
+		// The entry may have been handed over as the wait timed out
+
+		if (!wait.entry) {
+			for (QWAIT **pp = &pQueue->waits; *pp; pp = &(*pp)->next)
+				if (*pp == &wait) {
+					*pp = wait.next;
+					break;
+				}
+
+			pQueue->current++;
+			t->active = true;
+			ReleaseSRWLockExclusive(&pQueue->Lock);
+
+			EntryArray[0] = (PLIST_ENTRY)(ULONG_PTR)((rc == STATUS_SUCCESS) ? STATUS_TIMEOUT : rc);
+			return 1;
+		}
+
+		// The rundown waits for a thread that was handed an entry. If it
+		// has been let go since, the entry is all it takes
+
+		if (t->queue != pQueue) {
+			ReleaseSRWLockExclusive(&pQueue->Lock);
+			InterlockedDecrement(&pQueue->handed);
+			WakeByAddressAll((PVOID)&pQueue->handed);
+
+			EntryArray[0] = wait.entry;
+			return 1;
+		}
+
+		pQueue->handed--;
+		EntryArray[n++] = wait.entry;
+		t->active = true;
+	}
+
+	while (t->active && n < Count && pQueue->first)
+		EntryArray[n++] = DdkUnlinkEntry(pQueue);
+
+	if (!t->active) {
+		pQueue->current++;
+		t->active = true;
+		EntryArray[n++] = (PLIST_ENTRY)(ULONG_PTR)STATUS_TIMEOUT;
+	}
+
+	ReleaseSRWLockExclusive(&pQueue->Lock);
+	return n;
+}
+
+
+DDKAPI
+PLIST_ENTRY KeRemoveQueue(PRKQUEUE Queue, KPROCESSOR_MODE WaitMode, PLARGE_INTEGER Timeout)
+{
+	PLIST_ENTRY Entry;
+
+	KeRemoveQueueEx(Queue, WaitMode, FALSE, Timeout, &Entry, 1);
+	return Entry;
+}
+
+
+/*
+ *	PLIST_ENTRY KeRundownQueue(PRKQUEUE Queue)
+ *
+ *	Return the entries left in the queue, as a list without a head, and
+ *	release the threads associated with it. Threads waiting on the queue
+ *	are woken with STATUS_ABANDONED, while those already handed an entry
+ *	return just that entry. All have let go of the queue on return, so
+ *	that the caller may free it.
+ */
+
+DDKAPI
+PLIST_ENTRY KeRundownQueue(PRKQUEUE Queue)
+{
+	QUEUE *pQueue = GetQueue(Queue);
+	volatile LONG pending = 0;
+
+	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+	AcquireSRWLockExclusive(&ThreadLock);
+	AcquireSRWLockExclusive(&pQueue->Lock);
+
+	PLIST_ENTRY Entry = pQueue->first;
+
+	pQueue->first = NULL;
+	pQueue->signal = 0;
+
+	while (pQueue->threads) {
+		QTHREAD *t = pQueue->threads;
+
+		pQueue->threads = t->next;
+		t->queue = NULL;
+		t->active = t->blocked = false;
+	}
+
+	// Each waiter reacquires the lock before its wait goes out of scope
+
+	while (pQueue->waits) {
+		QWAIT *pWait = pQueue->waits;
+
+		pQueue->waits = pWait->next;
+		pWait->abandoned = &pending;
+		pending++;
+		KeSetEvent((PRKEVENT)&pWait->event, IO_NO_INCREMENT, FALSE);
+	}
+
+	pQueue->current = 0;
+	ReleaseSRWLockExclusive(&pQueue->Lock);
+	ReleaseSRWLockExclusive(&ThreadLock);
+
+	for (LONG n; (n = pending) != 0; )
+		WaitOnAddress((PVOID)&pending, &n, sizeof(n), INFINITE);
+
+	for (LONG n; (n = pQueue->handed) != 0; )
+		WaitOnAddress((PVOID)&pQueue->handed, &n, sizeof(n), INFINITE);
+
+	return Entry;
+}
@@ -47,6 +47,7 @@ NTSTATUS DdkGetRegistryStatus(LSTATUS rc);
 
 
 static HKEY hive = NULL;
+static HKEY checkpoint = NULL;
 
 
 void DdkRegistryInit()
@@ -94,11 +95,46 @@ void DdkRegistryInit()
 
 void DdkRegistryDeinit()
 {
+	if (checkpoint != NULL)
+		RegCloseKey(checkpoint);
+
 	if (hive != NULL)
 		RegCloseKey(hive);
 }
 
 
+void DdkCheckpointRegistry()
+{
+	if (checkpoint == NULL) {
+		char path[MAX_PATH+1];
+
+		DdkGetLocalPath(path, sizeof(path), "C:\\Windows\\System32\\Config", "checkpoint.dat");
+
+		if (RegLoadAppKeyA(path, &checkpoint, KEY_ALL_ACCESS,
+				REG_PROCESS_APPKEY, NULL) != ERROR_SUCCESS)
+			ddkfail("Unable to create registry checkpoint");
+	}
+
+	RegDeleteTreeW(checkpoint, NULL);
+
+	if (RegCopyTreeW(hive, NULL, checkpoint) != ERROR_SUCCESS)
+		ddkfail("Unable to checkpoint registry");
+}
+
+
+void DdkRestoreRegistry()
+{
+	// Keys opened since the checkpoint are left referring to deleted keys
+
+	if (checkpoint == NULL) return;
+
+	RegDeleteTreeW(hive, NULL);
+
+	if (RegCopyTreeW(checkpoint, NULL, hive) != ERROR_SUCCESS)
+		ddkfail("Unable to restore registry");
+}
+
+
 DDKAPI
 void DdkCreateRegistryKey(ULONG RelativeTo, PWSTR Path)
 {
@@ -0,0 +1,454 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Executive Resource Routines
+ */
+
+#include "stdafx.h"
+
+
+/*
+ *	A resource is owned exclusively by one thread, or shared by any number
+ *	of threads, each of which may acquire it recursively. Shared owners
+ *	are kept in a table that grows as needed.
+ *
+ *	A thread that cannot acquire the resource queues a wait record, and
+ *	ownership is handed to it on release, as in the kernel. An exclusive
+ *	release grants all the shared waiters, and a shared release grants
+ *	the oldest exclusive waiter, so that neither side can starve the
+ *	other. New shared acquires wait behind exclusive waiters, unless the
+ *	caller asks to starve them.
+ */
+
+enum { SharedWait, SharedStarveExclusive, SharedWaitForExclusive };
+
+typedef struct _OWNER {
+	ERESOURCE_THREAD	thread;
+	LONG				count;
+} OWNER;
+
+typedef struct _OWNERS {
+	ULONG			size;
+	OWNER			v[1];
+} OWNERS;
+
+typedef struct _RWAIT {
+	DISPATCH		event;			// Synchronization event
+	struct _RWAIT	*next;
+	ERESOURCE_THREAD thread;
+} RWAIT;
+
+typedef struct _RESOURCE : public OBJECT {
+	SRWLOCK			Lock;
+	OWNERS			*owners;		// Shared owners
+	RWAIT			*shared;		// Shared waiters, granted together
+	RWAIT			*exclusive;		// Exclusive waiters, oldest first
+	RWAIT			**tail;
+	ERESOURCE_THREAD owner;			// Exclusive owner
+	LONG			recursion;
+	LONG			active;			// Shared acquires held
+	ULONG			sharedwaiters;
+	ULONG			exclusivewaiters;
+	ULONG			contention;		// Acquires that had to wait
+} RESOURCE;
+
+
+static RESOURCE *GetResource(PERESOURCE Resource)
+{
+	RESOURCE *pRes = (RESOURCE *)Resource;
+
+	if (!pRes || pRes->type != ResourceType)
+		ddkfail("Invalid resource specified");
+
+	return pRes;
+}
+
+
+static ERESOURCE_THREAD DdkResourceThread()
+{
+	return (ERESOURCE_THREAD)KeGetCurrentThread();
+}
+
+
+/*
+ *	Called with the resource lock held.
+ */
+
+static OWNER *DdkFindOwner(RESOURCE *pRes, ERESOURCE_THREAD thread, bool create)
+{
+	OWNERS *pOwners = pRes->owners;
+	OWNER *pFree = NULL;
+	ULONG i, size = (pOwners) ? pOwners->size : 0;
+
+	for (i = 0; i < size; i++) {
+		if (pOwners->v[i].thread == thread) return &pOwners->v[i];
+		if (!pFree && !pOwners->v[i].thread) pFree = &pOwners->v[i];
+	}
+
+	if (!create) return NULL;
+
+	if (!pFree) {
+		ULONG n = (size) ? size * 2 : 4;
+
+		pOwners = (OWNERS *)realloc(pOwners, sizeof(OWNERS) + (n - 1) * sizeof(OWNER));
+
+		if (!pOwners)
+			ddkfail("Unable to allocate resource owner table");
+
+		memset(&pOwners->v[size], 0, (n - size) * sizeof(OWNER));
+		pOwners->size = n;
+		pRes->owners = pOwners;
+		pFree = &pOwners->v[size];
+	}
+
+	pFree->thread = thread;
+	pFree->count = 0;
+	return pFree;
+}
+
+
+static void DdkGrantShared(RESOURCE *pRes)
+{
+	while (pRes->shared) {
+		RWAIT *pWait = pRes->shared;
+
+		pRes->shared = pWait->next;
+		pRes->sharedwaiters--;
+		pRes->active++;
+		DdkFindOwner(pRes, pWait->thread, true)->count++;
+
+		KeSetEvent((PRKEVENT)&pWait->event, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+
+static bool DdkGrantExclusive(RESOURCE *pRes)
+{
+	RWAIT *pWait = pRes->exclusive;
+
+	if (!pWait) return false;
+
+	if (!(pRes->exclusive = pWait->next))
+		pRes->tail = &pRes->exclusive;
+
+	pRes->exclusivewaiters--;
+	pRes->owner = pWait->thread;
+	pRes->recursion = 1;
+
+	KeSetEvent((PRKEVENT)&pWait->event, IO_NO_INCREMENT, FALSE);
+	return true;
+}
+
+
+/*
+ *	Called with the resource lock held, which is released before waiting
+ *	for ownership to be handed over.
+ */
+
+static void DdkWaitResource(RESOURCE *pRes, RWAIT *pWait, ERESOURCE_THREAD thread, bool exclusive)
+{
+	KeInitializeEvent((PRKEVENT)&pWait->event, SynchronizationEvent, FALSE);
+	pWait->thread = thread;
+	pWait->next = NULL;
+	pRes->contention++;
+
+	if (exclusive) {
+		*pRes->tail = pWait;
+		pRes->tail = &pWait->next;
+		pRes->exclusivewaiters++;
+	}
+
+	else {
+		pWait->next = pRes->shared;
+		pRes->shared = pWait;
+		pRes->sharedwaiters++;
+	}
+
+	ReleaseSRWLockExclusive(&pRes->Lock);
+	KeWaitForSingleObject(&pWait->event, Executive, KernelMode, FALSE, NULL);
+}
+
+
+static BOOLEAN DdkAcquireShared(PERESOURCE Resource, BOOLEAN Wait, int mode, PVOID pCaller)
+{
+	RESOURCE *pRes = GetResource(Resource);
+	ERESOURCE_THREAD thread = DdkResourceThread();
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+	bool contended = false;
+	RWAIT wait;
+
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+	AcquireSRWLockExclusive(&pRes->Lock);
+
+	OWNER *pOwner = (pRes->owner) ? NULL : DdkFindOwner(pRes, thread, false);
+
+	// A shared owner may acquire again past exclusive waiters, unless it
+	// asked to wait for them
+
+	bool grant = (!pRes->owner && (!pRes->exclusive || mode == SharedStarveExclusive
+		|| (pOwner && mode == SharedWait)));
+
+	// An exclusive owner acquires shared as a recursive exclusive acquire
+
+	if (pRes->owner == thread) {
+		pRes->recursion++;
+		ReleaseSRWLockExclusive(&pRes->Lock);
+	}
+
+	else if (grant) {
+		if (!pOwner) pOwner = DdkFindOwner(pRes, thread, true);
+		pOwner->count++;
+		pRes->active++;
+		ReleaseSRWLockExclusive(&pRes->Lock);
+	}
+
+	else if (!Wait) {
+		ReleaseSRWLockExclusive(&pRes->Lock);
+		return FALSE;
+	}
+
+	else {
+		DdkWaitResource(pRes, &wait, thread, false);
+		contended = true;
+	}
+
+	if (start) DdkLockStatAcquire(pRes, pCaller, LockShared, start, contended);
+	return TRUE;
+}
+
+
+DDKAPI
+NTSTATUS ExInitializeResourceLite(PERESOURCE Resource)
+{
+	RESOURCE *pRes = (RESOURCE *)Resource;
+
+	DdkInitializeObject(pRes, sizeof(RESOURCE), _SizeofResource_);
+
+	pRes->type = ResourceType;
+	pRes->tail = &pRes->exclusive;
+	InitializeSRWLock(&pRes->Lock);
+	return STATUS_SUCCESS;
+}
+
+
+DDKAPI
+NTSTATUS ExReinitializeResourceLite(PERESOURCE Resource)
+{
+	RESOURCE *pRes = GetResource(Resource);
+
+	DDKASSERT(!pRes->shared && !pRes->exclusive);
+
+	free(pRes->owners);
+	return ExInitializeResourceLite(Resource);
+}
+
+
+DDKAPI
+NTSTATUS ExDeleteResourceLite(PERESOURCE Resource)
+{
+	RESOURCE *pRes = GetResource(Resource);
+
+	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+	DDKASSERT(!pRes->shared && !pRes->exclusive);
+
+	free(pRes->owners);
+	pRes->owners = NULL;
+	pRes->type = 0;
+	return STATUS_SUCCESS;
+}
+
+
+DDKAPI
+BOOLEAN ExAcquireResourceSharedLite(PERESOURCE Resource, BOOLEAN Wait)
+{
+	return DdkAcquireShared(Resource, Wait, SharedWait, _ReturnAddress());
+}
+
+
+DDKAPI
+BOOLEAN ExAcquireSharedStarveExclusive(PERESOURCE Resource, BOOLEAN Wait)
+{
+	return DdkAcquireShared(Resource, Wait, SharedStarveExclusive, _ReturnAddress());
+}
+
+
+DDKAPI
+BOOLEAN ExAcquireSharedWaitForExclusive(PERESOURCE Resource, BOOLEAN Wait)
+{
+	return DdkAcquireShared(Resource, Wait, SharedWaitForExclusive, _ReturnAddress());
+}
+
+
+DDKAPI
+BOOLEAN ExAcquireResourceExclusiveLite(PERESOURCE Resource, BOOLEAN Wait)
+{
+	RESOURCE *pRes = GetResource(Resource);
+	ERESOURCE_THREAD thread = DdkResourceThread();
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+	bool contended = false;
+	RWAIT wait;
+
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+	AcquireSRWLockExclusive(&pRes->Lock);
+
+	if (pRes->owner == thread)
+		pRes->recursion++;
+
+	else if (!pRes->owner && !pRes->active) {
+		pRes->owner = thread;
+		pRes->recursion = 1;
+	}
+
+	else if (!Wait) {
+		ReleaseSRWLockExclusive(&pRes->Lock);
+		return FALSE;
+	}
+
+	// A shared owner waiting for exclusive access would wait forever
+
+	else if (DdkFindOwner(pRes, thread, false))
+		ddkfail("Exclusive acquire of a resource held shared");
+
+	else {
+		DdkWaitResource(pRes, &wait, thread, true);
+		contended = true;
+	}
+
+	if (!contended) ReleaseSRWLockExclusive(&pRes->Lock);
+
+	if (start) DdkLockStatAcquire(pRes, _ReturnAddress(), LockExclusive, start, contended);
+	return TRUE;
+}
+
+
+DDKAPI
+VOID ExConvertExclusiveToSharedLite(PERESOURCE Resource)
+{
+	RESOURCE *pRes = GetResource(Resource);
+	ERESOURCE_THREAD thread = DdkResourceThread();
+
+	AcquireSRWLockExclusive(&pRes->Lock);
+
+	if (pRes->owner != thread)
+		KeBugCheckEx(RESOURCE_NOT_OWNED, (ULONG_PTR)Resource, thread, 0, 0);
+
+	DdkFindOwner(pRes, thread, true)->count += pRes->recursion;
+	pRes->active += pRes->recursion;
+	pRes->owner = 0;
+	pRes->recursion = 0;
+
+	DdkGrantShared(pRes);
+	ReleaseSRWLockExclusive(&pRes->Lock);
+}
+
+
+DDKAPI
+VOID ExReleaseResourceForThreadLite(PERESOURCE Resource, ERESOURCE_THREAD ResourceThreadId)
+{
+	RESOURCE *pRes = GetResource(Resource);
+
+	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+	AcquireSRWLockExclusive(&pRes->Lock);
+
+	if (pRes->owner && pRes->owner == ResourceThreadId) {
+		if (!--pRes->recursion) {
+			pRes->owner = 0;
+			if (pRes->shared) DdkGrantShared(pRes);
+			else DdkGrantExclusive(pRes);
+		}
+	}
+
+	else {
+		OWNER *pOwner = DdkFindOwner(pRes, ResourceThreadId, false);
+
+		if (!pOwner)
+			KeBugCheckEx(RESOURCE_NOT_OWNED, (ULONG_PTR)Resource, ResourceThreadId, 0, 0);
+
+		if (!--pOwner->count) pOwner->thread = 0;
+		if (!--pRes->active && !DdkGrantExclusive(pRes)) DdkGrantShared(pRes);
+	}
+
+	ReleaseSRWLockExclusive(&pRes->Lock);
+
+	if (DdkLocksHeld) DdkLockStatRelease(pRes);
+}
+
+
+DDKAPI
+VOID ExReleaseResourceLite(PERESOURCE Resource)
+{
+	ExReleaseResourceForThreadLite(Resource, DdkResourceThread());
+}
+
+
+DDKAPI
+BOOLEAN ExIsResourceAcquiredExclusiveLite(PERESOURCE Resource)
+{
+	return (GetResource(Resource)->owner == DdkResourceThread());
+}
+
+
+/*
+ *	ULONG ExIsResourceAcquiredSharedLite(PERESOURCE Resource)
+ *
+ *	Return the number of times the caller holds the resource, either
+ *	shared or exclusive.
+ */
+
+DDKAPI
+ULONG ExIsResourceAcquiredSharedLite(PERESOURCE Resource)
+{
+	RESOURCE *pRes = GetResource(Resource);
+	ERESOURCE_THREAD thread = DdkResourceThread();
+	ULONG count = 0;
+
+	AcquireSRWLockExclusive(&pRes->Lock);
+
+	if (pRes->owner == thread) count = pRes->recursion;
+
+	else {
+		OWNER *pOwner = DdkFindOwner(pRes, thread, false);
+		if (pOwner) count = pOwner->count;
+	}
+
+	ReleaseSRWLockExclusive(&pRes->Lock);
+	return count;
+}
+
+
+DDKAPI
+ULONG ExGetExclusiveWaiterCount(PERESOURCE Resource)
+{
+	return GetResource(Resource)->exclusivewaiters;
+}
+
+
+DDKAPI
+ULONG ExGetSharedWaiterCount(PERESOURCE Resource)
+{
+	return GetResource(Resource)->sharedwaiters;
+}
+
+
+/*
+ *	ULONG DdkGetResourceContention(PERESOURCE Resource)
+ *
+ *	Return the number of acquires that had to wait, as kept in the
+ *	ContentionCount of a kernel resource.
+ */
+
+DDKAPI
+ULONG DdkGetResourceContention(PERESOURCE Resource)
+{
+	return GetResource(Resource)->contention;
+}
@@ -0,0 +1,309 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Rundown Protection Routines
+ */
+
+#include "stdafx.h"
+
+
+/*
+ *	A rundown reference counts in twos, leaving the low bit to mark that
+ *	rundown has started. Once it has, the rest of the word points to the
+ *	wait block of the thread running it down, and releases count down the
+ *	wait block instead, with the last setting its event.
+ *
+ *	The cache aware variant keeps a reference per processor, each in its
+ *	own cache line. A reference may be released on another processor, so
+ *	one count may go negative, but the sum is always right. The wait block
+ *	starts with a bias that is removed once every reference points to it,
+ *	so that partial sums can never reach zero.
+ */
+
+#define RUNDOWN_ACTIVE		1
+#define RUNDOWN_INC			2
+#define RUNDOWN_BIAS		(1LL << 48)
+
+typedef struct _RUNDOWNWAIT {
+	DISPATCH		event;			// Synchronization event
+	volatile LONG64	count;
+} RUNDOWNWAIT;
+
+typedef struct DECLSPEC_CACHEALIGN _RUNDOWNREF {
+	volatile ULONG_PTR	Count;
+} RUNDOWNREF;
+
+typedef struct _RUNDOWNCACHE {
+	RUNDOWNREF		*refs;
+	PVOID			alloc;			// Pool to free, when allocated here
+	ULONG			number;
+} RUNDOWNCACHE;
+
+
+static bool DdkAcquireRundown(volatile ULONG_PTR *pCount, ULONG Count)
+{
+	ULONG_PTR v = *pCount;
+
+	for (;;) {
+		if (v & RUNDOWN_ACTIVE) return false;
+
+		ULONG_PTR prev = (ULONG_PTR)InterlockedCompareExchangePointer(
+			(PVOID volatile *)pCount, (PVOID)(v + (ULONG_PTR)Count * RUNDOWN_INC), (PVOID)v);
+
+		if (prev == v) return true;
+		v = prev;
+	}
+}
+
+
+static void DdkReleaseRundown(volatile ULONG_PTR *pCount, ULONG Count)
+{
+	ULONG_PTR v = *pCount;
+
+	for (;;) {
+		if (v & RUNDOWN_ACTIVE) {
+			RUNDOWNWAIT *pWait = (RUNDOWNWAIT *)(v & ~(ULONG_PTR)RUNDOWN_ACTIVE);
+
+			if (!InterlockedAdd64(&pWait->count, -(LONG64)Count))
+				KeSetEvent((PRKEVENT)&pWait->event, IO_NO_INCREMENT, FALSE);
+
+			return;
+		}
+
+		ULONG_PTR prev = (ULONG_PTR)InterlockedCompareExchangePointer(
+			(PVOID volatile *)pCount, (PVOID)(v - (ULONG_PTR)Count * RUNDOWN_INC), (PVOID)v);
+
+		if (prev == v) return;
+		v = prev;
+	}
+}
+
+
+static void DdkBeginRundown(RUNDOWNWAIT *pWait)
+{
+	KeInitializeEvent((PRKEVENT)&pWait->event, SynchronizationEvent, FALSE);
+	pWait->count = RUNDOWN_BIAS;
+}
+
+
+static void DdkPointRundown(volatile ULONG_PTR *pCount, RUNDOWNWAIT *pWait)
+{
+	ULONG_PTR v = InterlockedExchangePointer((PVOID volatile *)pCount,
+		(PVOID)((ULONG_PTR)pWait | RUNDOWN_ACTIVE));
+
+	DDKASSERT(!(v & RUNDOWN_ACTIVE));
+
+	InterlockedAdd64(&pWait->count, (LONG_PTR)v / RUNDOWN_INC);
+}
+
+
+static void DdkWaitRundown(RUNDOWNWAIT *pWait)
+{
+	if (InterlockedAdd64(&pWait->count, -RUNDOWN_BIAS))
+		KeWaitForSingleObject(&pWait->event, Executive, KernelMode, FALSE, NULL);
+}
+
+
+DDKAPI
+VOID ExInitializeRundownProtection(PEX_RUNDOWN_REF RunRef)
+{
+	*(volatile ULONG_PTR *)RunRef = 0;
+}
+
+
+DDKAPI
+VOID ExReInitializeRundownProtection(PEX_RUNDOWN_REF RunRef)
+{
+	DDKASSERT(*(volatile ULONG_PTR *)RunRef == RUNDOWN_ACTIVE);
+	*(volatile ULONG_PTR *)RunRef = 0;
+}
+
+
+DDKAPI
+BOOLEAN ExAcquireRundownProtection(PEX_RUNDOWN_REF RunRef)
+{
+	return DdkAcquireRundown((volatile ULONG_PTR *)RunRef, 1);
+}
+
+
+DDKAPI
+BOOLEAN ExAcquireRundownProtectionEx(PEX_RUNDOWN_REF RunRef, ULONG Count)
+{
+	return DdkAcquireRundown((volatile ULONG_PTR *)RunRef, Count);
+}
+
+
+DDKAPI
+VOID ExReleaseRundownProtection(PEX_RUNDOWN_REF RunRef)
+{
+	DdkReleaseRundown((volatile ULONG_PTR *)RunRef, 1);
+}
+
+
+DDKAPI
+VOID ExReleaseRundownProtectionEx(PEX_RUNDOWN_REF RunRef, ULONG Count)
+{
+	DdkReleaseRundown((volatile ULONG_PTR *)RunRef, Count);
+}
+
+
+DDKAPI
+VOID ExWaitForRundownProtectionRelease(PEX_RUNDOWN_REF RunRef)
+{
+	volatile ULONG_PTR *pCount = (volatile ULONG_PTR *)RunRef;
+	RUNDOWNWAIT wait;
+
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+	// Nothing to wait for without references, or once run down
+
+	ULONG_PTR v = (ULONG_PTR)InterlockedCompareExchangePointer(
+		(PVOID volatile *)pCount, (PVOID)RUNDOWN_ACTIVE, NULL);
+
+	if (!v || v == RUNDOWN_ACTIVE) return;
+
+	DdkBeginRundown(&wait);
+	DdkPointRundown(pCount, &wait);
+	DdkWaitRundown(&wait);
+
+	*pCount = RUNDOWN_ACTIVE;
+}
+
+
+DDKAPI
+VOID ExRundownCompleted(PEX_RUNDOWN_REF RunRef)
+{
+	*(volatile ULONG_PTR *)RunRef = RUNDOWN_ACTIVE;
+}
+
+
+static RUNDOWNREF *DdkCurrentRundownRef(RUNDOWNCACHE *pCache)
+{
+	return &pCache->refs[DdkGetCurrentProcessor() % pCache->number];
+}
+
+
+DDKAPI
+SIZE_T ExSizeOfRundownProtectionCacheAware()
+{
+	return sizeof(RUNDOWNCACHE) + (DdkGetProcessorCount() + 1) * sizeof(RUNDOWNREF);
+}
+
+
+DDKAPI
+VOID ExInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware, SIZE_T RunRefSize)
+{
+	RUNDOWNCACHE *pCache = (RUNDOWNCACHE *)RunRefCacheAware;
+	ULONG_PTR refs = ((ULONG_PTR)(pCache + 1) + sizeof(RUNDOWNREF) - 1) & ~(ULONG_PTR)(sizeof(RUNDOWNREF) - 1);
+	SIZE_T space = RunRefSize - (refs - (ULONG_PTR)pCache);
+
+	DDKASSERT(RunRefSize >= sizeof(RUNDOWNCACHE) + 2 * sizeof(RUNDOWNREF));
+
+	pCache->refs = (RUNDOWNREF *)refs;
+	pCache->alloc = NULL;
+	pCache->number = (ULONG)min(space / sizeof(RUNDOWNREF), (SIZE_T)DdkGetProcessorCount());
+
+	memset(pCache->refs, 0, pCache->number * sizeof(RUNDOWNREF));
+}
+
+
+DDKAPI
+PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE PoolType, ULONG PoolTag)
+{
+	SIZE_T size = ExSizeOfRundownProtectionCacheAware();
+	RUNDOWNCACHE *pCache = (RUNDOWNCACHE *)ExAllocatePoolWithTag(PoolType, size, PoolTag);
+
+	if (!pCache) return NULL;
+
+	ExInitializeRundownProtectionCacheAware((PEX_RUNDOWN_REF_CACHE_AWARE)pCache, size);
+	pCache->alloc = pCache;
+	return (PEX_RUNDOWN_REF_CACHE_AWARE)pCache;
+}
+
+
+DDKAPI
+VOID ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	RUNDOWNCACHE *pCache = (RUNDOWNCACHE *)RunRefCacheAware;
+
+	DDKASSERT(pCache->alloc == pCache);
+	ExFreePool(pCache->alloc);
+}
+
+
+DDKAPI
+VOID ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	RUNDOWNCACHE *pCache = (RUNDOWNCACHE *)RunRefCacheAware;
+
+	for (ULONG i = 0; i < pCache->number; i++) {
+		DDKASSERT(pCache->refs[i].Count == RUNDOWN_ACTIVE);
+		pCache->refs[i].Count = 0;
+	}
+}
+
+
+DDKAPI
+BOOLEAN ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	return DdkAcquireRundown(&DdkCurrentRundownRef((RUNDOWNCACHE *)RunRefCacheAware)->Count, 1);
+}
+
+
+DDKAPI
+BOOLEAN ExAcquireRundownProtectionCacheAwareEx(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware, ULONG Count)
+{
+	return DdkAcquireRundown(&DdkCurrentRundownRef((RUNDOWNCACHE *)RunRefCacheAware)->Count, Count);
+}
+
+
+DDKAPI
+VOID ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	DdkReleaseRundown(&DdkCurrentRundownRef((RUNDOWNCACHE *)RunRefCacheAware)->Count, 1);
+}
+
+
+DDKAPI
+VOID ExReleaseRundownProtectionCacheAwareEx(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware, ULONG Count)
+{
+	DdkReleaseRundown(&DdkCurrentRundownRef((RUNDOWNCACHE *)RunRefCacheAware)->Count, Count);
+}
+
+
+DDKAPI
+VOID ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	RUNDOWNCACHE *pCache = (RUNDOWNCACHE *)RunRefCacheAware;
+	RUNDOWNWAIT wait;
+	ULONG i;
+
+	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+	DdkBeginRundown(&wait);
+
+	for (i = 0; i < pCache->number; i++)
+		DdkPointRundown(&pCache->refs[i].Count, &wait);
+
+	DdkWaitRundown(&wait);
+
+	for (i = 0; i < pCache->number; i++)
+		pCache->refs[i].Count = RUNDOWN_ACTIVE;
+}
+
+
+DDKAPI
+VOID ExRundownCompletedCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	RUNDOWNCACHE *pCache = (RUNDOWNCACHE *)RunRefCacheAware;
+
+	for (ULONG i = 0; i < pCache->number; i++)
+		pCache->refs[i].Count = RUNDOWN_ACTIVE;
+}
@@ -14,9 +14,8 @@
 #include "stdafx.h"
 
 
-typedef struct _SEMAPHORE : public OBJECT {
-	DWORD			threadid;
-	volatile LONG	count;
+typedef struct _SEMAPHORE : public DISPATCH {
+	LONG			limit;
 } SEMAPHORE, *PSEMAPHORE;
 
 
@@ -26,14 +25,13 @@ VOID KeInitializeSemaphore(PRKSEMAPHORE Semaphore, LONG Count, LONG Limit)
 	SEMAPHORE *pSema = (SEMAPHORE *)Semaphore;
 
 	DDKASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+	DDKASSERT(Count >= 0 && Count <= Limit);
 
 	DdkInitializeObject(pSema, sizeof(SEMAPHORE), _SizeofSemaphore_);
 
-	pSema->h = CreateSemaphore(NULL, Count, Limit, NULL);
 	pSema->type = SemaphoreType;
-	pSema->count = Count;
-
-	if (!pSema->h) ddkfail("Unable to initialize Semaphore");
+	pSema->signal = Count;
+	pSema->limit = Limit;
 }
 
 
@@ -46,12 +44,10 @@ LONG KeReleaseSemaphore(PRKSEMAPHORE Semaphore,
 
 	DDKASSERT(KeGetCurrentIrql() <= (Wait ? PASSIVE_LEVEL : DISPATCH_LEVEL));
 
-	InterlockedAdd(&pSema->count, Adjustment);
-
-	if (!ReleaseSemaphore(pSema->h, Adjustment, &prev))
+	if (Adjustment <= 0 || (prev = DdkSignalObject(pSema, Adjustment, pSema->limit)) < 0)
 		KeBugCheck(STATUS_SEMAPHORE_LIMIT_EXCEEDED);
 
-	return (prev != 0);
+	return prev;
 }
 
 
@@ -59,13 +55,5 @@ DDKAPI
 LONG KeReadStateSemaphore(PRKMUTEX Semaphore)
 {
 	SEMAPHORE *pSema = (SEMAPHORE *)Semaphore;
-	return (pSema->count != 0);
+	return pSema->signal;
 }
-
-
-void DdkUpdateSemaphore(OBJECT *pObj)
-{
-	SEMAPHORE *pSema = (SEMAPHORE *)pObj;
-	InterlockedDecrement(&pSema->count);
-}
-
@@ -14,19 +14,67 @@
 #include "stdddk.h"
 
 
-#define SHARED_DATA	0x7FFE0000;
+#define SHARED_DATA	0x7FFE0000
+
+
+/*
+ *	Drivers are directed to DdkSharedUserData rather than the system
+ *	page. Once virtual time is used it is a private copy, which holds
+ *	the virtual clock, or the real one with any advance carried over
+ *	while drivers loaded against the copy remain.
+ */
+
+ULONG64 DdkSharedUserData = SHARED_DATA;
 
 
 ULONG DdkGetTickCountMultiplier()
 {
-	PKUSER_SHARED_DATA pData = (PKUSER_SHARED_DATA)SHARED_DATA;
+	PKUSER_SHARED_DATA pData = (PKUSER_SHARED_DATA)DdkSharedUserData;
 	return pData->TickCountMultiplier;
 }
 
 
 ULONG64 DdkGetTickCount()
+{
+	PKUSER_SHARED_DATA pData = (PKUSER_SHARED_DATA)DdkSharedUserData;
+	return pData->TickCountQuad;
+}
+
+
+ULONG64 DdkGetSystemTickCount()
 {
 	PKUSER_SHARED_DATA pData = (PKUSER_SHARED_DATA)SHARED_DATA;
 	return pData->TickCountQuad;
 }
 
+
+static void DdkSetSharedTime(volatile KSYSTEM_TIME *pTime, ULONG64 v)
+{
+	// Readers check High1Time against High2Time to detect a torn read
+
+	pTime->High2Time = (LONG)(v >> 32);
+	*(volatile ULONG64 *)&pTime->LowPart = v;
+}
+
+
+void DdkSetVirtualSharedData(PVOID pPage, ULONG64 InterruptTime, ULONG64 SystemTime, ULONG64 TickCount)
+{
+	PKUSER_SHARED_DATA VirtualData = (PKUSER_SHARED_DATA)pPage;
+
+	// Refresh the rest of the page when switching to it
+
+	if (DdkSharedUserData != (ULONG64)pPage)
+		memcpy(VirtualData, (PVOID)SHARED_DATA, sizeof(KUSER_SHARED_DATA));
+
+	DdkSetSharedTime(&VirtualData->InterruptTime, InterruptTime);
+	DdkSetSharedTime(&VirtualData->SystemTime, SystemTime);
+	DdkSetSharedTime(&VirtualData->TickCount, TickCount);
+
+	DdkSharedUserData = (ULONG64)VirtualData;
+}
+
+
+void DdkSetSystemSharedData()
+{
+	DdkSharedUserData = SHARED_DATA;
+}
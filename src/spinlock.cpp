@@ -12,44 +12,124 @@
  */
 
 #include "stdafx.h"
+#include <intrin.h>
 
 
 typedef struct _LOCKHANDLE {
-	PKSPIN_LOCK		lock;
+	struct _LOCKHANDLE * volatile next;
+	volatile LONG64	lock;			// PKSPIN_LOCK and QUEUE flags
 	KIRQL			irql;
 } LOCKHANDLE, *PLOCKHANDLE;
 
 
-static ULONG lockcount = 1;
-static const int maxv = 4096;
+/*
+ *	KSPIN_LOCKs are test-and-test-and-set locks held in the lock word, so
+ *	that a short critical section never sleeps in the OS. Waiters spin on a
+ *	plain read with exponential backoff and only retry the interlocked
+ *	operation once the lock looks free. On oversubscribed hosts a spin
+ *	limit can be set, after which waiters park on the lock word.
+ */
+
+#define SPIN_HELD		0x01
+#define SPIN_PARKED		0x02
+#define SPIN_TAIL		(~(LONG64)0x07)
+#define SPIN_BACKOFF	1024
+
+#define QUEUE_WAIT		0x01
+#define QUEUE_PARKED	0x02
+#define QUEUE_FLAGS		0x03
 
-static SRWLOCK *lockv[4096];
-static SRWLOCK Lock = SRWLOCK_INIT;
+static volatile ULONG SpinLimit = 0;
 
 
 DDKAPI
-VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+VOID DdkSetSpinLimit(ULONG Spins)
+{
+	// Zero spins for ever, which matches the kernel
+
+	SpinLimit = Spins;
+}
+
+
+static
+void DdkAcquireSpinLock(volatile LONG64 *pLock, PVOID pCaller)
+{
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+	ULONG delay = 1, spins = 0;
+	bool contended = false;
+
+	while (InterlockedBitTestAndSet64(pLock, 0)) {
+		LONG64 value;
+		contended = true;
+
+		while ((value = *pLock) & SPIN_HELD) {
+			ULONG limit = SpinLimit;
+
+			if (limit && spins >= limit) {
+				if ((value & SPIN_PARKED) || InterlockedCompareExchange64(pLock,
+						value | SPIN_PARKED, value) == value) {
+					value |= SPIN_PARKED;
+					WaitOnAddress(pLock, &value, sizeof(value), INFINITE);
+				}
+
+				continue;
+			}
+
+			for (ULONG i = 0; i < delay; i++)
+				YieldProcessor();
+
+			spins += delay;
+			if (delay < SPIN_BACKOFF) delay <<= 1;
+		}
+	}
+
+	if (start) DdkLockStatAcquire((PVOID)pLock, pCaller, LockSpin, start, contended);
+}
+
+
+static
+bool DdkTryAcquireSpinLock(volatile LONG64 *pLock, PVOID pCaller)
+{
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+
+	if ((*pLock & SPIN_HELD) || InterlockedBitTestAndSet64(pLock, 0))
+		return false;
+
+	if (start) DdkLockStatAcquire((PVOID)pLock, pCaller, LockSpin, start, false);
+	return true;
+}
+
+
+static
+void DdkReleaseSpinLock(volatile LONG64 *pLock)
 {
-	if (sizeof(SRWLOCK) > sizeof(KSPIN_LOCK))
-		ddkfail("spinlock is too small to initialize");
+	if (DdkLocksHeld) DdkLockStatRelease((PVOID)pLock);
+
+	if (InterlockedExchange64(pLock, 0) & SPIN_PARKED)
+		WakeByAddressAll((PVOID)pLock);
+}
 
-	InitializeSRWLock((SRWLOCK *)SpinLock);
+
+DDKAPI
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+	*SpinLock = 0;
 }
 
 
 DDKAPI
 BOOLEAN KeTestSpinLock(PKSPIN_LOCK SpinLock)
 {
-	return (((SRWLOCK *)SpinLock)->Ptr == 0) ? TRUE : FALSE;
+	return (*(volatile KSPIN_LOCK *)SpinLock & SPIN_HELD) ? FALSE : TRUE;
 }
 
 
 static
-KIRQL AcquireSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
+KIRQL AcquireSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql, PVOID pCaller)
 {
 	KIRQL rc;
 	KeRaiseIrql(NewIrql, &rc);
-	AcquireSRWLockExclusive((SRWLOCK *)SpinLock);
+	DdkAcquireSpinLock((volatile LONG64 *)SpinLock, pCaller);
 	return rc;
 }
 
@@ -58,14 +138,14 @@ DDKAPI
 KIRQL KeAcquireSpinLockRaiseToDpc(PKSPIN_LOCK SpinLock)
 {
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-	return AcquireSpinLock(SpinLock, DISPATCH_LEVEL);
+	return AcquireSpinLock(SpinLock, DISPATCH_LEVEL, _ReturnAddress());
 }
 
 
 DDKAPI
 KIRQL KeAcquireSpinLockForDpc(PKSPIN_LOCK SpinLock)
 {
-	return AcquireSpinLock(SpinLock, DISPATCH_LEVEL);
+	return AcquireSpinLock(SpinLock, DISPATCH_LEVEL, _ReturnAddress());
 }
 
 
@@ -73,7 +153,7 @@ DDKAPI
 VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock)
 {
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	AcquireSpinLock(SpinLock, KeGetCurrentIrql());
+	AcquireSpinLock(SpinLock, KeGetCurrentIrql(), _ReturnAddress());
 }
 
 
@@ -81,7 +161,7 @@ DDKAPI
 BOOLEAN KeTryToAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock)
 {
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	return (TryAcquireSRWLockExclusive((SRWLOCK *)SpinLock) != 0) ? TRUE : FALSE;
+	return DdkTryAcquireSpinLock((volatile LONG64 *)SpinLock, _ReturnAddress()) ? TRUE : FALSE;
 }
 
 
@@ -89,7 +169,7 @@ DDKAPI
 VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
 {
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	ReleaseSRWLockExclusive((SRWLOCK *)SpinLock);
+	DdkReleaseSpinLock((volatile LONG64 *)SpinLock);
 	KeLowerIrql(NewIrql);
 }
 
@@ -108,13 +188,115 @@ VOID KeReleaseSpinLockForDpc(PKSPIN_LOCK SpinLock, KIRQL OldIrql)
 }
 
 
+/*
+ *	In-stack queued spinlocks form an MCS queue. The lock word holds the
+ *	most recent waiter's handle, each waiter spins on its own handle and
+ *	the lock is handed over in FIFO order. A plain spinlock holder has no
+ *	handle, so a queued waiter has to wait for it to release the lock
+ *	before joining the queue.
+ */
+
+static
+void DdkWaitQueuedSpinLock(PLOCKHANDLE h)
+{
+	ULONG spins = 0;
+	LONG64 value;
+
+	while ((value = h->lock) & QUEUE_WAIT) {
+		ULONG limit = SpinLimit;
+
+		if (limit && spins >= limit) {
+			if ((value & QUEUE_PARKED) || InterlockedCompareExchange64(&h->lock,
+					value | QUEUE_PARKED, value) == value) {
+				value |= QUEUE_PARKED;
+				WaitOnAddress(&h->lock, &value, sizeof(value), INFINITE);
+			}
+
+			continue;
+		}
+
+		YieldProcessor();
+		spins++;
+	}
+}
+
+
+static
+void DdkAcquireQueuedSpinLock(PKSPIN_LOCK SpinLock, PLOCKHANDLE h, PVOID pCaller)
+{
+	volatile LONG64 *pLock = (volatile LONG64 *)SpinLock;
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+	ULONG delay = 1;
+
+	h->next = NULL;
+	h->lock = (LONG64)SpinLock | QUEUE_WAIT;
+
+	for (;;) {
+		LONG64 value = *pLock;
+
+		if ((value & SPIN_HELD) && !(value & SPIN_TAIL)) {
+			for (ULONG i = 0; i < delay; i++)
+				YieldProcessor();
+
+			if (delay < SPIN_BACKOFF) delay <<= 1;
+			continue;
+		}
+
+		LONG64 tail = (LONG64)h | SPIN_HELD | (value & SPIN_PARKED);
+
+		if (InterlockedCompareExchange64(pLock, tail, value) != value)
+			continue;
+
+		PLOCKHANDLE prev = (PLOCKHANDLE)(value & SPIN_TAIL);
+
+		if (!prev) h->lock = (LONG64)SpinLock;
+
+		else {
+			prev->next = h;
+			DdkWaitQueuedSpinLock(h);
+		}
+
+		if (start) DdkLockStatAcquire(SpinLock, pCaller, LockQueued, start, (prev || delay > 1));
+		return;
+	}
+}
+
+
+static
+void DdkReleaseQueuedSpinLock(PLOCKHANDLE h)
+{
+	volatile LONG64 *pLock = (volatile LONG64 *)(h->lock & ~(LONG64)QUEUE_FLAGS);
+	PLOCKHANDLE next = h->next;
+
+	if (DdkLocksHeld) DdkLockStatRelease((PVOID)pLock);
+
+	if (!next) {
+		LONG64 value;
+
+		while (((value = *pLock) & SPIN_TAIL) == (LONG64)h)
+			if (InterlockedCompareExchange64(pLock, 0, value) == value) {
+				if (value & SPIN_PARKED) WakeByAddressAll((PVOID)pLock);
+				return;
+			}
+
+		// A waiter has joined the queue and is linking itself in
+
+		while ((next = h->next) == NULL)
+			YieldProcessor();
+	}
+
+	if (InterlockedExchange64(&next->lock, next->lock & ~(LONG64)QUEUE_FLAGS) & QUEUE_PARKED)
+		WakeByAddressSingle((PVOID)&next->lock);
+}
+
+
 DDKAPI
 VOID KeAcquireInStackQueuedSpinLock(PKSPIN_LOCK SpinLock, PKLOCK_QUEUE_HANDLE LockHandle)
 {
 	PLOCKHANDLE h = (PLOCKHANDLE)LockHandle;
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-	h->irql = AcquireSpinLock(SpinLock, DISPATCH_LEVEL);
-	h->lock = SpinLock;
+	KeRaiseIrql(DISPATCH_LEVEL, &h->irql);
+	DdkAcquireQueuedSpinLock(SpinLock, h, _ReturnAddress());
 }
 
 
@@ -123,8 +305,8 @@ VOID KeAcquireInStackQueuedSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock, PKLOCK_QUEUE
 {
 	PLOCKHANDLE h = (PLOCKHANDLE)LockHandle;
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	h->irql = AcquireSpinLock(SpinLock, KeGetCurrentIrql());
-	h->lock = SpinLock;
+	h->irql = KeGetCurrentIrql();
+	DdkAcquireQueuedSpinLock(SpinLock, h, _ReturnAddress());
 }
 
 
@@ -133,7 +315,8 @@ VOID KeReleaseInStackQueuedSpinLock(PKLOCK_QUEUE_HANDLE LockHandle)
 {
 	PLOCKHANDLE h = (PLOCKHANDLE)LockHandle;
 	DDKASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
-	KeReleaseSpinLock(h->lock, h->irql);
+	DdkReleaseQueuedSpinLock(h);
+	KeLowerIrql(h->irql);
 }
 
 
@@ -142,47 +325,116 @@ VOID KeReleaseInStackQueuedSpinLockFromDpcLevel(PKLOCK_QUEUE_HANDLE LockHandle)
 {
 	PLOCKHANDLE h = (PLOCKHANDLE)LockHandle;
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	KeReleaseSpinLock(h->lock, h->irql);
+	DdkReleaseQueuedSpinLock(h);
+	KeLowerIrql(h->irql);
 }
 
 
+/*
+ *	EX_SPIN_LOCKs keep the reader count and writer bits in the lock word.
+ *	A waiting writer stops new readers from entering, so that a stream of
+ *	shared acquires cannot starve it.
+ */
+
+#define EX_WRITER		((LONG)0x80000000)
+#define EX_WRITER_WAIT	0x40000000
+#define EX_READERS		0x3fffffff
+
+
 static
-SRWLOCK *GetSRWLock(PEX_SPIN_LOCK SpinLock)
+void DdkBackoff(ULONG *pDelay, ULONG *pSpins)
 {
-	ULONG i = *(ULONG *)SpinLock;
+	ULONG limit = SpinLimit;
 
-	if (i == 0) {
-		AcquireSRWLockExclusive(&Lock);
+	if (limit && *pSpins >= limit) {
+		SwitchToThread();
+		return;
+	}
 
-		if ((i = *(ULONG *)SpinLock) == 0) {
-			i = lockcount;
+	for (ULONG i = 0; i < *pDelay; i++)
+		YieldProcessor();
 
-			if (i / maxv >= sizeof(lockv) / sizeof(lockv[0]))
-				ddkfail("Too many read write spinlocks");
+	*pSpins += *pDelay;
+	if (*pDelay < SPIN_BACKOFF) *pDelay <<= 1;
+}
 
-			 if (!lockv[i / maxv] && !(lockv[i / maxv] = (SRWLOCK *)calloc(maxv, sizeof(SRWLOCK))))
-				 ddkfail("Unable to allocate read write spinlock");
 
-			 lockcount++;
-			 InterlockedExchange((ULONG *)SpinLock, i);
+static
+void DdkAcquireShared(PEX_SPIN_LOCK SpinLock, PVOID pCaller)
+{
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+	ULONG delay = 1, spins = 0;
+
+	for (;;) {
+		LONG value = *SpinLock;
+
+		if (!(value & (EX_WRITER | EX_WRITER_WAIT))) {
+			if ((value & EX_READERS) == EX_READERS)
+				ddkfail("Too many shared spinlock owners");
+
+			if (InterlockedCompareExchange(SpinLock, value + 1, value) == value) {
+				if (start) DdkLockStatAcquire((PVOID)SpinLock, pCaller, LockShared, start, delay > 1);
+				return;
+			}
+
+			continue;
 		}
 
-		ReleaseSRWLockExclusive(&Lock);
+		DdkBackoff(&delay, &spins);
 	}
+}
 
-	if (i >= lockcount || !lockv[i / maxv])
-		ddkfail("Uninitialized read write lock");
 
-	return &lockv[i / maxv][i % maxv];
+static
+void DdkReleaseShared(PEX_SPIN_LOCK SpinLock)
+{
+	DDKASSERT((*SpinLock & EX_READERS) != 0);
+	if (DdkLocksHeld) DdkLockStatRelease((PVOID)SpinLock);
+	InterlockedDecrement(SpinLock);
 }
 
 
 static
-KIRQL AcquireSpinLockShared(PEX_SPIN_LOCK SpinLock, KIRQL NewIrql)
+void DdkAcquireExclusive(PEX_SPIN_LOCK SpinLock, PVOID pCaller)
+{
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+	ULONG delay = 1, spins = 0;
+
+	for (;;) {
+		LONG value = *SpinLock;
+
+		if (!(value & (EX_WRITER | EX_READERS))) {
+			if (InterlockedCompareExchange(SpinLock, EX_WRITER, value) == value) {
+				if (start) DdkLockStatAcquire((PVOID)SpinLock, pCaller, LockExclusive, start, delay > 1);
+				return;
+			}
+
+			continue;
+		}
+
+		if (!(value & EX_WRITER_WAIT))
+			InterlockedOr(SpinLock, EX_WRITER_WAIT);
+
+		DdkBackoff(&delay, &spins);
+	}
+}
+
+
+static
+void DdkReleaseExclusive(PEX_SPIN_LOCK SpinLock)
+{
+	DDKASSERT((*SpinLock & EX_WRITER) != 0);
+	if (DdkLocksHeld) DdkLockStatRelease((PVOID)SpinLock);
+	InterlockedAnd(SpinLock, ~EX_WRITER);
+}
+
+
+static
+KIRQL AcquireSpinLockShared(PEX_SPIN_LOCK SpinLock, KIRQL NewIrql, PVOID pCaller)
 {
 	KIRQL rc;
 	KeRaiseIrql(NewIrql, &rc);
-	AcquireSRWLockShared(GetSRWLock(SpinLock));
+	DdkAcquireShared(SpinLock, pCaller);
 	return rc;
 }
 
@@ -191,7 +443,7 @@ DDKAPI
 KIRQL ExAcquireSpinLockShared(PEX_SPIN_LOCK SpinLock)
 {
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-	return AcquireSpinLockShared(SpinLock, DISPATCH_LEVEL);
+	return AcquireSpinLockShared(SpinLock, DISPATCH_LEVEL, _ReturnAddress());
 }
 
 
@@ -199,7 +451,7 @@ DDKAPI
 VOID ExReleaseSpinLockShared(PEX_SPIN_LOCK SpinLock, KIRQL NewIrql)
 {
 	DDKASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
-	ReleaseSRWLockShared(GetSRWLock(SpinLock));
+	DdkReleaseShared(SpinLock);
 	KeLowerIrql(NewIrql);
 }
 
@@ -208,7 +460,7 @@ DDKAPI
 VOID ExAcquireSpinLockSharedAtDpcLevel(PEX_SPIN_LOCK SpinLock)
 {
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	AcquireSpinLockShared(SpinLock, KeGetCurrentIrql());
+	AcquireSpinLockShared(SpinLock, KeGetCurrentIrql(), _ReturnAddress());
 }
 
 
@@ -216,24 +468,34 @@ DDKAPI
 VOID ExReleaseSpinLockSharedFromDpcLevel(PEX_SPIN_LOCK SpinLock)
 {
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	ReleaseSRWLockShared(GetSRWLock(SpinLock));
+	DdkReleaseShared(SpinLock);
 }
 
 
 DDKAPI
 LOGICAL ExTryConvertSharedSpinLockExclusive(PEX_SPIN_LOCK SpinLock)
 {
-	// Not supported by SRWLOCKs
-	return FALSE;
+	// Only succeeds if the caller is the sole shared owner
+
+	for (;;) {
+		LONG value = *SpinLock;
+
+		if ((value & (EX_WRITER | EX_READERS)) != 1)
+			return FALSE;
+
+		if (InterlockedCompareExchange(SpinLock,
+				EX_WRITER | (value & EX_WRITER_WAIT), value) == value)
+			return TRUE;
+	}
 }
 
 
 static
-KIRQL AcquireSpinLockExclusive(PEX_SPIN_LOCK SpinLock, KIRQL NewIrql)
+KIRQL AcquireSpinLockExclusive(PEX_SPIN_LOCK SpinLock, KIRQL NewIrql, PVOID pCaller)
 {
 	KIRQL rc;
 	KeRaiseIrql(NewIrql, &rc);
-	AcquireSRWLockExclusive(GetSRWLock(SpinLock));
+	DdkAcquireExclusive(SpinLock, pCaller);
 	return rc;
 }
 
@@ -242,7 +504,7 @@ DDKAPI
 KIRQL ExAcquireSpinLockExclusive(PEX_SPIN_LOCK SpinLock)
 {
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-	return AcquireSpinLockExclusive(SpinLock, DISPATCH_LEVEL);
+	return AcquireSpinLockExclusive(SpinLock, DISPATCH_LEVEL, _ReturnAddress());
 }
 
 
@@ -250,7 +512,7 @@ DDKAPI
 VOID ExReleaseSpinLockExclusive(PEX_SPIN_LOCK SpinLock, KIRQL NewIrql)
 {
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	ReleaseSRWLockExclusive(GetSRWLock(SpinLock));
+	DdkReleaseExclusive(SpinLock);
 	KeLowerIrql(NewIrql);
 }
 
@@ -259,7 +521,7 @@ DDKAPI
 VOID ExAcquireSpinLockExclusiveAtDpcLevel(PEX_SPIN_LOCK SpinLock)
 {
 	DDKASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
-	AcquireSpinLockExclusive(SpinLock, KeGetCurrentIrql());
+	AcquireSpinLockExclusive(SpinLock, KeGetCurrentIrql(), _ReturnAddress());
 }
 
 DDKAPI
@@ -19,7 +19,7 @@ typedef struct PROCESS : public OBJECT {
 	KPRIORITY			BasePriority;
 } *PPROCESS;
 
-typedef struct _THREAD : public OBJECT {
+typedef struct _THREAD : public DISPATCH {
 	PKSTART_ROUTINE		Start;
 	PVOID				Context;
 	PPROCESS			process;
@@ -88,6 +88,7 @@ void DdkThreadInit()
 
 	if (!DdkCurrentThread) {
 		DdkCurrentThread = (THREAD *)DdkAllocObject(sizeof(THREAD), ThreadType);
+		DdkCurrentThread->notify = true;
 		DdkCurrentThread->process = &SystemProcess;
 		DdkCurrentThread->Priority = DefaultThreadPriority;
 		DdkCurrentThread->BasePriority = DefaultBaseThreadPriority;
@@ -126,6 +127,9 @@ void DdkInsertThread()
 
 void DdkThreadDeinit()
 {
+	DdkQueueThreadExit();
+	DdkWaitThreadExit();
+
 	if (DdkCurrentThread) {
 		DdkDetachIntercept(NULL, DdkGetCurrentThread());
 		DdkThreadLock();
@@ -137,6 +141,10 @@ void DdkThreadDeinit()
 				break;
 			}
 
+		// The thread object is signalled once the thread leaves the DDK
+
+		DdkSignalObject(DdkCurrentThread);
+
 		DdkDereferenceObject(DdkCurrentThread);
 		DdkCurrentThread = NULL;
 		DdkThreadUnlock();
@@ -196,6 +204,7 @@ NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess,
 
 	if (!pThread) return STATUS_INSUFFICIENT_RESOURCES;
 
+	pThread->notify = true;
 	pThread->Start = StartRoutine;
 	pThread->Context = StartContext;
 	pThread->process = pProcess;
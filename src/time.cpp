@@ -12,6 +12,7 @@
  */
 
 #include "stdafx.h"
+#include <intrin.h>
 
 
 ULONG KeMaximumIncrement;
@@ -19,6 +20,187 @@ ULONG KeMaximumIncrement;
 typedef VOID (*PGETPRECISE)(LPFILETIME);
 static PGETPRECISE pGetSystemTimePreciseAsFileTime;
 
+typedef LONG (NTAPI *PSETRESOLUTION)(ULONG, BOOLEAN, PULONG);
+static PSETRESOLUTION pNtSetTimerResolution;
+
+typedef VOID (WINAPI *PUNBIASEDPRECISE)(PULONGLONG);
+static PUNBIASEDPRECISE pQueryUnbiasedInterruptTimePrecise;
+
+
+/*
+ *	The DDK clock is interrupt time in 100ns units. In virtual time it
+ *	stands still until a test advances it, or in automatic mode until
+ *	deferred work has drained and threads are only waiting for time to
+ *	pass, when it jumps to the next timer. The clock never goes back, so
+ *	leaving virtual time keeps any advance as an offset to the real clock,
+ *	system time and tick count. Drivers loaded in virtual time read a
+ *	private shared data page, which the clock thread then keeps following
+ *	the real clock with those offsets until the last of them is unloaded.
+ *	The thread then stops, and later drivers read the system page.
+ */
+
+#define VIRTUAL_QUIET	4			// Idle polls before advancing
+
+volatile LONG DdkVirtualTime;
+
+static SRWLOCK ClockLock = SRWLOCK_INIT;
+static LONG64 ClockOffset;
+static LONG64 CounterOffset;			// ClockOffset in counter ticks
+static LONG64 SystemOffset;
+static LONG64 TickOffset;
+static LONG64 ClockFrequency;
+static volatile LONG64 VirtualNow;
+static LONG64 VirtualStart;
+static LONG64 VirtualSystemBias;		// System time less interrupt time
+static ULONG64 VirtualTickStart;
+static volatile LONG VirtualWaiters;
+static volatile LONG VirtualEvents;
+static PVOID VirtualShared;
+static LONG SharedImages;			// Loaded images reading VirtualShared
+static HANDLE ClockThread;
+
+
+/*
+ *	With an invariant TSC the performance counter is the TSC scaled to the
+ *	performance counter frequency, which avoids a call into the system on
+ *	every read. The scale is calibrated against the performance counter
+ *	at startup, sampling the TSC as the counter ticks over, which is good
+ *	to a few parts per million. That would still leave the DDK clock some
+ *	milliseconds an hour apart from the system interrupt time, so once a
+ *	second the scale is adjusted to meet the performance counter again a
+ *	second later. The clock is slewed rather than stepped, so it never goes
+ *	back. Readers that overlap an adjustment read the parameters again.
+ */
+
+#define TSC_CALIBRATE	100			// Calibrate for 1/100 second
+
+static bool TscCounter;
+static volatile LONG TscSequence;	// Odd while the parameters change
+static volatile ULONG64 TscStart;
+static volatile LONG64 TscCounterStart;
+static volatile ULONG64 TscScale;	// Counter ticks per TSC tick, 32.32 fixed point
+static ULONG64 TscCalibrated;		// Scale measured at startup
+static ULONG64 TscPeriod;			// TSC ticks per second
+
+
+#if defined(_AMD64_)
+static LONG64 DdkTscEdge(LONG64 after, ULONG64 *pTsc)
+{
+	LARGE_INTEGER q;
+
+	do {
+		QueryPerformanceCounter(&q);
+		*pTsc = __rdtsc();
+	} while (q.QuadPart <= after);
+
+	return q.QuadPart;
+}
+
+
+static ULONG64 DdkTscRatio(ULONG64 a, ULONG64 b)
+{
+	// (a << 32) / b, which overflows 64 bits once a reaches 2^32
+
+	ULONG64 hi, rem, lo = _umul128(a, 1ULL << 32, &hi);
+
+	if (hi >= b) return MAXULONG64;
+	return _udiv128(hi, lo, b, &rem);
+}
+
+
+static LONG64 DdkTscToCounter(ULONG64 tsc, ULONG64 start, LONG64 counter, ULONG64 scale)
+{
+	// A processor may read slightly behind the one that set the start
+
+	LONG64 delta = (LONG64)(tsc - start);
+	ULONG64 hi, lo = _umul128((delta > 0) ? (ULONG64)delta : 0, scale, &hi);
+
+	return counter + (LONG64)__shiftright128(lo, hi, 32);
+}
+
+
+/*
+ *	Called with TscSequence odd. Aim to meet the performance counter a
+ *	second from now, within a factor of two of the calibrated rate.
+ */
+
+static void DdkTscAdjust(ULONG64 tsc, LONG64 counter)
+{
+	LARGE_INTEGER q;
+
+	QueryPerformanceCounter(&q);
+
+	LONG64 gap = min(max(q.QuadPart + ClockFrequency - counter, 0), 2 * ClockFrequency);
+	ULONG64 scale = DdkTscRatio((ULONG64)gap, TscPeriod);
+
+	TscStart = tsc;
+	TscCounterStart = counter;
+	TscScale = min(max(scale, TscCalibrated / 2), TscCalibrated * 2);
+}
+#endif
+
+
+static void DdkTscInit()
+{
+#if defined(_AMD64_)
+	LARGE_INTEGER q;
+	LONG64 q0, q1;
+	ULONG64 t0, t1;
+	int r[4];
+
+	__cpuid(r, 0x80000000);
+	if ((ULONG)r[0] < 0x80000007) return;
+
+	__cpuid(r, 0x80000007);
+	if (!(r[3] & (1 << 8))) return;
+
+	QueryPerformanceCounter(&q);
+	q0 = DdkTscEdge(q.QuadPart, &t0);
+	q1 = DdkTscEdge(q0 + ClockFrequency / TSC_CALIBRATE - 1, &t1);
+
+	if (t1 <= t0) return;
+
+	TscScale = TscCalibrated = DdkTscRatio((ULONG64)(q1 - q0), t1 - t0);
+	TscStart = t1;
+	TscCounterStart = q1;
+	TscCounter = (TscScale != 0);
+
+	if (TscCounter)
+		TscPeriod = DdkTscRatio((ULONG64)ClockFrequency, TscScale);
+#endif
+}
+
+
+LONG64 DdkReadCounter()
+{
+#if defined(_AMD64_)
+	while (TscCounter) {
+		LONG seq = TscSequence;
+		ULONG64 tsc = __rdtsc(), start = TscStart;
+		LONG64 counter = DdkTscToCounter(tsc, start, TscCounterStart, TscScale);
+
+		if ((seq & 1) || seq != TscSequence) continue;
+
+		// The first reader a second after the last adjustment, or after
+		// the TSC has gone back, makes the next one
+
+		LONG64 delta = (LONG64)(tsc - start);
+
+		if ((delta > (LONG64)TscPeriod || delta < -(LONG64)TscPeriod)
+				&& InterlockedCompareExchange(&TscSequence, seq + 1, seq) == seq) {
+			DdkTscAdjust(tsc, counter);
+			InterlockedIncrement(&TscSequence);
+		}
+
+		return counter;
+	}
+#endif
+
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
 
 void DdkTimeInit()
 {
@@ -31,6 +213,301 @@ void DdkTimeInit()
 
 	if (!pGetSystemTimePreciseAsFileTime)
 		pGetSystemTimePreciseAsFileTime = &GetSystemTimeAsFileTime;
+
+	pNtSetTimerResolution = (PSETRESOLUTION)GetProcAddress(
+		GetModuleHandle("ntdll.dll"), "NtSetTimerResolution");
+
+	pQueryUnbiasedInterruptTimePrecise = (PUNBIASEDPRECISE)GetProcAddress(
+		GetModuleHandle("kernelbase.dll"), "QueryUnbiasedInterruptTimePrecise");
+
+	LARGE_INTEGER f;
+	QueryPerformanceFrequency(&f);
+	ClockFrequency = f.QuadPart;
+
+	DdkTscInit();
+}
+
+
+static LONG64 DdkFileTime(FILETIME ft)
+{
+	return (LONG64)(((ULONG64)ft.dwHighDateTime << 32) | ft.dwLowDateTime);
+}
+
+
+static LONG64 DdkCounterToClock(LONG64 c)
+{
+	return c / ClockFrequency * 10000000 + c % ClockFrequency * 10000000 / ClockFrequency;
+}
+
+
+static LONG64 DdkClockToCounter(LONG64 t)
+{
+	return t / 10000000 * ClockFrequency + t % 10000000 * ClockFrequency / 10000000;
+}
+
+
+static LONG64 DdkRealClock()
+{
+	return DdkCounterToClock(DdkReadCounter());
+}
+
+
+LONG64 DdkClockTime()
+{
+	if (DdkVirtualTime) return VirtualNow;
+	return DdkRealClock() + ClockOffset;
+}
+
+
+static LONG64 DdkPerformanceCounter()
+{
+	if (DdkVirtualTime) return DdkClockToCounter(VirtualNow);
+	return DdkReadCounter() + CounterOffset;
+}
+
+
+static LONG64 DdkRealSystemTime()
+{
+	FILETIME ft;
+
+	(*pGetSystemTimePreciseAsFileTime)(&ft);
+	return DdkFileTime(ft);
+}
+
+
+LONG64 DdkQuerySystemTime()
+{
+	if (DdkVirtualTime) return VirtualNow + VirtualSystemBias;
+	return DdkRealSystemTime() + SystemOffset;
+}
+
+
+static ULONG64 DdkVirtualTickCount()
+{
+	return VirtualTickStart + (VirtualNow - VirtualStart) / KeMaximumIncrement;
+}
+
+
+static void DdkUpdateSharedData()
+{
+	if (DdkVirtualTime)
+		DdkSetVirtualSharedData(VirtualShared, VirtualNow,
+			VirtualNow + VirtualSystemBias, DdkVirtualTickCount());
+
+	else DdkSetVirtualSharedData(VirtualShared, DdkRealClock() + ClockOffset,
+			DdkRealSystemTime() + SystemOffset, DdkGetSystemTickCount() + TickOffset);
+}
+
+
+/*
+ *	Move the clock forward, then wait for the timer wheels to expire
+ *	everything due by the new time. DPCs queued by the timers may still
+ *	be running when this returns.
+ */
+
+static void DdkSetVirtualTime(LONG64 t)
+{
+	AcquireSRWLockExclusive(&ClockLock);
+
+	if (DdkVirtualTime && t > VirtualNow) {
+		VirtualNow = t;
+		DdkUpdateSharedData();
+	}
+
+	t = DdkClockTime();
+	ReleaseSRWLockExclusive(&ClockLock);
+
+	DdkVirtualActivity();
+	DdkAdvanceTimers(t);
+}
+
+
+void DdkVirtualActivity()
+{
+	InterlockedIncrement(&VirtualEvents);
+}
+
+
+void DdkBeginVirtualWait()
+{
+	InterlockedIncrement(&VirtualWaiters);
+	InterlockedIncrement(&VirtualEvents);
+}
+
+
+void DdkEndVirtualWait()
+{
+	InterlockedDecrement(&VirtualWaiters);
+	InterlockedIncrement(&VirtualEvents);
+}
+
+
+/*
+ *	Advance automatically once threads are waiting, nothing but timers
+ *	is outstanding, and nothing has happened for a few polls. A thread
+ *	busy outside the DDK is not seen, so the polls give it a chance to
+ *	show some activity before its peers are timed out. Out of virtual
+ *	time, refresh the private shared data page every millisecond while
+ *	a driver still reads it, and stop once none does.
+ */
+
+static DWORD WINAPI DdkClockThread(PVOID arg)
+{
+	LONG seen = 0, quiet = 0;
+
+	DdkThreadInit();
+
+	for (;;) {
+		LONG mode = DdkVirtualTime;
+
+		if (mode == VirtualOff) {
+			WaitOnAddress((PVOID)&DdkVirtualTime, &mode, sizeof(mode), 1);
+
+			AcquireSRWLockExclusive(&ClockLock);
+			bool done = (!DdkVirtualTime && !SharedImages);
+
+			if (done) {
+				DdkSetSystemSharedData();
+				CloseHandle(ClockThread);
+				ClockThread = NULL;
+			}
+
+			else if (!DdkVirtualTime) DdkUpdateSharedData();
+
+			ReleaseSRWLockExclusive(&ClockLock);
+			if (done) break;
+			continue;
+		}
+
+		if (mode != VirtualAutomatic) {
+			WaitOnAddress((PVOID)&DdkVirtualTime, &mode, sizeof(mode), INFINITE);
+			continue;
+		}
+
+		Sleep(1);
+
+		LONG events = VirtualEvents;
+
+		if (events != seen || !VirtualWaiters || DdkDeferredWork() != DdkArmedTimers()) {
+			seen = events;
+			quiet = 0;
+			continue;
+		}
+
+		if (++quiet < VIRTUAL_QUIET) continue;
+
+		LONG64 next = DdkNextTimerDue();
+		if (next != MAXLONG64) DdkSetVirtualTime(next);
+
+		quiet = 0;
+	}
+
+	return 0;
+}
+
+
+/*
+ *	An image loaded while drivers are directed to the private page reads
+ *	it until the image is unloaded, so the page is held until then.
+ */
+
+bool DdkHoldSharedData()
+{
+	AcquireSRWLockExclusive(&ClockLock);
+	bool held = (VirtualShared && DdkSharedUserData == (ULONG64)VirtualShared);
+
+	if (held) SharedImages++;
+	ReleaseSRWLockExclusive(&ClockLock);
+	return held;
+}
+
+
+void DdkReleaseSharedData()
+{
+	AcquireSRWLockExclusive(&ClockLock);
+	SharedImages--;
+	ReleaseSRWLockExclusive(&ClockLock);
+}
+
+
+/*
+ *	VOID DdkEnableVirtualTime(BOOLEAN Enable, BOOLEAN Automatic)
+ *
+ *	Switch the clock between real and virtual time. Drivers loaded while
+ *	virtual time is off read the system shared data page directly, so
+ *	enable it before loading them.
+ */
+
+DDKAPI
+VOID DdkEnableVirtualTime(BOOLEAN Enable, BOOLEAN Automatic)
+{
+	LONG mode = (!Enable) ? VirtualOff : (Automatic) ? VirtualAutomatic : VirtualManual;
+
+	AcquireSRWLockExclusive(&ClockLock);
+
+	// Patched addresses are combined with the page, so it must be aligned
+
+	if (Enable && !VirtualShared) {
+		VirtualShared = VirtualAlloc(NULL, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+		if (!VirtualShared)
+			ddkfail("Unable to allocate virtual shared data");
+	}
+
+	// Start on a timer tick, so that timers due a whole number of
+	// milliseconds ahead expire as soon as the clock reaches them
+
+	if (Enable && !DdkVirtualTime) {
+		VirtualNow = VirtualStart = (DdkClockTime() / 10000 + 1) * 10000;
+		VirtualSystemBias = DdkQuerySystemTime() - VirtualNow;
+		VirtualTickStart = DdkGetTickCount();
+		DdkUpdateSharedData();
+	}
+
+	// Carry any advance over to the real clock, so that nothing goes back
+
+	if (!Enable && DdkVirtualTime) {
+		ClockOffset = max(ClockOffset, VirtualNow - DdkRealClock());
+		CounterOffset = DdkClockToCounter(ClockOffset);
+		SystemOffset = max(SystemOffset, VirtualNow + VirtualSystemBias - DdkRealSystemTime());
+		TickOffset = max(TickOffset, (LONG64)(DdkVirtualTickCount() - DdkGetSystemTickCount()));
+	}
+
+	InterlockedExchange(&DdkVirtualTime, mode);
+
+	if (!Enable && VirtualShared) {
+		if (SharedImages) DdkUpdateSharedData();
+		else DdkSetSystemSharedData();
+	}
+
+	if (VirtualShared && !ClockThread && (Enable || SharedImages)) {
+		ClockThread = CreateThread(NULL, 0, DdkClockThread, NULL, 0, NULL);
+
+		if (!ClockThread)
+			ddkfail("Unable to create clock thread");
+	}
+
+	LONG64 now = DdkClockTime();
+	ReleaseSRWLockExclusive(&ClockLock);
+
+	WakeByAddressAll((PVOID)&DdkVirtualTime);
+	DdkAdvanceTimers(now);
+}
+
+
+/*
+ *	VOID DdkAdvanceVirtualTime(LONG64 Interval)
+ *
+ *	Advance virtual time by an interval in 100ns units, expiring any
+ *	timers and timed waits that fall due.
+ */
+
+DDKAPI
+VOID DdkAdvanceVirtualTime(LONG64 Interval)
+{
+	DDKASSERT(DdkVirtualTime && Interval >= 0);
+
+	DdkSetVirtualTime(VirtualNow + Interval);
 }
 
 
@@ -41,6 +518,72 @@ VOID KeQueryTickCount(PLARGE_INTEGER CurrentCount)
 }
 
 
+/*
+ *	LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+ *
+ *	The counter follows the DDK clock, so it stands still in virtual time.
+ */
+
+DDKAPI
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+	LARGE_INTEGER v;
+
+	if (PerformanceFrequency)
+		PerformanceFrequency->QuadPart = ClockFrequency;
+
+	v.QuadPart = DdkPerformanceCounter();
+	return v;
+}
+
+
+DDKAPI
+ULONG64 KeQueryInterruptTimePrecise(PULONG64 QpcTimeStamp)
+{
+	LONG64 c = DdkPerformanceCounter();
+
+	*QpcTimeStamp = (ULONG64)c;
+
+	if (DdkVirtualTime) return VirtualNow;
+	return DdkCounterToClock(c - CounterOffset) + ClockOffset;
+}
+
+
+/*
+ *	Unbiased interrupt time leaves out time the host spent asleep. It
+ *	carries the same offset as the DDK clock once virtual time is left.
+ */
+
+DDKAPI
+ULONGLONG KeQueryUnbiasedInterruptTime()
+{
+	ULONGLONG t;
+
+	if (DdkVirtualTime) return VirtualNow;
+
+	QueryUnbiasedInterruptTime(&t);
+	return t + ClockOffset;
+}
+
+
+DDKAPI
+ULONG64 KeQueryUnbiasedInterruptTimePrecise(PULONG64 QpcTimeStamp)
+{
+	ULONGLONG t;
+
+	*QpcTimeStamp = (ULONG64)DdkPerformanceCounter();
+
+	if (DdkVirtualTime) return VirtualNow;
+
+	if (pQueryUnbiasedInterruptTimePrecise)
+		(*pQueryUnbiasedInterruptTimePrecise)(&t);
+
+	else QueryUnbiasedInterruptTime(&t);
+
+	return t + ClockOffset;
+}
+
+
 DDKAPI
 ULONG KeQueryTimeIncrement()
 {
@@ -48,6 +591,26 @@ ULONG KeQueryTimeIncrement()
 }
 
 
+/*
+ *	ULONG ExSetTimerResolution(ULONG DesiredTime, BOOLEAN SetResolution)
+ *
+ *	Request a clock interval in 100ns units, or release an earlier
+ *	request, and return the interval now in effect. A finer interval
+ *	also sharpens the timer wheels and ordinary waitable timers.
+ */
+
+DDKAPI
+ULONG ExSetTimerResolution(ULONG DesiredTime, BOOLEAN SetResolution)
+{
+	ULONG current = KeMaximumIncrement;
+
+	if (pNtSetTimerResolution)
+		(*pNtSetTimerResolution)(DesiredTime, SetResolution, &current);
+
+	return current;
+}
+
+
 DWORD DdkGetWaitTime(LARGE_INTEGER *pTimeout)
 {
 	if (!pTimeout) return INFINITE;
@@ -56,12 +619,8 @@ DWORD DdkGetWaitTime(LARGE_INTEGER *pTimeout)
 		return (DWORD)((-pTimeout->QuadPart) / 10000);
 
 	LARGE_INTEGER v;
-	FILETIME now;
 
-	GetSystemTimeAsFileTime(&now);
-	
-	v.HighPart = now.dwHighDateTime;
-	v.LowPart = now.dwLowDateTime;
+	v.QuadPart = DdkQuerySystemTime();
 
 	if (v.QuadPart > pTimeout->QuadPart)
 		return 0;
@@ -164,20 +723,18 @@ VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime)
 {
 	FILETIME ft;
 
-	GetSystemTimeAsFileTime(&ft);
+	if (DdkVirtualTime) {
+		CurrentTime->QuadPart = DdkQuerySystemTime();
+		return;
+	}
 
-	CurrentTime->LowPart = ft.dwLowDateTime;
-	CurrentTime->HighPart = ft.dwHighDateTime;
+	GetSystemTimeAsFileTime(&ft);
+	CurrentTime->QuadPart = DdkFileTime(ft) + SystemOffset;
 }
 
 
 DDKAPI
 VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime)
 {
-	FILETIME ft;
-
-	(*pGetSystemTimePreciseAsFileTime)(&ft);
-
-	CurrentTime->LowPart = ft.dwLowDateTime;
-	CurrentTime->HighPart = ft.dwHighDateTime;
+	CurrentTime->QuadPart = DdkQuerySystemTime();
 }
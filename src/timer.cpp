@@ -15,30 +15,396 @@
 
 
 DDKAPI BOOLEAN KeInsertQueueDpc(PRKDPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2);
-DDKAPI BOOLEAN KeRemoveQueueDpc(PRKDPC Dpc);
 
 
-typedef struct _TIMER : public OBJECT {
-	PTP_TIMER		Clock;
+typedef struct _TIMER : public DISPATCH {
+	LIST_ENTRY		entry;			// Wheel slot while armed
 	PKDPC			Dpc;
-	FILETIME		DueTime;
+	LONG64			due;			// DDK clock
 	LONG			Period;
-	volatile LONG	state;
-	bool			notify;
+	volatile SHORT	wheel;			// Wheel + 1 while armed
+	bool			wait;			// Timeout of a virtual time wait
 } TIMER, *PTIMER;
 
-enum { TimerIdle, TimerActive, TimerDone };
 
+/*
+ *	Each virtual processor has a hashed hierarchical timer wheel, serviced
+ *	by its own thread. Level 0 has a slot for each of the next 64 ticks of
+ *	a millisecond, and each higher level covers 64 slots of the level below.
+ *	When level 0 wraps, the next slot of level 1 is cascaded down, and so on
+ *	up the levels. Timers beyond the top level are parked in its last slot
+ *	and cascaded again.
+ *
+ *	Arming and cancelling take only the wheel lock, and never wait for the
+ *	timer thread. As with DPCs, the wheel field names the wheel holding the
+ *	timer and only changes under that wheel's lock.
+ *
+ *	The wheels follow the DDK clock, so in virtual time the threads sleep
+ *	until the clock is advanced.
+ */
+
+#define WHEEL_BITS		6
+#define WHEEL_SLOTS		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	5
+#define WHEEL_RANGE		(1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+#define TIMER_TICK		10000
+
+typedef struct DECLSPEC_CACHEALIGN _TIMERWHEEL {
+	SRWLOCK			Lock;
+	CONDITION_VARIABLE Ready;
+	CONDITION_VARIABLE Done;
+	ULONG64			tick;			// Next tick to expire
+	ULONG64			wake;			// Tick the thread will next wake
+	ULONG			count;
+	ULONG			Number;
+	HANDLE			h;
+	LIST_ENTRY		slot[WHEEL_LEVELS][WHEEL_SLOTS];
+} TIMERWHEEL;
+
+
+static TIMERWHEEL wheelv[DDK_MAXIMUM_PROCESSORS];
+static ULONG wheelc;
+static volatile LONG ArmedTimers;
+static INIT_ONCE WheelInit = INIT_ONCE_STATIC_INIT;
+
+
+static LONG64 DdkTimerDue(LARGE_INTEGER DueTime)
+{
+	LONG64 interval = -DueTime.QuadPart;
+
+	if (DueTime.QuadPart > 0)
+		interval = DueTime.QuadPart - DdkQuerySystemTime();
+
+	return DdkClockTime() + ((interval > 0) ? interval : 0);
+}
+
+
+static ULONG64 DdkTimerTick(LONG64 t)
+{
+	return (ULONG64)t / TIMER_TICK;
+}
+
+
+/*
+ *	The tick on which a timer expires. The wheel runs a tick once the
+ *	clock reaches its start, so the due time is rounded up to the next
+ *	tick, and a timer never expires early.
+ */
+
+static ULONG64 DdkTimerExpiry(LONG64 due)
+{
+	return ((ULONG64)due + TIMER_TICK - 1) / TIMER_TICK;
+}
+
+
+/*
+ *	Pending one-shot timers are deferred work. They are also counted
+ *	on their own, so that virtual time can tell when only timers remain.
+ */
+
+static void DdkBeginTimer()
+{
+	InterlockedIncrement(&ArmedTimers);
+	DdkBeginDeferred();
+}
+
+
+static void DdkEndTimer()
+{
+	DdkEndDeferred();
+	InterlockedDecrement(&ArmedTimers);
+}
+
+
+LONG DdkArmedTimers()
+{
+	return ArmedTimers;
+}
+
+
+static void DdkLinkTimer(TIMERWHEEL *w, TIMER *pTimer)
+{
+	ULONG64 expires = DdkTimerExpiry(pTimer->due);
+	ULONG64 idx = expires - w->tick;
+	LIST_ENTRY *head;
+	int level = 0;
+
+	if ((LONG64)idx < 0) {
+		expires = w->tick;
+		idx = 0;
+	}
+
+	else if (idx >= WHEEL_RANGE) {
+		expires = w->tick + WHEEL_RANGE - 1;
+		idx = WHEEL_RANGE - 1;
+	}
+
+	while (idx >= WHEEL_SLOTS) {
+		idx >>= WHEEL_BITS;
+		level++;
+	}
+
+	head = &w->slot[level][(expires >> (level * WHEEL_BITS)) & WHEEL_MASK];
+
+	pTimer->entry.Flink = head;
+	pTimer->entry.Blink = head->Blink;
+	head->Blink->Flink = &pTimer->entry;
+	head->Blink = &pTimer->entry;
+	w->count++;
+}
+
+
+static void DdkUnlinkTimer(TIMERWHEEL *w, TIMER *pTimer)
+{
+	pTimer->entry.Blink->Flink = pTimer->entry.Flink;
+	pTimer->entry.Flink->Blink = pTimer->entry.Blink;
+	pTimer->entry.Flink = pTimer->entry.Blink = NULL;
+	w->count--;
+}
+
+
+static TIMER *DdkTakeTimer(LIST_ENTRY *head)
+{
+	if (head->Flink == head) return NULL;
+	return CONTAINING_RECORD(head->Flink, TIMER, entry);
+}
+
+
+static void DdkExpireTimer(TIMERWHEEL *w, TIMER *pTimer, LONG64 now, LONG64 t)
+{
+	bool wait = pTimer->wait;
+	PKDPC Dpc = pTimer->Dpc;
+	ULONG Period = pTimer->Period;
+
+	DdkUnlinkTimer(w, pTimer);
+
+	if (!wait)
+		DdkRecordLatency((Dpc) ? DdkGetDpcRoutine(Dpc) : (PVOID)pTimer,
+			DDK_LATENCY_TIMER, t - DdkLatencyTicks(max(now - pTimer->due, 0)), t, 0);
+
+	// A waiter may free a one-shot timer as soon as it is signalled, so
+	// finish with it first and only use the copies afterwards
+
+	if (Period) {
+		pTimer->due += (LONG64)Period * TIMER_TICK;
+		if (pTimer->due < now) pTimer->due = now;
+		DdkLinkTimer(w, pTimer);
+	}
+
+	else InterlockedExchange16(&pTimer->wheel, 0);
+
+	DdkSignalObject(pTimer);
+
+	if (Dpc) KeInsertQueueDpc(Dpc, 0, 0);
+	if (!Period && !wait) DdkEndTimer();
+}
+
+
+static void DdkCascadeTimers(TIMERWHEEL *w, int level)
+{
+	LIST_ENTRY *head = &w->slot[level][(w->tick >> (level * WHEEL_BITS)) & WHEEL_MASK];
+	TIMER *pTimer;
+
+	while ((pTimer = DdkTakeTimer(head)) != NULL) {
+		DdkUnlinkTimer(w, pTimer);
+		DdkLinkTimer(w, pTimer);
+	}
+}
+
+
+static void DdkRunTimers(TIMERWHEEL *w, LONG64 clock)
+{
+	ULONG64 now = DdkTimerTick(clock);
+	LONG64 t = DdkLatencyTime();
+
+	if (!w->count) {
+		w->tick = now + 1;
+		return;
+	}
+
+	while (w->tick <= now) {
+		ULONG64 index = w->tick & WHEEL_MASK;
+		TIMER *pTimer;
+
+		for (int level = 1; !index && level < WHEEL_LEVELS; level++) {
+			index = (w->tick >> (level * WHEEL_BITS)) & WHEEL_MASK;
+			DdkCascadeTimers(w, level);
+		}
+
+		LIST_ENTRY *head = &w->slot[0][w->tick & WHEEL_MASK];
+		w->tick++;
+
+		while ((pTimer = DdkTakeTimer(head)) != NULL)
+			DdkExpireTimer(w, pTimer, clock, t);
+	}
+}
+
+
+static ULONG64 DdkNextTimer(TIMERWHEEL *w)
+{
+	ULONG64 t = w->tick;
+
+	if (!w->count) return MAXULONG64;
+
+	// The next occupied slot, or the next cascade
 
-static VOID DdkTimerCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_TIMER Timer)
+	do {
+		if (w->slot[0][t & WHEEL_MASK].Flink != &w->slot[0][t & WHEEL_MASK])
+			return t;
+	} while ((++t & WHEEL_MASK) != 0);
+
+	return t;
+}
+
+
+static DWORD WINAPI DdkTimerThread(PVOID arg)
+{
+	TIMERWHEEL *w = (TIMERWHEEL *)arg;
+
+	DdkThreadInit();
+	DdkSetCurrentProcessor(w->Number);
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+	AcquireSRWLockExclusive(&w->Lock);
+
+	for (;;) {
+		LONG64 clock = DdkClockTime();
+		ULONG64 now = DdkTimerTick(clock);
+
+		DdkRunTimers(w, clock);
+		w->wake = DdkNextTimer(w);
+		WakeAllConditionVariable(&w->Done);
+
+		DWORD wait = (w->wake == MAXULONG64 || DdkVirtualTime) ? INFINITE
+			: (w->wake > now) ? (DWORD)min(w->wake - now, 0x7fffffff) : 0;
+
+		if (wait) SleepConditionVariableSRW(&w->Ready, &w->Lock, wait, 0);
+	}
+
+	return 0;
+}
+
+
+static BOOL CALLBACK DdkTimerInit(PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
+{
+	ULONG count = DdkGetProcessorCount();
+
+	for (ULONG i = 0; i < count; i++) {
+		TIMERWHEEL *w = &wheelv[i];
+
+		InitializeSRWLock(&w->Lock);
+		InitializeConditionVariable(&w->Ready);
+		InitializeConditionVariable(&w->Done);
+
+		for (int level = 0; level < WHEEL_LEVELS; level++)
+			for (int n = 0; n < WHEEL_SLOTS; n++)
+				w->slot[level][n].Flink = w->slot[level][n].Blink = &w->slot[level][n];
+
+		w->Number = i;
+		w->tick = DdkTimerTick(DdkClockTime());
+		w->wake = MAXULONG64;
+		w->h = CreateThread(NULL, 0, DdkTimerThread, w, 0, NULL);
+
+		if (!w->h)
+			ddkfail("Unable to create timer thread");
+
+		SetThreadIdealProcessor(w->h, i);
+	}
+
+	wheelc = count;
+	return TRUE;
+}
+
+
+/*
+ *	Wake each wheel and wait for it to expire everything due by the
+ *	given time. Used when the DDK clock jumps.
+ */
+
+void DdkAdvanceTimers(LONG64 Now)
+{
+	ULONG64 tick = DdkTimerTick(Now);
+
+	for (ULONG i = 0; i < wheelc; i++) {
+		TIMERWHEEL *w = &wheelv[i];
+
+		AcquireSRWLockExclusive(&w->Lock);
+
+		while (w->count && w->tick <= tick) {
+			WakeConditionVariable(&w->Ready);
+			SleepConditionVariableSRW(&w->Done, &w->Lock, INFINITE, 0);
+		}
+
+		WakeConditionVariable(&w->Ready);
+		ReleaseSRWLockExclusive(&w->Lock);
+	}
+}
+
+
+/*
+ *	The earliest time at which a timer will expire, for advancing
+ *	virtual time. This is the start of its tick, and timers behind the
+ *	wheel expire at its next tick.
+ */
+
+LONG64 DdkNextTimerDue()
+{
+	LONG64 next = MAXLONG64;
+
+	for (ULONG i = 0; i < wheelc; i++) {
+		TIMERWHEEL *w = &wheelv[i];
+
+		AcquireSRWLockExclusive(&w->Lock);
+
+		for (int level = 0; w->count && level < WHEEL_LEVELS; level++) {
+			for (int n = 0; n < WHEEL_SLOTS; n++) {
+				LIST_ENTRY *head = &w->slot[level][n];
+
+				for (LIST_ENTRY *e = head->Flink; e != head; e = e->Flink) {
+					TIMER *pTimer = CONTAINING_RECORD(e, TIMER, entry);
+					next = min(next, (LONG64)(max(DdkTimerExpiry(pTimer->due), w->tick) * TIMER_TICK));
+				}
+			}
+		}
+
+		ReleaseSRWLockExclusive(&w->Lock);
+	}
+
+	return next;
+}
+
+
+/*
+ *	Remove the timer from whichever wheel holds it. It may move wheels
+ *	while the lock is being taken, so check again once it is held.
+ */
+
+static bool DdkDisarmTimer(TIMER *pTimer)
 {
-	TIMER *pTimer = (PTIMER)Context;
+	LONG wheel;
+
+	while ((wheel = pTimer->wheel) != 0) {
+		TIMERWHEEL *w = &wheelv[wheel - 1];
+		bool armed = false;
+
+		AcquireSRWLockExclusive(&w->Lock);
+
+		if (pTimer->wheel == wheel) {
+			DdkUnlinkTimer(w, pTimer);
+			InterlockedExchange16(&pTimer->wheel, 0);
+			armed = true;
+		}
+
+		ReleaseSRWLockExclusive(&w->Lock);
 
-	if (pTimer->Period || InterlockedCompareExchange(
-			&pTimer->state, TimerDone, TimerActive) == TimerActive) {
-		SetEvent(pTimer->h);
-		if (pTimer->Dpc) KeInsertQueueDpc(pTimer->Dpc, 0, 0);
+		if (armed) {
+			if (!pTimer->Period && !pTimer->wait) DdkEndTimer();
+			return true;
+		}
 	}
+
+	return false;
 }
 
 
@@ -50,15 +416,10 @@ VOID KeInitializeTimerEx(PKTIMER Timer, TIMER_TYPE Type)
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
 
 	DdkInitializeObject(pTimer, sizeof(TIMER), _SizeofTimer_);
+	InitOnceExecuteOnce(&WheelInit, DdkTimerInit, NULL, NULL);
 
-	pTimer->h = CreateEvent(NULL, (Type == NotificationTimer), FALSE, NULL);
-	pTimer->Clock = CreateThreadpoolTimer(DdkTimerCallback, (PVOID)Timer, NULL);
 	pTimer->type = TimerType;
-	pTimer->state = TimerIdle;
 	pTimer->notify = (Type == NotificationTimer);
-
-	if (!pTimer->h || !pTimer->Clock)
-		ddkfail("Unable to initialize Timer");
 }
 
 
@@ -72,12 +433,7 @@ VOID KeInitializeTimer(PKTIMER Timer)
 DDKAPI
 BOOLEAN KeCancelTimer(PKTIMER Timer)
 {
-	TIMER *pTimer = (TIMER *)Timer;
-	LONG rc = InterlockedExchange(&pTimer->state, TimerIdle);
-
-	SetThreadpoolTimer(pTimer->Clock, NULL, 0, 0);
-	WaitForThreadpoolTimerCallbacks(pTimer->Clock, TRUE);
-	return (rc == TimerActive);
+	return DdkDisarmTimer((TIMER *)Timer);
 }
 
 
@@ -88,19 +444,41 @@ BOOLEAN KeSetTimerEx(PKTIMER Timer, LARGE_INTEGER DueTime, LONG Period, PKDPC Dp
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
 
 	TIMER *pTimer = (TIMER *)Timer;
-	LONG rc = InterlockedExchange(&pTimer->state, TimerIdle);
+	ULONG Number = DdkGetCurrentProcessor();
+	TIMERWHEEL *w = &wheelv[Number];
+	BOOLEAN rc = FALSE;
+
+	for (;;) {
+		if (DdkDisarmTimer(pTimer)) rc = TRUE;
 
-	SetThreadpoolTimer(pTimer->Clock, NULL, 0, 0);
-	WaitForThreadpoolTimerCallbacks(pTimer->Clock, TRUE);
+		AcquireSRWLockExclusive(&w->Lock);
+
+		// Armed again by another caller since it was removed
+
+		if (!InterlockedCompareExchange16(&pTimer->wheel, (SHORT)(Number + 1), 0))
+			break;
+
+		ReleaseSRWLockExclusive(&w->Lock);
+	}
 
 	pTimer->Dpc = Dpc;
 	pTimer->Period = Period;
-	pTimer->DueTime = DdkGetDueTime(DueTime);
-	pTimer->state = TimerActive;
+	pTimer->due = DdkTimerDue(DueTime);
+
+	// An empty wheel is not advanced, so bring it up to date first
+
+	if (!w->count) w->tick = DdkTimerTick(DdkClockTime());
 
-	ResetEvent(pTimer->h);
-	SetThreadpoolTimer(pTimer->Clock, &pTimer->DueTime, Period, 0);
-	return (rc == TimerActive);
+	if (!Period && !pTimer->wait) DdkBeginTimer();
+	pTimer->signal = 0;
+	DdkLinkTimer(w, pTimer);
+
+	bool wake = (DdkTimerExpiry(pTimer->due) < w->wake);
+
+	ReleaseSRWLockExclusive(&w->Lock);
+
+	if (wake) WakeConditionVariable(&w->Ready);
+	return rc;
 }
 
 
@@ -117,13 +495,31 @@ BOOLEAN KeReadStateTimer(PKTIMER Timer)
 	TIMER *pTimer = (TIMER *)Timer;
 
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+	return (pTimer->signal != 0);
+}
 
-	DWORD rc = WaitForSingleObject(pTimer->h, 0);
 
-	if (rc == WAIT_OBJECT_0) {
-		if (!pTimer->notify) SetEvent(pTimer->h);
-		return TRUE;
-	}
+/*
+ *	Timed waits in virtual time are ended by a timer on the wheel, so
+ *	that they time out as the virtual clock passes their due time.
+ */
+
+PKTIMER DdkArmWaitTimer(LARGE_INTEGER DueTime)
+{
+	PKTIMER Timer = (PKTIMER)malloc(_SizeofTimer_);
+
+	if (!Timer) ddkfail("Unable to allocate wait timer");
 
-	return FALSE;
+	KeInitializeTimerEx(Timer, NotificationTimer);
+	((TIMER *)Timer)->wait = true;
+
+	KeSetTimerEx(Timer, DueTime, 0, NULL);
+	return Timer;
+}
+
+
+void DdkFreeWaitTimer(PKTIMER Timer)
+{
+	DdkDisarmTimer((TIMER *)Timer);
+	free(Timer);
 }
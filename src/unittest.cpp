@@ -74,6 +74,12 @@ BOOLEAN DdkModuleEnd(char *pName)
 	cleanupname = NULL;
 	bool rc = DdkTestRemove(pName);
 	LeaveCriticalSection(&Lock);
+
+	if (DdkLockStats) {
+		DdkReportLockStats();
+		DdkResetLockStats();
+	}
+
 	return (rc != true);
 }
 
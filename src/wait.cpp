@@ -12,82 +12,482 @@
  */
 
 #include "stdafx.h"
+#include <intrin.h>
 
 
-extern void DdkUpdateMutex(OBJECT *pObj);
-extern void DdkUpdateSemaphore(OBJECT *pObj);
+extern bool DdkAcquireMutex(OBJECT *pObj);
+extern LONG DdkReleaseMutex(OBJECT *pObj);
+extern bool DdkIsMutexContended(OBJECT *pObj);
 
 
-static HANDLE nullevent;
+/*
+ *	A waiting thread parks on a word of its own with WaitOnAddress, or on
+ *	an event of its own for an alertable wait, which must also wake for an
+ *	APC. Each object it waits on is entered in a hashed table of parked
+ *	waits, and counts its waiters, so signalling an object nobody waits on
+ *	costs only the interlocked update of its state.
+ *
+ *	A notification object wakes every waiter on it. A synchronization
+ *	object wakes one waiter for each unit of signal, passing over those
+ *	already woken for it, and a waiter that leaves without taking it wakes
+ *	another in its place. A waiter only tries again the objects that were
+ *	signalled, which the waker pushes on a list in the wait, so a wait on
+ *	many objects is not scanned for each signal. A wait for all is woken
+ *	by each of its objects, and checks them all once any is signalled.
+ *
+ *	A waiter may free the object as soon as its wait is satisfied, so the
+ *	signaller takes the waiter count in the same interlocked operation that
+ *	sets the signal, and does not touch the object after it.
+ *
+ *	The entries are kept in the caller's wait block array, or in blocks
+ *	on the stack for a few objects, so a wait has no limit but the array.
+ *	A signal only scans its own hash bucket, which holds few entries
+ *	besides those for the object.
+ */
+
+#define PARK_BUCKETS	1024
+#define WAIT_BLOCKS		4			// At least THREAD_WAIT_OBJECTS
+
+#define PARK_TIMEOUT	(-1)
+#define PARK_ALERTED	(-2)
+
+typedef struct _PARKED PARKED;
+
+typedef struct _PARKWAIT {
+	volatile LONG	wake;
+	bool			all;			// Wait for all
+	HANDLE			alert;			// Event for an alertable wait
+	PARKED * volatile signalled;	// Entries signalled since the last pass
+} PARKWAIT;
+
+struct _PARKED {
+	LIST_ENTRY		entry;
+	DISPATCH		*pObj;
+	PARKWAIT		*wait;
+	PARKED			*next;			// On the signalled list
+	volatile LONG	hit;
+};
+
+typedef struct DECLSPEC_CACHEALIGN _PARKBUCKET {
+	SRWLOCK			Lock;
+	LIST_ENTRY		list;
+} PARKBUCKET;
+
+
+static PARKBUCKET parkv[PARK_BUCKETS];
+static __declspec(thread) HANDLE DdkAlertEvent;
 
 
 void DdkWaitInit()
 {
-	nullevent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (sizeof(PARKED) > _SizeofWaitBlock_ || ThreadWaitObjects > WAIT_BLOCKS)
+		ddkfail("Wait blocks are too small");
+
+	for (int i = 0; i < PARK_BUCKETS; i++) {
+		InitializeSRWLock(&parkv[i].Lock);
+		parkv[i].list.Flink = parkv[i].list.Blink = &parkv[i].list;
+	}
+}
+
+
+void DdkWaitThreadExit()
+{
+	if (DdkAlertEvent) {
+		CloseHandle(DdkAlertEvent);
+		DdkAlertEvent = NULL;
+	}
+}
+
+
+static PARKBUCKET *DdkParkBucket(DISPATCH *pObj)
+{
+	return &parkv[((ULONG64)pObj * 0x9E3779B97F4A7C15ULL) >> 54];
+}
+
+
+static void DdkPark(PARKED *pPark, PARKWAIT *wait)
+{
+	PARKBUCKET *b = DdkParkBucket(pPark->pObj);
+
+	pPark->wait = wait;
+	pPark->hit = 0;
+
+	AcquireSRWLockExclusive(&b->Lock);
+	pPark->entry.Flink = &b->list;
+	pPark->entry.Blink = b->list.Blink;
+	b->list.Blink->Flink = &pPark->entry;
+	b->list.Blink = &pPark->entry;
+	ReleaseSRWLockExclusive(&b->Lock);
+
+	InterlockedIncrement16(&pPark->pObj->waiters);
+}
+
+
+static void DdkUnpark(PARKED *pPark)
+{
+	PARKBUCKET *b = DdkParkBucket(pPark->pObj);
+
+	InterlockedDecrement16(&pPark->pObj->waiters);
+
+	AcquireSRWLockExclusive(&b->Lock);
+	pPark->entry.Blink->Flink = pPark->entry.Flink;
+	pPark->entry.Flink->Blink = pPark->entry.Blink;
+	ReleaseSRWLockExclusive(&b->Lock);
+}
+
+
+/*
+ *	Wake up to count waiters parked on an object, besides any wait for all
+ *	and those already woken for it. Only the address of the object is used,
+ *	as it may already have been freed.
+ */
+
+static void DdkWakeParked(DISPATCH *pObj, LONG count)
+{
+	PARKBUCKET *b = DdkParkBucket(pObj);
+
+	AcquireSRWLockShared(&b->Lock);
+
+	for (LIST_ENTRY *e = b->list.Flink; e != &b->list; e = e->Flink) {
+		PARKED *pPark = CONTAINING_RECORD(e, PARKED, entry);
+		PARKWAIT *wait = pPark->wait;
+		PARKED *next;
+
+		if (pPark->pObj != pObj || pPark->hit) continue;
+		if (!wait->all && count <= 0) continue;
+		if (InterlockedExchange(&pPark->hit, 1)) continue;
+		if (!wait->all) count--;
+
+		do {
+			next = wait->signalled;
+			pPark->next = next;
+		} while (InterlockedCompareExchangePointer((PVOID volatile *)&wait->signalled,
+			pPark, next) != next);
+
+		InterlockedExchange(&wait->wake, 1);
+
+		if (wait->alert) SetEvent(wait->alert);
+		else WakeByAddressSingle((PVOID)&wait->wake);
+	}
+
+	ReleaseSRWLockShared(&b->Lock);
+}
+
+
+/*
+ *	Called after changing the signal state of an object that cannot go
+ *	away under the caller, such as a queue with its lock held.
+ */
+
+void DdkWakeWaiters(DISPATCH *pObj)
+{
+	if (pObj->waiters) DdkWakeParked(pObj, (pObj->notify) ? MAXLONG : 1);
+}
+
+
+/*
+ *	Set the signal state of an object, or add to its count up to a limit,
+ *	and wake its waiters. Returns the previous state, or -1 if the count
+ *	would pass the limit.
+ */
+
+LONG DdkSignalObject(DISPATCH *pObj, LONG Adjustment, LONG Limit)
+{
+	LONG64 state = pObj->state, prev;
+	LONG signal;
+
+	for (;;) {
+		signal = (LONG)state;
+
+		if (Adjustment && signal > Limit - Adjustment) return -1;
+
+		LONG next = (Adjustment) ? signal + Adjustment : 1;
+
+		prev = InterlockedCompareExchange64(&pObj->state,
+			(state & ~(LONG64)MAXULONG) | (ULONG)next, state);
+
+		if (prev == state) break;
+		state = prev;
+	}
+
+	if ((SHORT)(state >> 32))
+		DdkWakeParked(pObj, ((UCHAR)(state >> 48)) ? MAXLONG : max(Adjustment, 1));
+
+	return signal;
 }
 
 
-static POBJECT GetDispatch(OBJECT *pObj)
+static DISPATCH *GetDispatch(OBJECT *pObj)
 {
-	if (!pObj || !isDispatchObject(pObj) || !pObj->h)
+	if (!pObj || !isDispatchObject(pObj))
 		ddkfail("Invalid dispatch object");
 
-	return pObj;
+	return static_cast<DISPATCH *>(pObj);
 }
 
 
-static NTSTATUS WaitStatus(OBJECT **pVec, ULONG count, int all, DWORD rc)
+static bool DdkObjectReady(DISPATCH *pObj)
 {
-	if ((LONG)rc >= WAIT_OBJECT_0 && rc < WAIT_OBJECT_0 + MAXIMUM_WAIT_OBJECTS) {
-		for (ULONG i = (all) ? 0 : (rc - WAIT_OBJECT_0); i < count; i++) {
-			if (pVec[i]->type == SemaphoreType) DdkUpdateSemaphore(pVec[i]);
-			if (pVec[i]->type == MutexType) DdkUpdateMutex(pVec[i]);
-			if (!all) break;
-		}
+	if (pObj->type == MutexType) return (pObj->signal > 0 || !DdkIsMutexContended(pObj));
+	return (pObj->signal > 0);
+}
+
+
+static bool DdkAcquireObject(DISPATCH *pObj)
+{
+	LONG signal;
+
+	if (pObj->type == MutexType) return DdkAcquireMutex(pObj);
+	if (pObj->notify) return (pObj->signal > 0);
+
+	while ((signal = pObj->signal) > 0)
+		if (InterlockedCompareExchange(&pObj->signal, signal - 1, signal) == signal)
+			return true;
+
+	return false;
+}
+
+
+static void DdkUnacquireObject(DISPATCH *pObj)
+{
+	if (pObj->notify) return;
+
+	if (pObj->type == MutexType) DdkReleaseMutex(pObj);
+	else if (pObj->type == SemaphoreType) DdkSignalObject(pObj, 1, MAXLONG);
+	else DdkSignalObject(pObj, 0, 0);
+}
+
+
+/*
+ *	Satisfy a wait for any object, or all of them, returning the index of
+ *	the object or -1. A wait for all only takes the objects once they are
+ *	all signalled. It has its blocks sorted by address, and gives back the
+ *	objects it took if another thread got in first, so two such waits on
+ *	the same objects cannot hold each other off. Giving them back wakes
+ *	the caller too, which costs it one more pass.
+ */
+
+static LONG DdkSatisfyWait(ULONG n, PARKED park[], bool all)
+{
+	ULONG i;
 
-		return (STATUS_WAIT_0 + (rc - WAIT_OBJECT_0));
+	if (!all) {
+		for (i = 0; i < n; i++)
+			if (DdkAcquireObject(park[i].pObj)) return i;
+
+		return -1;
 	}
 
-	if (rc == WAIT_TIMEOUT) return STATUS_TIMEOUT;
-	if (rc == WAIT_IO_COMPLETION) return STATUS_ALERTED;
-	return STATUS_UNSUCCESSFUL;
+	for (i = 0; i < n; i++)
+		if (!DdkObjectReady(park[i].pObj)) return -1;
+
+	for (i = 0; i < n; i++)
+		if (!DdkAcquireObject(park[i].pObj)) break;
+
+	if (i == n) return 0;
+
+	while (i-- > 0)
+		DdkUnacquireObject(park[i].pObj);
+
+	return -1;
 }
 
 
-DDKAPI
-NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason,
-	KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+/*
+ *	Try again to satisfy a wait that was woken, with the entries that were
+ *	signalled. Each is taken off the list before its object is tried, so
+ *	that a later signal puts it back.
+ */
+
+static LONG DdkRetryWait(ULONG n, PARKED park[], bool all, PARKED *list)
 {
-	return KeWaitForMultipleObjects(1, &Object, WaitAny, WaitReason, WaitMode, Alertable, Timeout, NULL);
+	bool any = false;
+	LONG rc = -1;
+
+	while (list) {
+		PARKED *pPark = list;
+
+		list = pPark->next;
+		InterlockedExchange(&pPark->hit, 0);
+
+		if (pPark < park || pPark >= park + n) continue;
+		any = true;
+
+		if (!all && rc < 0 && DdkAcquireObject(pPark->pObj))
+			rc = (LONG)(pPark - park);
+	}
+
+	return (all && any) ? DdkSatisfyWait(n, park, true) : rc;
 }
 
 
-DDKAPI
-NTSTATUS KeWaitForMultipleObjects(ULONG Count, PVOID Object[], WAIT_TYPE WaitType,
-	KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable,
-	PLARGE_INTEGER Timeout, PKWAIT_BLOCK WaitBlockArray)
+static int __cdecl DdkCompareParked(const void *p1, const void *p2)
+{
+	DISPATCH *o1 = ((const PARKED *)p1)->pObj, *o2 = ((const PARKED *)p2)->pObj;
+	return (o1 < o2) ? -1 : (o1 > o2) ? 1 : 0;
+}
+
+
+/*
+ *	Park until the wait is satisfied or times out. A wait with a timeout
+ *	in virtual time parks on a timer that expires as the clock passes the
+ *	timeout, as do delays, which wait on no objects at all. An alertable
+ *	wait parks on the thread's event, so an APC ends it.
+ *
+ *	The first pass tries every object, for signals sent before the wait
+ *	was parked. On the way out, a synchronization object that is still
+ *	signalled wakes another waiter, in case it woke this one for nothing.
+ */
+
+static LONG DdkParkWait(ULONG n, PARKED park[], bool all, bool alertable, PLARGE_INTEGER Timeout)
+{
+	PARKED timer;
+	PARKWAIT wait;
+	bool virt = (DdkVirtualTime && Timeout), first = true;
+	PKTIMER Timer = (virt) ? DdkArmWaitTimer(*Timeout) : NULL;
+	LONG64 deadline = (Timeout && !virt) ? DdkClockTime() + DdkGetWaitTime(Timeout) * 10000LL : 0;
+	LONG rc = PARK_TIMEOUT;
+	ULONG i;
+
+	wait.wake = 0;
+	wait.all = all;
+	wait.alert = NULL;
+	wait.signalled = NULL;
+
+	if (alertable) {
+		if (!DdkAlertEvent && !(DdkAlertEvent = CreateEvent(NULL, FALSE, FALSE, NULL)))
+			ddkfail("Failed to create alert event");
+
+		wait.alert = DdkAlertEvent;
+	}
+
+	if (virt) DdkBeginVirtualWait();
+
+	DdkQueueBlock();
+
+	for (i = 0; i < n; i++)
+		DdkPark(&park[i], &wait);
+
+	if (Timer) {
+		timer.pObj = (DISPATCH *)Timer;
+		DdkPark(&timer, &wait);
+	}
+
+	for (;;) {
+		DWORD ms = INFINITE;
+		LONG zero = 0;
+
+		InterlockedExchange(&wait.wake, 0);
+
+		PARKED *list = (PARKED *)InterlockedExchangePointer((PVOID volatile *)&wait.signalled, NULL);
+
+		rc = DdkRetryWait(n, park, all, list);
+
+		if (first && rc < 0 && n) rc = DdkSatisfyWait(n, park, all);
+		first = false;
+
+		if (rc >= 0) break;
+		if (Timer && KeReadStateTimer(Timer)) break;
+
+		if (deadline) {
+			LONG64 left = deadline - DdkClockTime();
+
+			if (left <= 0) break;
+			ms = (DWORD)min((left + 9999) / 10000, (LONG64)MAXDWORD - 1);
+		}
+
+		if (!wait.alert) WaitOnAddress(&wait.wake, &zero, sizeof(zero), ms);
+
+		else if (WaitForSingleObjectEx(wait.alert, ms, TRUE) == WAIT_IO_COMPLETION) {
+			rc = PARK_ALERTED;
+			break;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		DdkUnpark(&park[i]);
+
+	for (i = 0; i < n; i++) {
+		DISPATCH *pObj = park[i].pObj;
+
+		if (!pObj->notify && pObj->waiters && pObj->signal > 0)
+			DdkWakeParked(pObj, 1);
+	}
+
+	if (Timer) {
+		DdkUnpark(&timer);
+		DdkEndVirtualWait();
+		DdkFreeWaitTimer(Timer);
+	}
+
+	DdkQueueUnblock();
+	return rc;
+}
+
+
+/*
+ *	Without a wait block array the thread's own few blocks are used, as in
+ *	the kernel. With one, any number of objects may be waited on, where the
+ *	kernel stops at MAXIMUM_WAIT_OBJECTS.
+ */
+
+static NTSTATUS WaitForObjects(ULONG Count, PVOID Object[], WAIT_TYPE WaitType,
+	BOOLEAN Alertable, PLARGE_INTEGER Timeout, PKWAIT_BLOCK WaitBlockArray, PVOID pCaller)
 {
-	POBJECT obj[MAXIMUM_WAIT_OBJECTS];
-	HANDLE h[MAXIMUM_WAIT_OBJECTS];
-	ULONG i = 0;
+	PARKED local[WAIT_BLOCKS];
+	PARKED *park = (WaitBlockArray) ? (PARKED *)WaitBlockArray : local;
+	LONG64 start = (DdkLockStats) ? DdkLockStatTime() : 0;
+	bool all = (WaitType == WaitAll), contended = false;
+	ULONG i;
 
-	if (Count > (WaitBlockArray ? MAXIMUM_WAIT_OBJECTS : ThreadWaitObjects))
+	if (!WaitBlockArray && Count > ThreadWaitObjects)
 		KeBugCheck(MAXIMUM_WAIT_OBJECTS_EXCEEDED);
 
-	for (; i < Count; i++) {
-		obj[i] = GetDispatch(FromPointer(Object[i]));
-		h[i] = obj[i]->h;
+	for (i = 0; i < Count; i++) {
+		park[i].pObj = GetDispatch(FromPointer(Object[i]));
+
+		if (start && park[i].pObj->type == MutexType && DdkIsMutexContended(park[i].pObj))
+			contended = true;
 	}
 
-	// Adding a dummy entry seems to significantly speed up
-	// WaitForSingleObject when used with timers and threadpools
+	if (all && Count > 1)
+		qsort(park, Count, sizeof(PARKED), DdkCompareParked);
 
-	if (i == 1 && nullevent) h[i++] = nullevent;
+	LONG rc = DdkSatisfyWait(Count, park, all);
 
-	DWORD rc = WaitForMultipleObjectsEx(i, h,
-		(WaitType == WaitAll), DdkGetWaitTime(Timeout), (Alertable != FALSE));
+	if (rc < 0 && (!Timeout || Timeout->QuadPart))
+		rc = DdkParkWait(Count, park, all, (Alertable != FALSE), Timeout);
 
-	return WaitStatus(obj, Count, (WaitType == WaitAll), rc);
+	if (rc == PARK_ALERTED) return STATUS_ALERTED;
+	if (rc < 0) return STATUS_TIMEOUT;
+
+	if (start) {
+		for (i = (all) ? 0 : rc; i < Count; i++) {
+			if (park[i].pObj->type == MutexType)
+				DdkLockStatAcquire(park[i].pObj, pCaller, LockMutex, start, contended);
+
+			if (!all) break;
+		}
+	}
+
+	return STATUS_WAIT_0 + rc;
+}
+
+
+DDKAPI
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason,
+	KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+	return WaitForObjects(1, &Object, WaitAny, Alertable, Timeout, NULL, _ReturnAddress());
+}
+
+
+DDKAPI
+NTSTATUS KeWaitForMultipleObjects(ULONG Count, PVOID Object[], WAIT_TYPE WaitType,
+	KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout, PKWAIT_BLOCK WaitBlockArray)
+{
+	return WaitForObjects(Count, Object, WaitType, Alertable, Timeout, WaitBlockArray, _ReturnAddress());
 }
 
 
@@ -97,8 +497,14 @@ NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode,
 {
 	DDKASSERT(KeGetCurrentIrql() <= APC_LEVEL);
 
+	if (DdkVirtualTime && Interval && Interval->QuadPart) {
+		LONG rc = DdkParkWait(0, NULL, false, (Alertable != FALSE), Interval);
+		return (rc == PARK_ALERTED) ? STATUS_ALERTED : STATUS_SUCCESS;
+	}
+
+	DdkQueueBlock();
 	DWORD rc = SleepEx(DdkGetDelayTime(Interval), (Alertable != FALSE));
+	DdkQueueUnblock();
 
-	if (rc == WAIT_IO_COMPLETION) return STATUS_ALERTED;
-	return STATUS_SUCCESS;
+	return (rc == WAIT_IO_COMPLETION) ? STATUS_ALERTED : STATUS_SUCCESS;
 }
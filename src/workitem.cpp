@@ -14,39 +14,354 @@
 #include "stdafx.h"
 
 
+/*
+ *	Each type of work queue has a kernel queue and its own pool of system
+ *	worker threads. The kernel queue limits the workers running to the
+ *	processors, and a worker that blocks in a Ke wait gives up its place.
+ *	Other blocking, such as Sleep or a Win32 wait, is not seen and keeps
+ *	the place. Should that leave items waiting with no thread to take
+ *	them, the balance thread creates another worker, up to the maximum
+ *	for the queue, and workers above the minimum exit once they have
+ *	been idle for a while. An I/O work item is queued as a system work
+ *	item of its own.
+ */
+
+#define WORKER_DYNAMIC		16				// Threads added as workers block
+#define WORKER_IDLE			(-10 * 1000 * 10000LL)
+#define WORKER_BALANCE		100				// Milliseconds
+
+typedef struct _WORKQUEUE {
+	PKQUEUE			Queue;
+	volatile LONG	minimum;
+	volatile LONG	maximum;
+	volatile LONG	priority;
+	volatile LONG	threads;
+	volatile LONG	peak;
+	volatile LONG	maxdepth;
+	volatile LONG64	completed;
+} WORKQUEUE;
+
 typedef struct _IO_WORKITEM {
-	PTP_WORK Work;
+	WORK_QUEUE_ITEM Item;
 	void *IoObject;
 	PIO_WORKITEM_ROUTINE WorkerRoutine;
 	PIO_WORKITEM_ROUTINE_EX WorkerRoutineEx;
 	WORK_QUEUE_TYPE QueueType;
 	void *Context;
 	volatile LONG queued;
+	LONG64 queuetime;
 } IO_WORKITEM;
 
 
 __declspec(thread) bool DdkWorkItemActive = false;
 
+static const char *WorkQueueName[MaximumWorkQueue] = { "critical", "delayed", "hypercritical" };
+static const KPRIORITY WorkQueuePriority[MaximumWorkQueue] = { 13, 12, 15 };
+
+static WORKQUEUE workv[MaximumWorkQueue];
+static INIT_ONCE WorkInit = INIT_ONCE_STATIC_INIT;
+static HANDLE BalanceEvent;
 
-static VOID DdkWorkCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_WORK Work)
+
+static void DdkWorkMax(volatile LONG *pMax, LONG v)
 {
-	PIO_WORKITEM pWork = (IO_WORKITEM *)Context;
-	IO_WORKITEM w = *pWork;
+	LONG max;
+
+	while ((max = *pMax) < v)
+		if (InterlockedCompareExchange(pMax, v, max) == max)
+			break;
+}
+
+
+static int DdkWorkerPriority(KPRIORITY Priority)
+{
+	if (Priority >= 15) return THREAD_PRIORITY_HIGHEST;
+	if (Priority >= 13) return THREAD_PRIORITY_ABOVE_NORMAL;
+	return THREAD_PRIORITY_NORMAL;
+}
+
+
+static bool DdkRetireWorker(WORKQUEUE *pWork)
+{
+	LONG n = pWork->threads;
+
+	while (n > pWork->minimum) {
+		LONG prev = InterlockedCompareExchange(&pWork->threads, n - 1, n);
+
+		if (prev == n) return true;
+		n = prev;
+	}
+
+	return false;
+}
+
+
+static DWORD WINAPI DdkWorkerThread(PVOID Context)
+{
+	WORKQUEUE *pWork = (WORKQUEUE *)Context;
+	KPRIORITY priority = -1;
+	LARGE_INTEGER idle;
 
 	DdkThreadInit();
-	DdkWorkItemActive = true;
-	KeLowerIrql(PASSIVE_LEVEL);
+	idle.QuadPart = WORKER_IDLE;
+
+	for (;;) {
+		if (priority != pWork->priority) {
+			priority = pWork->priority;
+			KeSetPriorityThread(KeGetCurrentThread(), priority);
+			SetThreadPriority(GetCurrentThread(), DdkWorkerPriority(priority));
+		}
+
+		// Only threads above the minimum give up waiting, and not in
+		// virtual time, where the timeout would move the clock on
+
+		bool retire = (pWork->threads > pWork->minimum && !DdkVirtualTime);
+		PLIST_ENTRY Entry = KeRemoveQueue(pWork->Queue, KernelMode, (retire) ? &idle : NULL);
+
+		if (Entry == (PLIST_ENTRY)(ULONG_PTR)STATUS_TIMEOUT) {
+			if (DdkRetireWorker(pWork)) break;
+			continue;
+		}
+
+		PWORK_QUEUE_ITEM pItem = CONTAINING_RECORD(Entry, WORK_QUEUE_ITEM, List);
+
+		DdkWorkItemActive = true;
+		(*pItem->WorkerRoutine)(pItem->Parameter);
+		DDKASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+		DdkWorkItemActive = false;
+
+		InterlockedIncrement64(&pWork->completed);
+		DdkEndDeferred();
+	}
+
+	return 0;
+}
+
+
+static bool DdkCreateWorker(WORKQUEUE *pWork)
+{
+	LONG n = pWork->threads;
+
+	for (;;) {
+		if (n >= pWork->maximum) return false;
+
+		LONG prev = InterlockedCompareExchange(&pWork->threads, n + 1, n);
+
+		if (prev == n) break;
+		n = prev;
+	}
+
+	HANDLE h = CreateThread(NULL, 0, DdkWorkerThread, pWork, 0, NULL);
+
+	if (!h) {
+		InterlockedDecrement(&pWork->threads);
+		return false;
+	}
+
+	CloseHandle(h);
+	DdkWorkMax(&pWork->peak, n + 1);
+	return true;
+}
+
+
+/*
+ *	Every so often, or when woken, keep each queue at its minimum number
+ *	of workers, and add one to a queue starved by blocked workers.
+ */
+
+static DWORD WINAPI DdkBalanceThread(PVOID Context)
+{
+	for (;;) {
+		WaitForSingleObject(BalanceEvent, WORKER_BALANCE);
+
+		for (int i = 0; i < MaximumWorkQueue; i++) {
+			WORKQUEUE *pWork = &workv[i];
+
+			while (pWork->threads < pWork->minimum && DdkCreateWorker(pWork))
+				;
+
+			if (DdkQueueStarved(pWork->Queue)) DdkCreateWorker(pWork);
+		}
+	}
+
+	return 0;
+}
+
+
+static BOOL CALLBACK DdkWorkInit(PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
+{
+	LONG processors = (LONG)DdkGetProcessorCount();
+
+	for (int i = 0; i < MaximumWorkQueue; i++) {
+		WORKQUEUE *pWork = &workv[i];
+
+		pWork->Queue = (PKQUEUE)malloc(_SizeofQueue_);
+
+		if (!pWork->Queue)
+			ddkfail("Unable to allocate work queue");
+
+		DdkInitializeQueue(pWork->Queue, 0);
+
+		pWork->minimum = (i == HyperCriticalWorkQueue) ? 1 : processors;
+		pWork->maximum = pWork->minimum + WORKER_DYNAMIC;
+		pWork->priority = WorkQueuePriority[i];
+
+		for (LONG n = 0; n < pWork->minimum; n++)
+			if (!DdkCreateWorker(pWork))
+				ddkfail("Unable to create worker thread");
+	}
+
+	BalanceEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	HANDLE h = (BalanceEvent) ? CreateThread(NULL, 0, DdkBalanceThread, NULL, 0, NULL) : NULL;
+
+	if (!h)
+		ddkfail("Unable to create worker balance thread");
+
+	CloseHandle(h);
+	return TRUE;
+}
+
+
+static bool DdkWorkStarted()
+{
+	BOOL pending;
+
+	return InitOnceBeginInitialize(&WorkInit, INIT_ONCE_CHECK_ONLY, &pending, NULL) && !pending;
+}
+
+
+static WORKQUEUE *DdkGetWorkQueue(WORK_QUEUE_TYPE QueueType)
+{
+	if ((ULONG)QueueType >= MaximumWorkQueue)
+		ddkfail("Invalid work queue specified");
+
+	InitOnceExecuteOnce(&WorkInit, DdkWorkInit, NULL, NULL);
+	return &workv[QueueType];
+}
+
+
+static void DdkQueueWork(PWORK_QUEUE_ITEM WorkItem, WORK_QUEUE_TYPE QueueType)
+{
+	WORKQUEUE *pWork = DdkGetWorkQueue(QueueType);
+
+	DdkBeginDeferred();
+
+	LONG depth = KeInsertQueue(pWork->Queue, &WorkItem->List) + 1;
+
+	DdkWorkMax(&pWork->maxdepth, depth);
+
+	if (DdkQueueStarved(pWork->Queue)) SetEvent(BalanceEvent);
+}
+
+
+static VOID DdkIoWorkRoutine(PVOID Parameter)
+{
+	PIO_WORKITEM pWork = (IO_WORKITEM *)Parameter;
+	IO_WORKITEM w = *pWork;
+
 	InterlockedExchange(&pWork->queued, 0);
 
+	LONG64 start = DdkLatencyTime();
+
 	if (w.WorkerRoutineEx)
 		(*w.WorkerRoutineEx)(w.IoObject, w.Context, pWork);
 
 	else (*w.WorkerRoutine)((PDEVICE_OBJECT)(w.IoObject), w.Context);
 
-	DDKASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+	DdkRecordLatency((w.WorkerRoutineEx) ? (PVOID)w.WorkerRoutineEx : (PVOID)w.WorkerRoutine,
+		DDK_LATENCY_WORKITEM, w.queuetime, start, DdkLatencyTime());
 
 	ObDereferenceObject(w.IoObject);
-	DdkWorkItemActive = false;
+}
+
+
+DDKAPI
+VOID ExQueueWorkItem(PWORK_QUEUE_ITEM WorkItem, WORK_QUEUE_TYPE QueueType)
+{
+	DDKASSERT(WorkItem && WorkItem->WorkerRoutine);
+	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+	// ExInitializeWorkItem clears the link, and the queue clears it again
+	// as the item is removed, so a set link means it is queued already
+
+	DDKASSERT(WorkItem->List.Flink == NULL);
+
+	DdkQueueWork(WorkItem, QueueType);
+}
+
+
+/*
+ *	NTSTATUS DdkSetWorkQueue(WORK_QUEUE_TYPE QueueType, ULONG MinimumThreads,
+ *			ULONG MaximumThreads, KPRIORITY Priority)
+ *
+ *	Set the number of workers kept for a queue, the most it may grow to
+ *	as workers block, and the priority they run at.
+ */
+
+DDKAPI
+NTSTATUS DdkSetWorkQueue(WORK_QUEUE_TYPE QueueType, ULONG MinimumThreads, ULONG MaximumThreads, KPRIORITY Priority)
+{
+	if ((ULONG)QueueType >= MaximumWorkQueue || !MinimumThreads ||
+			MaximumThreads < MinimumThreads || Priority < 0 || Priority > 31)
+		return STATUS_INVALID_PARAMETER;
+
+	WORKQUEUE *pWork = DdkGetWorkQueue(QueueType);
+
+	pWork->maximum = (LONG)MaximumThreads;
+	pWork->minimum = (LONG)MinimumThreads;
+	pWork->priority = Priority;
+
+	SetEvent(BalanceEvent);
+	return STATUS_SUCCESS;
+}
+
+
+/*
+ *	BOOLEAN DdkQueryWorkQueue(WORK_QUEUE_TYPE QueueType, PULONG Depth,
+ *			PULONG MaximumDepth, PULONG Threads, PULONG64 Completed)
+ *
+ *	Return the items waiting in a queue and the most there have been, the
+ *	worker threads it has, and the number of items it has run. Queues not
+ *	yet started report zeros, without starting them.
+ */
+
+DDKAPI
+BOOLEAN DdkQueryWorkQueue(WORK_QUEUE_TYPE QueueType, PULONG Depth, PULONG MaximumDepth, PULONG Threads, PULONG64 Completed)
+{
+	if ((ULONG)QueueType >= MaximumWorkQueue)
+		return FALSE;
+
+	WORKQUEUE *pWork = &workv[QueueType];
+
+	if (!DdkWorkStarted()) {
+		if (Depth) *Depth = 0;
+		if (MaximumDepth) *MaximumDepth = 0;
+		if (Threads) *Threads = 0;
+		if (Completed) *Completed = 0;
+		return TRUE;
+	}
+
+	if (Depth) *Depth = (ULONG)KeReadStateQueue(pWork->Queue);
+	if (MaximumDepth) *MaximumDepth = (ULONG)pWork->maxdepth;
+	if (Threads) *Threads = (ULONG)pWork->threads;
+	if (Completed) *Completed = (ULONG64)pWork->completed;
+	return TRUE;
+}
+
+
+DDKAPI
+VOID DdkReportWorkQueues()
+{
+	bool started = DdkWorkStarted();
+
+	for (int i = 0; i < MaximumWorkQueue; i++) {
+		WORKQUEUE *pWork = &workv[i];
+
+		DdkPrint("DDK: %s work queue depth %d max %d threads %d peak %d priority %d completed %I64d",
+			WorkQueueName[i], (started) ? KeReadStateQueue(pWork->Queue) : 0, pWork->maxdepth,
+			pWork->threads, pWork->peak, (started) ? pWork->priority : WorkQueuePriority[i],
+			pWork->completed);
+	}
 }
 
 
@@ -63,11 +378,7 @@ VOID IoInitializeWorkItem(PVOID IoObject, PIO_WORKITEM IoWorkItem)
 	DDKASSERT(IoObject);
 	memset(IoWorkItem, 0, sizeof(IO_WORKITEM));
 
-	IoWorkItem->Work = CreateThreadpoolWork(DdkWorkCallback, (PVOID)IoWorkItem, NULL);
-
-	if (!IoWorkItem->Work)
-		ddkfail("Unable to initialize WorkItem");
-
+	ExInitializeWorkItem(&IoWorkItem->Item, DdkIoWorkRoutine, IoWorkItem);
 	IoWorkItem->IoObject = IoObject;
 }
 
@@ -78,7 +389,6 @@ VOID IoUninitializeWorkItem(PIO_WORKITEM IoWorkItem)
 	DDKASSERT(IoWorkItem);
 	DDKASSERT(!IoWorkItem->queued);
 
-	CloseThreadpoolWork(IoWorkItem->Work);
 	memset(IoWorkItem, 0, sizeof(IO_WORKITEM));
 }
 
@@ -100,16 +410,17 @@ DDKAPI
 VOID IoQueueWorkItem(PIO_WORKITEM IoWorkItem,
 		PIO_WORKITEM_ROUTINE WorkerRoutine, WORK_QUEUE_TYPE QueueType, PVOID Context)
 {
-	DDKASSERT(IoWorkItem);
+	DDKASSERT(IoWorkItem && !IoWorkItem->queued);
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
 
 	IoWorkItem->WorkerRoutine = WorkerRoutine;
 	IoWorkItem->QueueType = QueueType;
 	IoWorkItem->Context = Context;
 	IoWorkItem->queued = true;
+	IoWorkItem->queuetime = DdkLatencyTime();
 
 	ObReferenceObject(IoWorkItem->IoObject);
-	SubmitThreadpoolWork(IoWorkItem->Work);
+	DdkQueueWork(&IoWorkItem->Item, QueueType);
 }
 
 
@@ -117,16 +428,17 @@ DDKAPI
 VOID IoQueueWorkItemEx(PIO_WORKITEM IoWorkItem,
     PIO_WORKITEM_ROUTINE_EX WorkerRoutine, WORK_QUEUE_TYPE QueueType, PVOID Context)
 {
-	DDKASSERT(IoWorkItem);
+	DDKASSERT(IoWorkItem && !IoWorkItem->queued);
 	DDKASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
 
 	IoWorkItem->WorkerRoutineEx = WorkerRoutine;
 	IoWorkItem->QueueType = QueueType;
 	IoWorkItem->Context = Context;
 	IoWorkItem->queued = true;
+	IoWorkItem->queuetime = DdkLatencyTime();
 
 	ObReferenceObject(IoWorkItem->IoObject);
-	SubmitThreadpoolWork(IoWorkItem->Work);
+	DdkQueueWork(&IoWorkItem->Item, QueueType);
 }
 
 
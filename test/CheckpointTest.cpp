@@ -0,0 +1,210 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2024, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Checkpoint Tests
+ */
+
+#include "stdafx.h"
+
+
+namespace DdkUnitTest
+{
+	TEST_CLASS(DdkCheckpointTest)
+	{
+		PDRIVER_OBJECT pDriver;
+		PDEVICE_OBJECT pDevice;
+		PFILE_OBJECT pFile;
+		UNICODE_STRING udev;
+		UNICODE_STRING ulink;
+
+		char DriverName[100];
+		wchar_t DeviceName[100];
+		wchar_t LinkName[100];
+
+		static NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
+		{
+			DdkCheckpointTest *pTest = (DdkCheckpointTest *)_wtoll(&DriverObject->DriverName.Buffer[3]);
+			pTest->pDriver = DriverObject;
+			return STATUS_SUCCESS;
+		}
+
+		static NTSTATUS OpenFile(PWCH pName, ULONG Disposition)
+		{
+			OBJECT_ATTRIBUTES attr;
+			IO_STATUS_BLOCK iostat;
+			UNICODE_STRING u;
+
+			RtlInitUnicodeString(&u, pName);
+
+			InitializeObjectAttributes(&attr, &u,
+				(OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE), NULL, NULL);
+
+			HANDLE h = NULL;
+			NTSTATUS status = ZwCreateFile(&h, GENERIC_READ | GENERIC_WRITE,
+				&attr, &iostat, NULL, FILE_ATTRIBUTE_NORMAL, 0, Disposition,
+				FILE_NON_DIRECTORY_FILE, NULL, 0);
+
+			if (NT_SUCCESS(status)) ZwClose(h);
+			return status;
+		}
+
+		static NTSTATUS DeleteFile(PWCH pName)
+		{
+			OBJECT_ATTRIBUTES attr;
+			UNICODE_STRING u;
+
+			RtlInitUnicodeString(&u, pName);
+
+			InitializeObjectAttributes(&attr, &u,
+				(OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE), NULL, NULL);
+
+			return ZwDeleteFile(&attr);
+		}
+
+	public:
+		TEST_METHOD_INITIALIZE(DdkCheckpointTestInit)
+		{
+			DdkThreadInit();
+
+			sprintf(DriverName, "DRV%I64d:%d", (LONGLONG)this, GetUniqueId());
+			swprintf(DeviceName, sizeof(DeviceName) / sizeof(WCHAR),
+				L"\\Device\\D%I64d:%d", (LONGLONG)this, GetUniqueId());
+			swprintf(LinkName, sizeof(LinkName) / sizeof(WCHAR),
+				L"\\Device\\L%I64d:%d", (LONGLONG)this, GetUniqueId());
+
+			pDriver = 0;
+			pDevice = 0;
+			pFile = 0;
+
+			RtlInitUnicodeString(&udev, DeviceName);
+			RtlInitUnicodeString(&ulink, LinkName);
+
+			NTSTATUS rc = DdkInitDriver(DriverName, DriverEntry);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsNotNull(pDriver);
+
+			rc = IoCreateDevice(pDriver, 200, &udev, FILE_DEVICE_DISK, 0, FALSE, &pDevice);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsNotNull(pDevice);
+
+			rc = IoCreateSymbolicLink(&ulink, &udev);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+		}
+
+		TEST_METHOD_CLEANUP(DdkCheckpointTestCleanup)
+		{
+			DdkDiscardCheckpoint();
+			IoDeleteSymbolicLink(&ulink);
+			if (pFile) ObDereferenceObject(pFile);
+			if (pDevice) IoDeleteDevice(pDevice);
+			if (pDriver) DdkUnloadDriver(DriverName);
+		}
+
+		/*
+		 *	Check that a restore deletes devices created since the checkpoint
+		 */
+		TEST_METHOD(DdkCheckpointRestoreNewDevice)
+		{
+			UNICODE_STRING u;
+			PDEVICE_OBJECT pDevice2;
+
+			RtlInitUnicodeString(&u, L"\\Device\\CheckpointNew");
+
+			NTSTATUS rc = DdkCheckpoint();
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+
+			rc = IoCreateDevice(pDriver, 0, &u, FILE_DEVICE_DISK, 0, FALSE, &pDevice2);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+
+			rc = DdkRestore();
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+
+			rc = IoGetDeviceObjectPointer(&u, 0, &pFile, &pDevice2);
+			Assert::IsTrue(rc == STATUS_OBJECT_NAME_NOT_FOUND);
+
+			Assert::IsTrue(pDriver->DeviceObject == pDevice);
+			Assert::IsNull(pDevice->NextDevice);
+		}
+
+		/*
+		 *	Check that a restore brings back a device deleted since the checkpoint
+		 */
+		TEST_METHOD(DdkCheckpointRestoreDeletedDevice)
+		{
+			PDEVICE_OBJECT pDevice2;
+
+			NTSTATUS rc = DdkCheckpoint();
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+
+			IoDeleteDevice(pDevice);
+
+			rc = IoGetDeviceObjectPointer(&udev, 0, &pFile, &pDevice2);
+			Assert::IsTrue(rc == STATUS_OBJECT_NAME_NOT_FOUND);
+
+			rc = DdkRestore();
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+
+			rc = IoGetDeviceObjectPointer(&udev, 0, &pFile, &pDevice2);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(pDevice2 == pDevice);
+		}
+
+		/*
+		 *	Check that a restore puts back a symbolic link deleted since
+		 */
+		TEST_METHOD(DdkCheckpointRestoreSymLink)
+		{
+			PDEVICE_OBJECT pDevice2;
+
+			NTSTATUS rc = DdkCheckpoint();
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+
+			IoDeleteSymbolicLink(&ulink);
+
+			rc = DdkRestore();
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+
+			rc = IoGetDeviceObjectPointer(&ulink, 0, &pFile, &pDevice2);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(pDevice2 == pDevice);
+		}
+
+		/*
+		 *	Check that a restore removes files created since the checkpoint,
+		 *	and puts back those deleted since
+		 */
+		TEST_METHOD(DdkCheckpointRestoreFiles)
+		{
+			NTSTATUS rc = OpenFile(L"\\??\\C:\\Test\\Checkpoint1.txt", FILE_CREATE);
+			Assert::AreEqual(STATUS_SUCCESS, rc);
+
+			rc = DdkCheckpoint();
+			Assert::AreEqual(STATUS_SUCCESS, rc);
+
+			rc = OpenFile(L"\\??\\C:\\Test\\Checkpoint2.txt", FILE_CREATE);
+			Assert::AreEqual(STATUS_SUCCESS, rc);
+
+			rc = DeleteFile(L"\\??\\C:\\Test\\Checkpoint1.txt");
+			Assert::AreEqual(STATUS_SUCCESS, rc);
+
+			rc = DdkRestore();
+			Assert::AreEqual(STATUS_SUCCESS, rc);
+
+			rc = OpenFile(L"\\??\\C:\\Test\\Checkpoint2.txt", FILE_OPEN);
+			Assert::AreEqual(STATUS_OBJECT_NAME_NOT_FOUND, rc);
+
+			rc = OpenFile(L"\\??\\C:\\Test\\Checkpoint1.txt", FILE_OPEN);
+			Assert::AreEqual(STATUS_SUCCESS, rc);
+
+			rc = DeleteFile(L"\\??\\C:\\Test\\Checkpoint1.txt");
+			Assert::AreEqual(STATUS_SUCCESS, rc);
+		}
+	};
+}
@@ -16,6 +16,25 @@
 
 namespace DdkUnitTest
 {
+	static KDPC dpchigh, dpcmedium;
+	static KEVENT dpcdone;
+	static LONG dpcorder[3], dpcordercount;
+	static ULONG dpcprocessor[3];
+
+	static VOID DdkDpcRecord(PKDPC Dpc, PVOID DeferredContext, PVOID Arg1, PVOID Arg2)
+	{
+		dpcprocessor[dpcordercount] = KeGetCurrentProcessorNumberEx(NULL);
+		dpcorder[dpcordercount++] = (LONG)(LONG_PTR)DeferredContext;
+
+		if (!DeferredContext) {
+			KeInsertQueueDpc(&dpcmedium, 0, 0);
+			KeInsertQueueDpc(&dpchigh, 0, 0);
+		}
+
+		if (dpcordercount == 3)
+			KeSetEvent(&dpcdone, 0, FALSE);
+	}
+
 	TEST_CLASS(DdkDpcTest)
 	{
 		KDPC dpc;
@@ -91,6 +110,76 @@ namespace DdkUnitTest
 			Assert::IsTrue(rm && add);
 		}
 
+		TEST_METHOD(DdkDpcImportance)
+		{
+			ULONG target = KeQueryActiveProcessorCountEx(0) - 1;
+			KDPC first;
+
+			dpcordercount = 0;
+			KeInitializeEvent(&dpcdone, NotificationEvent, FALSE);
+			KeInitializeDpc(&first, DdkDpcRecord, (PVOID)0);
+			KeInitializeDpc(&dpcmedium, DdkDpcRecord, (PVOID)1);
+			KeInitializeDpc(&dpchigh, DdkDpcRecord, (PVOID)2);
+			KeSetImportanceDpc(&dpchigh, HighImportance);
+			KeSetTargetProcessorDpc(&first, (CCHAR)target);
+
+			Assert::IsTrue(KeInsertQueueDpc(&first, 0, 0) != 0);
+			KeWaitForSingleObject(&dpcdone, Executive, KernelMode, FALSE, NULL);
+
+			// Queued from a DPC, both run on the same processor once it returns
+
+			Assert::IsTrue(dpcorder[0] == 0 && dpcorder[1] == 2 && dpcorder[2] == 1);
+			Assert::IsTrue(dpcprocessor[0] == target && dpcprocessor[1] == target && dpcprocessor[2] == target);
+		}
+
+		TEST_METHOD(DdkDpcWaitForIdle)
+		{
+			LARGE_INTEGER timeout;
+
+			timeout.QuadPart = -10000000LL * 10;
+
+			for (int i = 0; i < 100; i++) {
+				TEST_CALLBACK_INIT(id);
+				Assert::IsTrue(KeInsertQueueDpc(&dpc, id, 0) != 0);
+
+				Assert::IsTrue(DdkWaitForIdle(&timeout) == STATUS_SUCCESS);
+				Assert::IsTrue(count == i + 1);
+
+				TEST_CALLBACK_WAIT(id);
+			}
+		}
+
+		/*
+		 *	The first DPC queues the other two from DdkDpcRecord, so the
+		 *	latency recorded for the routine covers DPCs queued from both
+		 *	a thread and a DPC. All three must run before the query.
+		 */
+		TEST_METHOD(DdkDpcLatency)
+		{
+			ULONG64 latency, runtime;
+			KDPC first;
+
+			DdkResetLatency();
+			dpcordercount = 0;
+			KeInitializeEvent(&dpcdone, NotificationEvent, FALSE);
+			KeInitializeDpc(&first, DdkDpcRecord, (PVOID)0);
+			KeInitializeDpc(&dpcmedium, DdkDpcRecord, (PVOID)1);
+			KeInitializeDpc(&dpchigh, DdkDpcRecord, (PVOID)2);
+
+			Assert::IsTrue(KeInsertQueueDpc(&first, 0, 0) != 0);
+			KeWaitForSingleObject(&dpcdone, Executive, KernelMode, FALSE, NULL);
+			KeFlushQueuedDpcs();
+
+			Assert::IsTrue(dpcordercount == 3);
+			Assert::IsTrue(dpcorder[0] == 0 && dpcorder[1] == 1 && dpcorder[2] == 2);
+
+			Assert::IsTrue(DdkQueryLatency((PVOID)DdkDpcRecord, DDK_LATENCY_DPC, 999, &latency, &runtime) != 0);
+			Assert::IsTrue(latency < 1000000 && runtime < 1000000);
+
+			Assert::IsTrue(DdkQueryLatency((PVOID)DdkDpcRecord, DDK_LATENCY_WORKITEM, 500, &latency, &runtime) == 0);
+			DdkReportLatency();
+		}
+
 		TEST_METHOD(DdkDpcFlushQueued)
 		{
 			TEST_CALLBACK_INIT(id);
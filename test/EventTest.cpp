@@ -22,6 +22,7 @@ namespace DdkUnitTest
 		LARGE_INTEGER nowait;
 		UNICODE_STRING u;
 		KEVENT event;
+		KEVENT events[2];
 		HANDLE h1;
 		HANDLE h2;
 
@@ -199,5 +200,48 @@ namespace DdkUnitTest
 			Assert::IsTrue(rc == STATUS_SUCCESS);
 			Assert::IsTrue(KeReadStateEvent(pEvent) == FALSE);
 		}
+
+		TEST_METHOD_CALLBACK(DdkEventSetter, PVOID Context)
+		{
+			LARGE_INTEGER delay;
+			delay.QuadPart = -10 * 10000I64;
+
+			KeDelayExecutionThread(KernelMode, FALSE, &delay);
+			KeSetEvent(&events[0], IO_NO_INCREMENT, FALSE);
+
+			KeDelayExecutionThread(KernelMode, FALSE, &delay);
+			KeSetEvent(&events[1], IO_NO_INCREMENT, FALSE);
+		}
+
+		/*
+		 * Wait for events set by another thread, then for the thread
+		 */
+		TEST_METHOD(DdkEventWaitAllThread)
+		{
+			PVOID objects[2] = { &events[0], &events[1] };
+			PVOID thread;
+			TEST_CALLBACK_INIT(cb);
+
+			KeInitializeEvent(&events[0], SynchronizationEvent, FALSE);
+			KeInitializeEvent(&events[1], NotificationEvent, FALSE);
+
+			Assert::IsTrue(PsCreateSystemThread(&h1, THREAD_ALL_ACCESS,
+				NULL, NULL, NULL, DdkEventSetter, cb) == STATUS_SUCCESS);
+			Assert::IsTrue(ObReferenceObjectByHandle(h1, THREAD_ALL_ACCESS,
+				NULL, KernelMode, &thread, NULL) == STATUS_SUCCESS);
+
+			NTSTATUS rc = KeWaitForMultipleObjects(2, objects, WaitAll,
+				Executive, KernelMode, FALSE, NULL, NULL);
+
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(KeReadStateEvent(&events[0]) == FALSE);
+			Assert::IsTrue(KeReadStateEvent(&events[1]) == TRUE);
+
+			TEST_CALLBACK_WAIT(cb);
+
+			rc = KeWaitForSingleObject(thread, Executive, KernelMode, FALSE, NULL);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			ObDereferenceObject(thread);
+		}
 	};
 }
@@ -0,0 +1,129 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Fast Mutex Tests
+ */
+
+#include "stdafx.h"
+
+
+namespace DdkUnitTest
+{
+	TEST_CLASS(DdkFastMutexTest)
+	{
+		FAST_MUTEX mutex;
+		KGUARDED_MUTEX guarded;
+		EX_PUSH_LOCK pushlock;
+		bool acquired;
+
+	public:
+		TEST_METHOD_INITIALIZE(DdkFastMutexTestInit)
+		{
+			DdkThreadInit();
+			ExInitializeFastMutex(&mutex);
+			KeInitializeGuardedMutex(&guarded);
+			ExInitializePushLock(&pushlock);
+			acquired = false;
+		}
+
+		TEST_METHOD(DdkFastMutexAcquire)
+		{
+			ExAcquireFastMutex(&mutex);
+			Assert::IsTrue(KeGetCurrentIrql() == APC_LEVEL);
+			Assert::IsFalse(ExTryToAcquireFastMutex(&mutex));
+			Assert::IsTrue(KeGetCurrentIrql() == APC_LEVEL);
+
+			ExReleaseFastMutex(&mutex);
+			Assert::IsTrue(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+			Assert::IsTrue(ExTryToAcquireFastMutex(&mutex));
+			ExReleaseFastMutex(&mutex);
+		}
+
+		TEST_METHOD_CALLBACK(DdkFastMutexWaiter, PVOID Context)
+		{
+			ExAcquireFastMutex(&mutex);
+			acquired = true;
+			ExReleaseFastMutex(&mutex);
+		}
+
+		/*
+		 * A contended acquire waits, and is counted, until the release.
+		 * The mutex is held without raising the IRQL, so that the waiter
+		 * can be created at PASSIVE_LEVEL.
+		 */
+		TEST_METHOD(DdkFastMutexContention)
+		{
+			LARGE_INTEGER delay;
+			HANDLE h;
+			PVOID thread;
+			TEST_CALLBACK_INIT(cb);
+
+			delay.QuadPart = -1 * 10000I64;
+
+			KeEnterCriticalRegion();
+			ExAcquireFastMutexUnsafe(&mutex);
+
+			Assert::IsTrue(PsCreateSystemThread(&h, THREAD_ALL_ACCESS,
+				NULL, NULL, NULL, DdkFastMutexWaiter, cb) == STATUS_SUCCESS);
+			Assert::IsTrue(ObReferenceObjectByHandle(h, THREAD_ALL_ACCESS,
+				NULL, KernelMode, &thread, NULL) == STATUS_SUCCESS);
+
+			for (int i = 0; i < 5000 && !mutex.Contention; i++)
+				KeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+			Assert::IsTrue(mutex.Contention == 1);
+			Assert::IsFalse(acquired);
+			ExReleaseFastMutexUnsafe(&mutex);
+			KeLeaveCriticalRegion();
+
+			TEST_CALLBACK_WAIT(cb);
+
+			NTSTATUS rc = KeWaitForSingleObject(thread, Executive, KernelMode, FALSE, NULL);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(acquired);
+
+			ObDereferenceObject(thread);
+			ZwClose(h);
+		}
+
+		TEST_METHOD(DdkGuardedMutexAcquire)
+		{
+			KeAcquireGuardedMutex(&guarded);
+			Assert::IsTrue(KeAreAllApcsDisabled());
+			Assert::IsTrue(KeGetCurrentIrql() == PASSIVE_LEVEL);
+			Assert::IsFalse(KeTryToAcquireGuardedMutex(&guarded));
+
+			KeReleaseGuardedMutex(&guarded);
+			Assert::IsFalse(KeAreApcsDisabled());
+
+			Assert::IsTrue(KeTryToAcquireGuardedMutex(&guarded));
+			KeReleaseGuardedMutex(&guarded);
+		}
+
+		TEST_METHOD(DdkPushLockAcquire)
+		{
+			KeEnterCriticalRegion();
+			Assert::IsTrue(KeAreApcsDisabled());
+
+			ExAcquirePushLockSharedEx(&pushlock, 0);
+			ExAcquirePushLockSharedEx(&pushlock, 0);
+			ExReleasePushLockSharedEx(&pushlock, 0);
+			ExReleasePushLockSharedEx(&pushlock, 0);
+
+			ExAcquirePushLockExclusiveEx(&pushlock, 0);
+			ExReleasePushLockExclusiveEx(&pushlock, 0);
+			Assert::IsTrue(pushlock == 0);
+
+			KeLeaveCriticalRegion();
+			Assert::IsFalse(KeAreApcsDisabled());
+		}
+	};
+}
@@ -65,15 +65,16 @@ namespace DdkUnitTest
 
 		TEST_METHOD(DdkInlineTickCount)
 		{
-			for (int i = 0; true; i++) {
-				ULONGLONG x = GetTickCount64(), v;
+			ULONGLONG x1 = GetTickCount64(), x2, v1, v2;
+			ULONG inc = KeQueryTimeIncrement();
 
-				KeQueryTickCount(&v);
-				v = (v * KeQueryTimeIncrement()) / 10000;
+			KeQueryTickCount(&v1);
+			Sleep(200);
+			KeQueryTickCount(&v2);
+			x2 = GetTickCount64();
 
-				if (x == v) break;
-				Assert::IsTrue(i < 10);
-			}
+			LONGLONG d = (LONGLONG)((v2 - v1) * inc / 10000) - (LONGLONG)(x2 - x1);
+			Assert::IsTrue(_abs64(d) <= 2 * (inc / 10000 + 1));
 		}
 	};
 }
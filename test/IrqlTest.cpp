@@ -12,6 +12,7 @@
  */
 
 #include "stdafx.h"
+#include <intrin.h>
 
 
 namespace DdkUnitTest
@@ -54,6 +55,212 @@ namespace DdkUnitTest
 			Assert::IsTrue(KeGetCurrentIrql() == PASSIVE_LEVEL);
 		}
 
+#if defined(_AMD64_)
+		/*
+		 *	CR8 accesses built at run time, which patching the test module
+		 *	cannot reach, so that they always fault
+		 */
+
+		typedef ULONG64 (*PREADCR8)();
+		typedef VOID (*PWRITECR8)(ULONG64);
+
+		static BYTE *CR8Code()
+		{
+			static const BYTE code[] = {
+				0x44, 0x0f, 0x20, 0xc0, 0xc3,		// mov rax, cr8; ret
+				0x44, 0x0f, 0x22, 0xc1, 0xc3		// mov cr8, rcx; ret
+			};
+			static BYTE *pCode;
+			DWORD prot;
+
+			if (!pCode) {
+				BYTE *cp = (BYTE *)VirtualAlloc(NULL, sizeof(code), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+				if (!cp) return NULL;
+
+				memcpy(cp, code, sizeof(code));
+				VirtualProtect(cp, sizeof(code), PAGE_EXECUTE_READ, &prot);
+				FlushInstructionCache(GetCurrentProcess(), cp, sizeof(code));
+				pCode = cp;
+			}
+
+			return pCode;
+		}
+
+		TEST_METHOD(DdkIrqlCR8)
+		{
+			BYTE *pCode = CR8Code();
+			Assert::IsNotNull(pCode);
+
+			PREADCR8 pRead = (PREADCR8)pCode;
+			PWRITECR8 pWrite = (PWRITECR8)(pCode + 5);
+			KIRQL irql;
+
+			KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+			// Repeat to exercise the cached fault site, which counts each pass
+
+			for (int i = 0; i < 3; i++) {
+				LONG64 reads = DdkQueryFaultSite(pCode);
+				LONG64 writes = DdkQueryFaultSite(pCode + 5);
+
+				Assert::IsTrue((*pRead)() == DISPATCH_LEVEL);
+				(*pWrite)(APC_LEVEL);
+				Assert::IsTrue(KeGetCurrentIrql() == APC_LEVEL);
+				(*pWrite)(DISPATCH_LEVEL);
+
+				Assert::IsTrue(DdkQueryFaultSite(pCode) == reads + 1);
+				Assert::IsTrue(DdkQueryFaultSite(pCode + 5) == writes + 2);
+			}
+
+			// Compiled accesses read the IRQL whether patched or not
+
+			Assert::IsTrue(__readcr8() == DISPATCH_LEVEL);
+			KeLowerIrql(irql);
+		}
+
+		/*
+		 *	Functions with CR8 accesses to be patched, which call out so that
+		 *	they have unwind data
+		 */
+
+		static void Unwind(PCONTEXT pContext)
+		{
+			ULONG64 base, frame;
+			PVOID data;
+
+			PRUNTIME_FUNCTION pFunc = RtlLookupFunctionEntry(pContext->Rip, &base, NULL);
+			Assert::IsNotNull(pFunc);
+
+			RtlVirtualUnwind(UNW_FLAG_NHANDLER, base, pContext->Rip,
+				pFunc, pContext, &data, &frame, NULL);
+		}
+
+		__declspec(noinline) static void CaptureCaller(PCONTEXT pContext)
+		{
+			RtlCaptureContext(pContext);
+			Unwind(pContext);
+		}
+
+		__declspec(noinline) static KIRQL PatchRaise(KIRQL Irql, PCONTEXT pContext)
+		{
+			KIRQL OldIrql = (KIRQL)__readcr8();
+			__writecr8(Irql);
+			CaptureCaller(pContext);
+			return OldIrql;
+		}
+
+		__declspec(noinline) static KIRQL PatchExcept(KIRQL Irql)
+		{
+			__try {
+				RaiseException(0xe0000001, 0, 0, NULL);
+			}
+			__except (EXCEPTION_EXECUTE_HANDLER) {
+				__writecr8(Irql);
+				GetCurrentThreadId();
+			}
+
+			return (KIRQL)__readcr8();
+		}
+
+		static void PatchTestModule()
+		{
+			static bool patched = false;
+			HMODULE h;
+
+			// The stubs are kept for the lifetime of the test module
+
+			if (!patched && GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+					| GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCSTR)&PatchRaise, &h)) {
+				DdkPatchImage(h);
+				patched = true;
+			}
+		}
+
+		static bool isStub(BYTE *pAddr)
+		{
+			MEMORY_BASIC_INFORMATION mbi;
+
+			if (!VirtualQuery(pAddr, &mbi, sizeof(mbi)) || mbi.State != MEM_COMMIT
+					|| mbi.Type != MEM_PRIVATE || !(mbi.Protect & PAGE_EXECUTE_READWRITE))
+				return false;
+
+			// Stubs start with a TLS access, after a push for a write
+
+			if (pAddr[0] == 0x50 || pAddr[0] == 0x51) pAddr++;
+			return pAddr[0] == 0x65;
+		}
+
+		/*
+		 *	Check that patched code, including an __except block entered
+		 *	by the exception dispatcher, still reads and writes the IRQL
+		 */
+		TEST_METHOD(DdkIrqlPatch)
+		{
+			CONTEXT context;
+
+			PatchTestModule();
+
+			Assert::IsTrue(PatchRaise(DISPATCH_LEVEL, &context) == PASSIVE_LEVEL);
+			Assert::IsTrue(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+			Assert::IsTrue(PatchExcept(APC_LEVEL) == APC_LEVEL);
+			Assert::IsTrue(KeGetCurrentIrql() == APC_LEVEL);
+
+			KeLowerIrql(PASSIVE_LEVEL);
+		}
+
+		/*
+		 *	Check that unwinding from any stub patched into PatchRaise gives
+		 *	the same caller frame as unwinding from PatchRaise itself
+		 */
+		TEST_METHOD(DdkIrqlPatchUnwind)
+		{
+			CONTEXT context, expected;
+			ULONG64 base;
+			int count = 0;
+
+			PatchTestModule();
+			PatchRaise(PASSIVE_LEVEL, &context);
+
+			expected = context;
+			Unwind(&expected);
+
+			BYTE *pCode = (BYTE *)DdkCodeFromPointer((PVOID)&PatchRaise);
+			PRUNTIME_FUNCTION pFunc = RtlLookupFunctionEntry((ULONG64)pCode, &base, NULL);
+			Assert::IsNotNull(pFunc);
+
+			BYTE *pStart = (BYTE *)base + pFunc->BeginAddress;
+			BYTE *pEnd = (BYTE *)base + pFunc->EndAddress;
+
+			for (BYTE *cp = pStart; cp + 5 <= pEnd; cp++) {
+				if (cp[0] != 0xe9) continue;
+
+				BYTE *pStub = cp + 5 + *(LONG UNALIGNED *)&cp[1];
+				if (!isStub(pStub)) continue;
+
+				CONTEXT c = context;
+				c.Rip = (ULONG64)pStub;
+
+				// Unwind from after the push of the scratch register
+
+				if (pStub[0] == 0x50 || pStub[0] == 0x51) {
+					c.Rip++;
+					c.Rsp -= sizeof(ULONG64);
+				}
+
+				Unwind(&c);
+				Assert::IsTrue(c.Rip == expected.Rip);
+				Assert::IsTrue(c.Rsp == expected.Rsp);
+				count++;
+			}
+
+			// PatchRaise reads and writes CR8, so it must have been patched
+
+			Assert::IsTrue(count > 0);
+		}
+#endif
+
 		TEST_METHOD_ASYNC(DdkIrqlAsync)
 		{
 			KIRQL lo = (TEST_IS_ASYNC) ? APC_LEVEL : PASSIVE_LEVEL;
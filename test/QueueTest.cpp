@@ -0,0 +1,227 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Queue Tests
+ */
+
+#include "stdafx.h"
+#include <ntifs.h>
+
+
+namespace DdkUnitTest
+{
+	TEST_CLASS(DdkQueueTest)
+	{
+		LARGE_INTEGER nowait;
+		KQUEUE queue;
+		LIST_ENTRY entries[4];
+		PLIST_ENTRY removed;
+		PLIST_ENTRY removedLast;
+
+	public:
+		TEST_METHOD_INITIALIZE(DdkQueueTestInit)
+		{
+			DdkThreadInit();
+			KeInitializeQueue(&queue, 1);
+			nowait.QuadPart = 0;
+			removed = removedLast = NULL;
+		}
+
+		TEST_METHOD_CLEANUP(DdkQueueTestCleanup)
+		{
+			KeRundownQueue(&queue);
+		}
+
+		TEST_METHOD(DdkQueueInsertRemove)
+		{
+			Assert::IsTrue(KeReadStateQueue(&queue) == 0);
+			Assert::IsTrue(KeInsertQueue(&queue, &entries[0]) == 0);
+			Assert::IsTrue(KeInsertQueue(&queue, &entries[1]) == 1);
+			Assert::IsTrue(KeInsertHeadQueue(&queue, &entries[2]) == 2);
+			Assert::IsTrue(KeReadStateQueue(&queue) == 3);
+
+			Assert::IsTrue(KeRemoveQueue(&queue, KernelMode, &nowait) == &entries[2]);
+			Assert::IsTrue(KeRemoveQueue(&queue, KernelMode, &nowait) == &entries[0]);
+			Assert::IsTrue(KeRemoveQueue(&queue, KernelMode, &nowait) == &entries[1]);
+			Assert::IsTrue(KeReadStateQueue(&queue) == 0);
+
+			Assert::IsTrue(KeRemoveQueue(&queue, KernelMode, &nowait) == (PLIST_ENTRY)STATUS_TIMEOUT);
+		}
+
+		TEST_METHOD(DdkQueueRemoveBatch)
+		{
+			PLIST_ENTRY batch[4];
+
+			for (int i = 0; i < 3; i++)
+				KeInsertQueue(&queue, &entries[i]);
+
+			Assert::IsTrue(KeRemoveQueueEx(&queue, KernelMode, FALSE, &nowait, batch, 4) == 3);
+
+			for (int i = 0; i < 3; i++)
+				Assert::IsTrue(batch[i] == &entries[i]);
+
+			Assert::IsTrue(KeRemoveQueueEx(&queue, KernelMode, FALSE, &nowait, batch, 4) == 1);
+			Assert::IsTrue(batch[0] == (PLIST_ENTRY)STATUS_TIMEOUT);
+		}
+
+		TEST_METHOD(DdkQueueRundown)
+		{
+			Assert::IsTrue(KeRundownQueue(&queue) == NULL);
+
+			KeInsertQueue(&queue, &entries[0]);
+			KeInsertQueue(&queue, &entries[1]);
+
+			PLIST_ENTRY Entry = KeRundownQueue(&queue);
+
+			Assert::IsTrue(Entry == &entries[0] && Entry->Flink == &entries[1]);
+			Assert::IsTrue(KeReadStateQueue(&queue) == 0);
+		}
+
+		TEST_METHOD_CALLBACK(DdkQueueRemover, PVOID Context)
+		{
+			removed = KeRemoveQueue(&queue, KernelMode, NULL);
+		}
+
+		TEST_METHOD_CALLBACK(DdkQueueLastRemover, PVOID Context)
+		{
+			removedLast = KeRemoveQueue(&queue, KernelMode, NULL);
+		}
+
+		PVOID StartThread(PKSTART_ROUTINE StartRoutine, PVOID Context)
+		{
+			HANDLE h;
+			PVOID thread;
+
+			Assert::IsTrue(PsCreateSystemThread(&h, THREAD_ALL_ACCESS,
+				NULL, NULL, NULL, StartRoutine, Context) == STATUS_SUCCESS);
+			Assert::IsTrue(ObReferenceObjectByHandle(h, THREAD_ALL_ACCESS,
+				NULL, KernelMode, &thread, NULL) == STATUS_SUCCESS);
+
+			ZwClose(h);
+			return thread;
+		}
+
+		/*
+		 * An entry is handed to a thread already waiting on the queue
+		 */
+		TEST_METHOD(DdkQueueWaitThread)
+		{
+			LARGE_INTEGER delay;
+			HANDLE h;
+			PVOID thread;
+			TEST_CALLBACK_INIT(cb);
+
+			delay.QuadPart = -10 * 10000I64;
+
+			Assert::IsTrue(PsCreateSystemThread(&h, THREAD_ALL_ACCESS,
+				NULL, NULL, NULL, DdkQueueRemover, cb) == STATUS_SUCCESS);
+			Assert::IsTrue(ObReferenceObjectByHandle(h, THREAD_ALL_ACCESS,
+				NULL, KernelMode, &thread, NULL) == STATUS_SUCCESS);
+
+			KeDelayExecutionThread(KernelMode, FALSE, &delay);
+			KeInsertQueue(&queue, &entries[0]);
+
+			TEST_CALLBACK_WAIT(cb);
+
+			NTSTATUS rc = KeWaitForSingleObject(thread, Executive, KernelMode, FALSE, NULL);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(removed == &entries[0]);
+			Assert::IsTrue(KeReadStateQueue(&queue) == 0);
+
+			ObDereferenceObject(thread);
+			ZwClose(h);
+		}
+
+		/*
+		 * A thread that blocks in another wait gives up its place in the
+		 * queue, so that a waiting thread can take the next entry
+		 */
+		TEST_METHOD(DdkQueueBlockedThread)
+		{
+			LARGE_INTEGER timeout;
+			TEST_CALLBACK_INIT(cb);
+
+			timeout.QuadPart = -10 * 10000000I64;
+
+			KeInsertQueue(&queue, &entries[0]);
+			Assert::IsTrue(KeRemoveQueue(&queue, KernelMode, &nowait) == &entries[0]);
+
+			// This thread now fills the queue, so the entry is held back
+
+			PVOID thread = StartThread(DdkQueueRemover, cb);
+			KeInsertQueue(&queue, &entries[1]);
+			Assert::IsTrue(removed == NULL);
+
+			NTSTATUS rc = KeWaitForSingleObject(thread, Executive, KernelMode, FALSE, &timeout);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+
+			TEST_CALLBACK_WAIT(cb);
+			Assert::IsTrue(removed == &entries[1]);
+
+			ObDereferenceObject(thread);
+		}
+
+		/*
+		 * The most recent waiter takes the first entry
+		 */
+		TEST_METHOD(DdkQueueWakeLifo)
+		{
+			LARGE_INTEGER delay;
+			TEST_CALLBACK_INIT(cb1);
+			TEST_CALLBACK_INIT(cb2);
+
+			delay.QuadPart = -50 * 10000I64;
+
+			PVOID thread1 = StartThread(DdkQueueRemover, cb1);
+			KeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+			PVOID thread2 = StartThread(DdkQueueLastRemover, cb2);
+			KeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+			KeInsertQueue(&queue, &entries[0]);
+
+			TEST_CALLBACK_WAIT(cb2);
+			Assert::IsTrue(removedLast == &entries[0]);
+			Assert::IsTrue(removed == NULL);
+
+			KeInsertQueue(&queue, &entries[1]);
+
+			TEST_CALLBACK_WAIT(cb1);
+			Assert::IsTrue(removed == &entries[1]);
+
+			KeWaitForSingleObject(thread1, Executive, KernelMode, FALSE, NULL);
+			KeWaitForSingleObject(thread2, Executive, KernelMode, FALSE, NULL);
+			ObDereferenceObject(thread1);
+			ObDereferenceObject(thread2);
+		}
+
+		/*
+		 * A rundown releases a thread waiting on the queue
+		 */
+		TEST_METHOD(DdkQueueRundownWaiter)
+		{
+			LARGE_INTEGER delay;
+			TEST_CALLBACK_INIT(cb);
+
+			delay.QuadPart = -50 * 10000I64;
+
+			PVOID thread = StartThread(DdkQueueRemover, cb);
+			KeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+			Assert::IsTrue(KeRundownQueue(&queue) == NULL);
+
+			TEST_CALLBACK_WAIT(cb);
+			Assert::IsTrue(removed == (PLIST_ENTRY)STATUS_ABANDONED);
+
+			KeWaitForSingleObject(thread, Executive, KernelMode, FALSE, NULL);
+			ObDereferenceObject(thread);
+		}
+	};
+}
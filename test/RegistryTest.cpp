@@ -3226,5 +3226,30 @@ namespace DdkUnitTest
 			status = RtlDeleteRegistryValue(RTL_REGISTRY_SERVICES, L"", L"Test911");
 			Assert::AreEqual(STATUS_SUCCESS, status);
 		}
+
+		/*
+		 *	Check that a restore discards keys created since the checkpoint
+		 */
+		TEST_METHOD(DdkRegistryCheckpointRestore)
+		{
+			NTSTATUS status;
+
+			status = DdkCheckpoint();
+			Assert::AreEqual(STATUS_SUCCESS, status);
+
+			status = RtlCreateRegistryKey(RTL_REGISTRY_SERVICES, L"Checkpoint");
+			Assert::AreEqual(STATUS_SUCCESS, status);
+
+			status = DdkRestore();
+			Assert::AreEqual(STATUS_SUCCESS, status);
+
+			status = RtlCheckRegistryKey(RTL_REGISTRY_SERVICES, L"Checkpoint");
+			Assert::AreNotEqual(STATUS_SUCCESS, status);
+
+			status = RtlCheckRegistryKey(RTL_REGISTRY_SERVICES, L"Tcpip\\Parameters");
+			Assert::AreEqual(STATUS_SUCCESS, status);
+
+			DdkDiscardCheckpoint();
+		}
 	};
 }
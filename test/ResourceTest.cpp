@@ -0,0 +1,115 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Resource Tests
+ */
+
+#include "stdafx.h"
+
+
+namespace DdkUnitTest
+{
+	TEST_CLASS(DdkResourceTest)
+	{
+		ERESOURCE resource;
+		bool acquired;
+
+	public:
+		TEST_METHOD_INITIALIZE(DdkResourceTestInit)
+		{
+			DdkThreadInit();
+			ExInitializeResourceLite(&resource);
+			acquired = false;
+		}
+
+		TEST_METHOD_CLEANUP(DdkResourceTestCleanup)
+		{
+			ExDeleteResourceLite(&resource);
+		}
+
+		TEST_METHOD(DdkResourceShared)
+		{
+			Assert::IsTrue(ExAcquireResourceSharedLite(&resource, TRUE));
+			Assert::IsTrue(ExAcquireResourceSharedLite(&resource, FALSE));
+			Assert::IsTrue(ExIsResourceAcquiredSharedLite(&resource) == 2);
+			Assert::IsFalse(ExIsResourceAcquiredExclusiveLite(&resource));
+			Assert::IsFalse(ExAcquireResourceExclusiveLite(&resource, FALSE));
+
+			ExReleaseResourceLite(&resource);
+			ExReleaseResourceLite(&resource);
+			Assert::IsTrue(ExIsResourceAcquiredSharedLite(&resource) == 0);
+		}
+
+		TEST_METHOD(DdkResourceExclusive)
+		{
+			Assert::IsTrue(ExAcquireResourceExclusiveLite(&resource, TRUE));
+			Assert::IsTrue(ExAcquireResourceSharedLite(&resource, FALSE));
+			Assert::IsTrue(ExIsResourceAcquiredExclusiveLite(&resource));
+			Assert::IsTrue(ExIsResourceAcquiredSharedLite(&resource) == 2);
+
+			ExConvertExclusiveToSharedLite(&resource);
+			Assert::IsFalse(ExIsResourceAcquiredExclusiveLite(&resource));
+			Assert::IsTrue(ExIsResourceAcquiredSharedLite(&resource) == 2);
+
+			ExReleaseResourceLite(&resource);
+			ExReleaseResourceLite(&resource);
+			Assert::IsTrue(ExAcquireResourceExclusiveLite(&resource, FALSE));
+			ExReleaseResourceLite(&resource);
+		}
+
+		TEST_METHOD_CALLBACK(DdkResourceWriter, PVOID Context)
+		{
+			ExAcquireResourceExclusiveLite(&resource, TRUE);
+			acquired = true;
+			ExReleaseResourceLite(&resource);
+		}
+
+		/*
+		 * An exclusive waiter holds off new shared acquires, unless they
+		 * starve it, and is granted the resource on the last release
+		 */
+		TEST_METHOD(DdkResourceContention)
+		{
+			LARGE_INTEGER delay;
+			HANDLE h;
+			PVOID thread;
+			TEST_CALLBACK_INIT(cb);
+
+			delay.QuadPart = -1 * 10000I64;
+
+			Assert::IsTrue(ExAcquireResourceSharedLite(&resource, TRUE));
+			Assert::IsTrue(PsCreateSystemThread(&h, THREAD_ALL_ACCESS,
+				NULL, NULL, NULL, DdkResourceWriter, cb) == STATUS_SUCCESS);
+			Assert::IsTrue(ObReferenceObjectByHandle(h, THREAD_ALL_ACCESS,
+				NULL, KernelMode, &thread, NULL) == STATUS_SUCCESS);
+
+			for (int i = 0; i < 5000 && !ExGetExclusiveWaiterCount(&resource); i++)
+				KeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+			Assert::IsTrue(ExGetExclusiveWaiterCount(&resource) == 1);
+			Assert::IsFalse(ExAcquireSharedWaitForExclusive(&resource, FALSE));
+			Assert::IsTrue(ExAcquireResourceSharedLite(&resource, FALSE));
+			Assert::IsTrue(ExAcquireSharedStarveExclusive(&resource, FALSE));
+
+			for (int i = 0; i < 3; i++)
+				ExReleaseResourceLite(&resource);
+
+			TEST_CALLBACK_WAIT(cb);
+
+			NTSTATUS rc = KeWaitForSingleObject(thread, Executive, KernelMode, FALSE, NULL);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(acquired);
+			Assert::IsTrue(DdkGetResourceContention(&resource) == 1);
+
+			ObDereferenceObject(thread);
+			ZwClose(h);
+		}
+	};
+}
@@ -0,0 +1,115 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2026, rtegrity ltd. All rights reserved.
+ *
+ *  Details about the Windows Kernel API are based on the documentation
+ *  available at https://learn.microsoft.com/en-us/windows-hardware/drivers/
+ */
+
+/*
+ *	Rundown Protection Tests
+ */
+
+#include "stdafx.h"
+
+
+namespace DdkUnitTest
+{
+	TEST_CLASS(DdkRundownTest)
+	{
+		EX_RUNDOWN_REF rundown;
+		volatile bool rundowndone;
+
+	public:
+		TEST_METHOD_INITIALIZE(DdkRundownTestInit)
+		{
+			DdkThreadInit();
+			ExInitializeRundownProtection(&rundown);
+			rundowndone = false;
+		}
+
+		TEST_METHOD(DdkRundownAcquire)
+		{
+			Assert::IsTrue(ExAcquireRundownProtection(&rundown));
+			Assert::IsTrue(ExAcquireRundownProtectionEx(&rundown, 2));
+			ExReleaseRundownProtectionEx(&rundown, 2);
+			ExReleaseRundownProtection(&rundown);
+
+			ExWaitForRundownProtectionRelease(&rundown);
+			Assert::IsFalse(ExAcquireRundownProtection(&rundown));
+
+			ExReInitializeRundownProtection(&rundown);
+			Assert::IsTrue(ExAcquireRundownProtection(&rundown));
+			ExReleaseRundownProtection(&rundown);
+		}
+
+		TEST_METHOD_CALLBACK(DdkRundownWaiter, PVOID Context)
+		{
+			ExWaitForRundownProtectionRelease(&rundown);
+			rundowndone = true;
+		}
+
+		/*
+		 * Rundown refuses new references and waits for the last release
+		 */
+		TEST_METHOD(DdkRundownWait)
+		{
+			LARGE_INTEGER delay;
+			HANDLE h;
+			PVOID thread;
+			TEST_CALLBACK_INIT(cb);
+
+			delay.QuadPart = -1 * 10000I64;
+
+			Assert::IsTrue(ExAcquireRundownProtection(&rundown));
+			Assert::IsTrue(PsCreateSystemThread(&h, THREAD_ALL_ACCESS,
+				NULL, NULL, NULL, DdkRundownWaiter, cb) == STATUS_SUCCESS);
+			Assert::IsTrue(ObReferenceObjectByHandle(h, THREAD_ALL_ACCESS,
+				NULL, KernelMode, &thread, NULL) == STATUS_SUCCESS);
+
+			for (int i = 0; i < 5000 && ExAcquireRundownProtection(&rundown); i++) {
+				ExReleaseRundownProtection(&rundown);
+				KeDelayExecutionThread(KernelMode, FALSE, &delay);
+			}
+
+			Assert::IsFalse(ExAcquireRundownProtection(&rundown));
+			Assert::IsFalse(rundowndone);
+			ExReleaseRundownProtection(&rundown);
+
+			TEST_CALLBACK_WAIT(cb);
+
+			NTSTATUS rc = KeWaitForSingleObject(thread, Executive, KernelMode, FALSE, NULL);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(rundowndone);
+
+			ObDereferenceObject(thread);
+			ZwClose(h);
+		}
+
+		TEST_METHOD(DdkRundownCacheAware)
+		{
+			PEX_RUNDOWN_REF_CACHE_AWARE ref = ExAllocateCacheAwareRundownProtection(NonPagedPool, 'nuRD');
+
+			Assert::IsNotNull(ref);
+
+			for (int i = 0; i < 3; i++)
+				Assert::IsTrue(ExAcquireRundownProtectionCacheAware(ref));
+
+			Assert::IsTrue(ExAcquireRundownProtectionCacheAwareEx(ref, 2));
+			ExReleaseRundownProtectionCacheAwareEx(ref, 2);
+
+			for (int i = 0; i < 3; i++)
+				ExReleaseRundownProtectionCacheAware(ref);
+
+			ExWaitForRundownProtectionReleaseCacheAware(ref);
+			Assert::IsFalse(ExAcquireRundownProtectionCacheAware(ref));
+
+			ExReInitializeRundownProtectionCacheAware(ref);
+			Assert::IsTrue(ExAcquireRundownProtectionCacheAware(ref));
+			ExReleaseRundownProtectionCacheAware(ref);
+
+			ExFreeCacheAwareRundownProtection(ref);
+		}
+	};
+}
@@ -164,6 +164,83 @@ namespace DdkUnitTest
 			Assert::IsTrue(count && asynccount && tryfail && tryok);
 		}
 
+		TEST_METHOD(DdkSpinLockMultiParked)
+		{
+			DdkSetSpinLimit(64);
+			TEST_ASYNC_START(id, DdkSpinLockAsync);
+			DdkSpinLockAsync();
+			TEST_ASYNC_WAIT(id);
+			DdkSetSpinLimit(0);
+			Assert::IsTrue(count && asynccount && tryfail && tryok);
+		}
+
+		TEST_METHOD(DdkSpinLockTest)
+		{
+			KIRQL irql;
+			Assert::IsTrue(KeTestSpinLock(&lock) != 0);
+			KeAcquireSpinLock(&lock, &irql);
+			Assert::IsTrue(KeTestSpinLock(&lock) == 0);
+			KeReleaseSpinLock(&lock, irql);
+			Assert::IsTrue(KeTestSpinLock(&lock) != 0);
+		}
+
+		TEST_METHOD_ASYNC(DdkSpinLockQueuedAsync)
+		{
+			for (int v, i = 0, last = 0; i < 1000000; i++) {
+				KLOCK_QUEUE_HANDLE h;
+				KIRQL irql;
+
+				// Mix queued and plain acquires of the same lock
+
+				bool queued = ((i % 4) != 0);
+
+				if (queued) KeAcquireInStackQueuedSpinLock(&lock, &h);
+				else KeAcquireSpinLock(&lock, &irql);
+
+				if (TEST_IS_ASYNC) {
+					v = (value & 0xffff);
+					value = (value & 0xffff0000) + (i & 0xffff);
+					asynccount++;
+				} else {
+					v = (value >> 16) & 0xffff;
+					value = (value & 0xffff) + (i << 16);
+					count++;
+				}
+
+				if (queued) KeReleaseInStackQueuedSpinLock(&h);
+				else KeReleaseSpinLock(&lock, irql);
+
+				Assert::IsTrue(v == last);
+				last = (i & 0xffff);
+			}
+		}
+
+		TEST_METHOD(DdkSpinLockQueuedMulti)
+		{
+			TEST_ASYNC_START(id, DdkSpinLockQueuedAsync);
+			DdkSpinLockQueuedAsync();
+			TEST_ASYNC_WAIT(id);
+			Assert::IsTrue(count && asynccount);
+			Assert::IsTrue(KeTestSpinLock(&lock) != 0);
+		}
+
+		TEST_METHOD(DdkSpinLockStats)
+		{
+			ULONG64 acquires, contended;
+
+			DdkEnableLockStats(TRUE);
+			TEST_ASYNC_START(id, DdkSpinLockAsync);
+			DdkSpinLockAsync();
+			TEST_ASYNC_WAIT(id);
+			DdkReportLockStats();
+			DdkEnableLockStats(FALSE);
+			Assert::IsTrue(count && asynccount);
+
+			Assert::IsTrue(DdkQueryLockStats(&lock, &acquires, &contended, NULL, NULL));
+			Assert::IsTrue(acquires >= (ULONG64)(count + asynccount));
+			Assert::IsTrue(contended > 0 && contended <= acquires);
+		}
+
 		TEST_METHOD(DdkSpinLockSharedAcquire)
 		{
 			KIRQL irql = ExAcquireSpinLockShared(&xlock);
@@ -216,6 +293,24 @@ namespace DdkUnitTest
 			KeLowerIrql(irql);
 		}
 
+		TEST_METHOD(DdkSpinLockSharedConvert)
+		{
+			KIRQL irql = ExAcquireSpinLockShared(&xlock);
+			Assert::IsTrue(ExTryConvertSharedSpinLockExclusive(&xlock) != FALSE);
+			ExReleaseSpinLockExclusive(&xlock, irql);
+			Assert::IsTrue(xlock == 0);
+		}
+
+		TEST_METHOD(DdkSpinLockSharedConvertBusy)
+		{
+			KIRQL irql = ExAcquireSpinLockShared(&xlock);
+			ExAcquireSpinLockSharedAtDpcLevel(&xlock);
+			Assert::IsTrue(ExTryConvertSharedSpinLockExclusive(&xlock) == FALSE);
+			ExReleaseSpinLockSharedFromDpcLevel(&xlock);
+			ExReleaseSpinLockShared(&xlock, irql);
+			Assert::IsTrue(xlock == 0);
+		}
+
 		TEST_METHOD_ASYNC(DdkSpinLockSharedAsync)
 		{
 			for (int v, i = 0, last = 0; i < 1000000; i++) {
@@ -24,17 +24,27 @@ namespace DdkUnitTest
 			DdkThreadInit();
 		}
 
+		TEST_METHOD_CLEANUP(DdkTimeTestCleanup)
+		{
+			DdkEnableVirtualTime(FALSE);
+		}
+
+		/*
+		 * The tick count keeps pace with the host, less any offset left by
+		 * virtual time
+		 */
 		TEST_METHOD(DdkTimeTickCount)
 		{
-			for (int i = 0; true; i++) {
-				ULONGLONG x = GetTickCount64(), v;
+			ULONGLONG x1 = GetTickCount64(), x2, v1, v2;
+			ULONG inc = KeQueryTimeIncrement();
 
-				KeQueryTickCount(&v);
-				v = (v * KeQueryTimeIncrement()) / 10000;
+			KeQueryTickCount(&v1);
+			Sleep(200);
+			KeQueryTickCount(&v2);
+			x2 = GetTickCount64();
 
-				if (x == v) break;
-				Assert::IsTrue(i < 10);
-			}
+			LONGLONG d = (LONGLONG)((v2 - v1) * inc / 10000) - (LONGLONG)(x2 - x1);
+			Assert::IsTrue(_abs64(d) <= 2 * (inc / 10000 + 1));
 		}
 
 		/*
@@ -144,5 +154,85 @@ namespace DdkUnitTest
 			Assert::IsTrue(CompareFileTime(&kernelTime1, &kernelTime2) <= 0);
 		}
 
+		/*
+		 * Timers and timed waits follow virtual time
+		 */
+		TEST_METHOD(DdkTimeVirtual)
+		{
+			const LONGLONG sec = 10000000I64;
+			LARGE_INTEGER start, end, due;
+			KTIMER timer;
+			KEVENT event;
+
+			DdkEnableVirtualTime(TRUE);
+			KeQuerySystemTime(&start);
+
+			KeInitializeTimer(&timer);
+			due.QuadPart = -10 * sec;
+			KeSetTimer(&timer, due, NULL);
+
+			DdkAdvanceVirtualTime(5 * sec);
+			Assert::IsTrue(KeReadStateTimer(&timer) == FALSE);
+
+			DdkAdvanceVirtualTime(5 * sec);
+			Assert::IsTrue(KeReadStateTimer(&timer) == TRUE);
+
+			KeQuerySystemTime(&end);
+			Assert::IsTrue(end.QuadPart - start.QuadPart == 10 * sec);
+
+			// The clock moves on by itself once the wait is idle
+
+			DdkEnableVirtualTime(TRUE, TRUE);
+			KeInitializeEvent(&event, NotificationEvent, FALSE);
+			due.QuadPart = -3600 * sec;
+
+			Assert::IsTrue(KeWaitForSingleObject(&event, Executive,
+				KernelMode, FALSE, &due) == STATUS_TIMEOUT);
+
+			KeQuerySystemTime(&start);
+			Assert::IsTrue(start.QuadPart - end.QuadPart >= 3600 * sec);
+
+			// Leaving virtual time does not take the clock back
+
+			ULONGLONG tick1, tick2;
+			KeQueryTickCount(&tick1);
+
+			DdkEnableVirtualTime(FALSE);
+
+			KeQuerySystemTime(&end);
+			KeQueryTickCount(&tick2);
+			Assert::IsTrue(end.QuadPart >= start.QuadPart);
+			Assert::IsTrue(tick2 >= tick1);
+		}
+
+		/*
+		 * The performance counter and precise interrupt time agree
+		 */
+		TEST_METHOD(DdkTimePerformanceCounter)
+		{
+			LARGE_INTEGER f, c1, c2;
+			ULONG64 q, q1, q2, t1, t2, u1, u2;
+
+			c1 = KeQueryPerformanceCounter(&f);
+			t1 = KeQueryInterruptTimePrecise(&q1);
+			u1 = KeQueryUnbiasedInterruptTimePrecise(&q);
+
+			Sleep(100);
+
+			u2 = KeQueryUnbiasedInterruptTime();
+			t2 = KeQueryInterruptTimePrecise(&q2);
+			c2 = KeQueryPerformanceCounter(NULL);
+
+			Assert::IsTrue(f.QuadPart > 0);
+			Assert::IsTrue(c1.QuadPart <= (LONGLONG)q1 && q1 <= q && q <= q2 && q2 <= (ULONG64)c2.QuadPart);
+			Assert::IsTrue(u2 >= u1 + 90 * 10000);
+
+			// Elapsed counter and interrupt time agree to within 1ms
+
+			LONGLONG elapsed = (LONGLONG)(q2 - q1) * 10000000 / f.QuadPart;
+			Assert::IsTrue(_abs64(elapsed - (LONGLONG)(t2 - t1)) < 10000);
+			Assert::IsTrue(t2 - t1 >= 90 * 10000);
+		}
+
 	};
 }
@@ -16,6 +16,22 @@
 
 namespace DdkUnitTest
 {
+	static KEVENT extimerdone, extimerdeleted;
+	static volatile LONG extimercount;
+
+	static VOID DdkExTimerCount(PEX_TIMER Timer, PVOID Context)
+	{
+		Assert::IsTrue(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+		if (InterlockedIncrement(&extimercount) == (LONG)(LONG_PTR)Context)
+			KeSetEvent(&extimerdone, IO_NO_INCREMENT, FALSE);
+	}
+
+	static VOID DdkExTimerDeleted(PVOID Context)
+	{
+		KeSetEvent(&extimerdeleted, IO_NO_INCREMENT, FALSE);
+	}
+
 	TEST_CLASS(DdkTimerTest)
 	{
 		KTIMER timer;
@@ -113,6 +129,59 @@ namespace DdkUnitTest
 			Assert::IsTrue(KeReadStateTimer(&timer) == FALSE);
 		}
 
+		/*
+		 *	Wait on a timer on the stack and reuse its memory as soon as the
+		 *	wait returns. Nothing may write to the timer once it is signalled.
+		 */
+		TEST_METHOD(DdkTimerStackFree)
+		{
+			LARGE_INTEGER due, stall;
+
+			due.QuadPart = -1 * msec;
+			stall.QuadPart = -2 * msec;
+
+			for (int i = 0; i < 50; i++) {
+				KTIMER stacktimer;
+				volatile UCHAR *cp = (volatile UCHAR *)&stacktimer;
+
+				KeInitializeTimerEx(&stacktimer, SynchronizationTimer);
+				Assert::IsTrue(KeSetTimerEx(&stacktimer, due, 0, NULL) == FALSE);
+				Assert::IsTrue(KeWaitForSingleObject(&stacktimer, Executive, KernelMode, FALSE, &maxTime) == STATUS_SUCCESS);
+
+				memset((PVOID)cp, 0xcc, sizeof(stacktimer));
+				KeDelayExecutionThread(KernelMode, FALSE, &stall);
+
+				for (size_t j = 0; j < sizeof(stacktimer); j++)
+					Assert::IsTrue(cp[j] == 0xcc);
+			}
+		}
+
+		/*
+		 *	Arm, re-arm and cancel many timers, none of which should block
+		 */
+		TEST_METHOD(DdkTimerManyCancel)
+		{
+			const int TimerCount = 1000;
+			KTIMER *timers = (KTIMER *)calloc(TimerCount, sizeof(KTIMER));
+
+			Assert::IsTrue(timers != NULL);
+
+			for (int i = 0; i < TimerCount; i++) {
+				KeInitializeTimer(&timers[i]);
+				Assert::IsTrue(KeSetTimer(&timers[i], maxTime, NULL) == FALSE);
+			}
+
+			for (int i = 0; i < TimerCount; i++)
+				Assert::IsTrue(KeSetTimer(&timers[i], maxTime, NULL) == TRUE);
+
+			for (int i = 0; i < TimerCount; i++) {
+				Assert::IsTrue(KeCancelTimer(&timers[i]) == TRUE);
+				Assert::IsTrue(KeReadStateTimer(&timers[i]) == FALSE);
+			}
+
+			free(timers);
+		}
+
 		TEST_METHOD_CALLBACK(DdkTimerCallback, PRKDPC Dpc,
 			PVOID Context, PVOID Arg1, PVOID Arg2)
 		{
@@ -229,5 +298,56 @@ namespace DdkUnitTest
 			Assert::IsTrue(KeReadStateTimer(&timer) == TRUE);
 			Assert::IsTrue(KeCancelTimer(&timer) == FALSE);
 		}
+
+		/*
+		 *	Run a high resolution periodic timer at 250us, then cancel it
+		 *	and delete it without waiting.
+		 */
+		TEST_METHOD(DdkTimerExHighResolution)
+		{
+			const int Expiries = 20;
+			EXT_DELETE_PARAMETERS params = { 0, 0, DdkExTimerDeleted, NULL };
+			PEX_TIMER extimer = ExAllocateTimer(DdkExTimerCount,
+				(PVOID)(LONG_PTR)Expiries, EX_TIMER_HIGH_RESOLUTION);
+
+			Assert::IsTrue(extimer != NULL);
+
+			extimercount = 0;
+			KeInitializeEvent(&extimerdone, NotificationEvent, FALSE);
+			KeInitializeEvent(&extimerdeleted, NotificationEvent, FALSE);
+
+			Assert::IsTrue(ExSetTimer(extimer, -2500, 2500, NULL) == FALSE);
+			Assert::IsTrue(KeWaitForSingleObject(&extimerdone, Executive, KernelMode, FALSE, &maxTime) == STATUS_SUCCESS);
+			Assert::IsTrue(CheckTime(Expiries * 2500));
+
+			Assert::IsTrue(ExCancelTimer(extimer, NULL) == TRUE);
+			Assert::IsTrue(ExCancelTimer(extimer, NULL) == FALSE);
+
+			Assert::IsTrue(ExDeleteTimer(extimer, TRUE, FALSE, &params) == FALSE);
+			Assert::IsTrue(KeWaitForSingleObject(&extimerdeleted, Executive, KernelMode, FALSE, &maxTime) == STATUS_SUCCESS);
+		}
+
+		/*
+		 *	Delete a one-shot timer without cancelling it and wait, which
+		 *	returns once the callback has run and the timer is freed.
+		 */
+		TEST_METHOD(DdkTimerExDeleteWait)
+		{
+			EXT_DELETE_PARAMETERS params = { 0, 0, DdkExTimerDeleted, NULL };
+			PEX_TIMER extimer = ExAllocateTimer(DdkExTimerCount, (PVOID)1, 0);
+			LARGE_INTEGER zero = { 0 };
+
+			Assert::IsTrue(extimer != NULL);
+
+			extimercount = 0;
+			KeInitializeEvent(&extimerdone, NotificationEvent, FALSE);
+			KeInitializeEvent(&extimerdeleted, NotificationEvent, FALSE);
+
+			Assert::IsTrue(ExSetTimer(extimer, -20 * msec, 0, NULL) == FALSE);
+			Assert::IsTrue(ExDeleteTimer(extimer, FALSE, TRUE, &params) == FALSE);
+
+			Assert::IsTrue(extimercount == 1);
+			Assert::IsTrue(KeWaitForSingleObject(&extimerdeleted, Executive, KernelMode, FALSE, &zero) == STATUS_SUCCESS);
+		}
 	};
 }
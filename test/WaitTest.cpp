@@ -18,6 +18,11 @@ namespace DdkUnitTest
 	TEST_CLASS(DdkWaitTest)
 	{
 		const static LONG nTicks = 10;
+		const static int nWaiters = 4;
+
+		KSEMAPHORE semaphore;
+		KEVENT idle;
+		volatile LONG acquired;
 
 		TEST_METHOD_INITIALIZE(DdkWaitTestInit)
 		{
@@ -52,5 +57,147 @@ namespace DdkUnitTest
 			Assert::IsTrue(NT_SUCCESS(rc));
 			Assert::IsTrue(end.QuadPart - begin.QuadPart >= nTicks - 1);
 		}
+
+		/*
+		 * Wait on more objects than MAXIMUM_WAIT_OBJECTS with a wait block array
+		 */
+		TEST_METHOD(DdkWaitManyObjects)
+		{
+			static const int count = 4 * MAXIMUM_WAIT_OBJECTS;
+			static KEVENT events[count];
+			static KWAIT_BLOCK blocks[count];
+			static PVOID objects[count];
+			LARGE_INTEGER timeout;
+			NTSTATUS rc;
+
+			timeout.QuadPart = -10 * 10000I64;
+
+			for (int i = 0; i < count; i++) {
+				KeInitializeEvent(&events[i], SynchronizationEvent, FALSE);
+				objects[i] = &events[i];
+			}
+
+			KeSetEvent(&events[count - 10], IO_NO_INCREMENT, FALSE);
+
+			rc = KeWaitForMultipleObjects(count, objects, WaitAny,
+				Executive, KernelMode, FALSE, &timeout, blocks);
+
+			Assert::IsTrue(rc == STATUS_WAIT_0 + count - 10);
+			Assert::IsTrue(KeReadStateEvent(&events[count - 10]) == FALSE);
+
+			for (int i = 1; i < count; i++)
+				KeSetEvent(&events[i], IO_NO_INCREMENT, FALSE);
+
+			rc = KeWaitForMultipleObjects(count, objects, WaitAll,
+				Executive, KernelMode, FALSE, &timeout, blocks);
+
+			Assert::IsTrue(rc == STATUS_TIMEOUT);
+			Assert::IsTrue(KeReadStateEvent(&events[1]) == TRUE);
+
+			KeSetEvent(&events[0], IO_NO_INCREMENT, FALSE);
+
+			rc = KeWaitForMultipleObjects(count, objects, WaitAll,
+				Executive, KernelMode, FALSE, &timeout, blocks);
+
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(KeReadStateEvent(&events[1]) == FALSE);
+		}
+
+		TEST_METHOD_CALLBACK(DdkWaitAcquirer, PVOID Context)
+		{
+			PVOID objects[2] = { &idle, &semaphore };
+
+			NTSTATUS rc = KeWaitForMultipleObjects(2, objects, WaitAny,
+				Executive, KernelMode, FALSE, NULL, NULL);
+
+			Assert::IsTrue(rc == STATUS_WAIT_1);
+			InterlockedIncrement(&acquired);
+		}
+
+		/*
+		 * Each unit released wakes a waiter of its own
+		 */
+		TEST_METHOD(DdkWaitWakeOne)
+		{
+			LARGE_INTEGER delay;
+			HANDLE h;
+			TEST_CALLBACK_INIT_VEC(cb, nWaiters);
+
+			delay.QuadPart = -10 * 10000I64;
+			acquired = 0;
+
+			KeInitializeSemaphore(&semaphore, 0, MAXLONG);
+			KeInitializeEvent(&idle, NotificationEvent, FALSE);
+
+			for (int i = 0; i < nWaiters; i++) {
+				Assert::IsTrue(PsCreateSystemThread(&h, THREAD_ALL_ACCESS,
+					NULL, NULL, NULL, DdkWaitAcquirer, &cb[i]) == STATUS_SUCCESS);
+				TEST_CALLBACK_STARTED(cb[i]);
+				ZwClose(h);
+			}
+
+			KeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+			for (int i = 0; i < nWaiters; i++)
+				KeReleaseSemaphore(&semaphore, IO_NO_INCREMENT, 1, FALSE);
+
+			TEST_CALLBACK_WAIT_VEC(cb);
+
+			Assert::IsTrue(acquired == nWaiters);
+			Assert::IsTrue(KeReadStateSemaphore(&semaphore) == 0);
+		}
+
+		static VOID CALLBACK DdkWaitApc(ULONG_PTR Param)
+		{
+			InterlockedIncrement((LONG *)Param);
+		}
+
+		/*
+		 * An APC ends an alertable wait, but not one that is not alertable
+		 */
+		TEST_METHOD(DdkWaitAlertable)
+		{
+			LARGE_INTEGER timeout;
+			volatile LONG count = 0;
+			KEVENT event;
+
+			timeout.QuadPart = -10 * 10000I64;
+			KeInitializeEvent(&event, NotificationEvent, FALSE);
+
+			QueueUserAPC(DdkWaitApc, GetCurrentThread(), (ULONG_PTR)&count);
+
+			NTSTATUS rc = KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, &timeout);
+			Assert::IsTrue(rc == STATUS_TIMEOUT && count == 0);
+
+			rc = KeWaitForSingleObject(&event, Executive, KernelMode, TRUE, &timeout);
+			Assert::IsTrue(rc == STATUS_ALERTED && count == 1);
+
+			rc = KeWaitForSingleObject(&event, Executive, KernelMode, TRUE, &timeout);
+			Assert::IsTrue(rc == STATUS_TIMEOUT);
+		}
+
+		/*
+		 * A queue is signalled while it holds entries
+		 */
+		TEST_METHOD(DdkWaitQueueObject)
+		{
+			LARGE_INTEGER timeout;
+			LIST_ENTRY entry;
+			KQUEUE queue;
+
+			timeout.QuadPart = -10 * 10000I64;
+			KeInitializeQueue(&queue, 0);
+
+			NTSTATUS rc = KeWaitForSingleObject(&queue, Executive, KernelMode, FALSE, &timeout);
+			Assert::IsTrue(rc == STATUS_TIMEOUT);
+
+			KeInsertQueue(&queue, &entry);
+
+			rc = KeWaitForSingleObject(&queue, Executive, KernelMode, FALSE, &timeout);
+			Assert::IsTrue(rc == STATUS_SUCCESS);
+			Assert::IsTrue(KeReadStateQueue(&queue) == 1);
+
+			Assert::IsTrue(KeRundownQueue(&queue) == &entry);
+		}
 	};
 }
\ No newline at end of file
@@ -29,6 +29,7 @@ namespace DdkUnitTest
 		volatile LONG count;
 		volatile LONG blocked;
 		volatile LONG waiting;
+		KEVENT event;
 
 		char DriverName[100];
 
@@ -53,6 +54,7 @@ namespace DdkUnitTest
 			count = 0;
 			blocked = 0;
 			waiting = 0;
+			KeInitializeEvent(&event, NotificationEvent, FALSE);
 
 			NTSTATUS rc = DdkInitDriver(DriverName, DriverEntry);
 			Assert::IsTrue(rc == STATUS_SUCCESS);
@@ -81,9 +83,11 @@ namespace DdkUnitTest
 
 		TEST_METHOD_CALLBACK(DdkWorkItemProc, PDEVICE_OBJECT DeviceObject, PVOID Context)
 		{
+			// Only a Ke wait gives up the worker's place in the queue
+
 			if (blocked) {
 				InterlockedIncrement(&waiting);
-				while (blocked) Sleep(10);
+				KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
 			}
 
 			InterlockedIncrement(&count);
@@ -93,6 +97,17 @@ namespace DdkUnitTest
 		{
 			InterlockedIncrement(&count);
 		}
+
+		TEST_METHOD_CALLBACK(DdkWorkQueueProc, PVOID Context)
+		{
+			InterlockedIncrement(&count);
+		}
+
+		TEST_METHOD_CALLBACK(DdkWorkQueueBlock, PVOID Context)
+		{
+			KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+			InterlockedIncrement(&count);
+		}
 	
 		TEST_METHOD(DdkWorkItemInitialize)
 		{
@@ -156,13 +171,63 @@ namespace DdkUnitTest
 				TEST_CALLBACK_STARTED(id[i]);
 			}
 
-			Sleep(20);
-			InterlockedExchange(&blocked, 0);
+			// Blocked workers are replaced, so more than one item runs
+			// at once, even with a single processor
+
+			for (int i = 0; waiting < 2 && i < 500; i++) Sleep(10);
+
+			KeSetEvent(&event, IO_NO_INCREMENT, FALSE);
 
 			TEST_CALLBACK_WAIT_VEC(id);
 
 			Assert::IsTrue(waiting > 1);
 			Assert::IsTrue(count == nvec);
 		}
+
+		TEST_METHOD(DdkWorkQueueItem)
+		{
+			WORK_QUEUE_ITEM item;
+			ULONG threads;
+
+			TEST_CALLBACK_INIT(id);
+			ExInitializeWorkItem(&item, DdkWorkQueueProc, id);
+			ExQueueWorkItem(&item, CriticalWorkQueue);
+			TEST_CALLBACK_WAIT(id);
+			Assert::IsTrue(count == 1);
+
+			Assert::IsTrue(DdkQueryWorkQueue(CriticalWorkQueue, NULL, NULL, &threads, NULL));
+			Assert::IsTrue(threads >= 1);
+			Assert::IsFalse(DdkQueryWorkQueue(MaximumWorkQueue, NULL, NULL, NULL, NULL));
+
+			Assert::IsTrue(DdkSetWorkQueue(MaximumWorkQueue, 1, 1, 12) == STATUS_INVALID_PARAMETER);
+			Assert::IsTrue(DdkSetWorkQueue(DelayedWorkQueue, 2, 1, 12) == STATUS_INVALID_PARAMETER);
+		}
+
+		/*
+		 * A worker that blocks lets another worker take the next item
+		 */
+		TEST_METHOD(DdkWorkQueueBlocked)
+		{
+			WORK_QUEUE_ITEM item[2];
+			ULONG threads;
+
+			TEST_CALLBACK_INIT(blocker);
+			TEST_CALLBACK_INIT(id);
+
+			ExInitializeWorkItem(&item[0], DdkWorkQueueBlock, blocker);
+			ExInitializeWorkItem(&item[1], DdkWorkQueueProc, id);
+			ExQueueWorkItem(&item[0], HyperCriticalWorkQueue);
+			ExQueueWorkItem(&item[1], HyperCriticalWorkQueue);
+
+			TEST_CALLBACK_WAIT(id);
+			Assert::IsTrue(count == 1);
+
+			Assert::IsTrue(DdkQueryWorkQueue(HyperCriticalWorkQueue, NULL, NULL, &threads, NULL));
+			Assert::IsTrue(threads >= 2);
+
+			KeSetEvent(&event, IO_NO_INCREMENT, FALSE);
+			TEST_CALLBACK_WAIT(blocker);
+			Assert::IsTrue(count == 2);
+		}
 	};
 }